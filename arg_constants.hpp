@@ -0,0 +1,283 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include <cstdint>
+#include <cstring>
+
+/// Named constants for system call arguments, so text policies can say PROT_EXEC instead of 0x4.
+/// Like the system call names, the values are those of the architecture this is compiled for.
+/// C++ code uses the macros themselves.
+///
+/// Only flags that are bits of their own make sense with `has` and `lacks`: O_RDONLY is 0, and
+/// the access mode is tested as `(arg(N) & O_ACCMODE) == O_RDONLY`.
+
+namespace seccomp {
+
+    struct ArgConstant {
+        char const *name;
+        uint64_t value;
+    };
+
+    static ArgConstant const arg_constants[] = {
+        // open(2) flags, from <fcntl.h>
+#ifdef O_RDONLY
+        { "O_RDONLY", uint64_t(O_RDONLY) },
+#endif
+#ifdef O_WRONLY
+        { "O_WRONLY", uint64_t(O_WRONLY) },
+#endif
+#ifdef O_RDWR
+        { "O_RDWR", uint64_t(O_RDWR) },
+#endif
+#ifdef O_ACCMODE
+        { "O_ACCMODE", uint64_t(O_ACCMODE) },
+#endif
+#ifdef O_CREAT
+        { "O_CREAT", uint64_t(O_CREAT) },
+#endif
+#ifdef O_EXCL
+        { "O_EXCL", uint64_t(O_EXCL) },
+#endif
+#ifdef O_NOCTTY
+        { "O_NOCTTY", uint64_t(O_NOCTTY) },
+#endif
+#ifdef O_TRUNC
+        { "O_TRUNC", uint64_t(O_TRUNC) },
+#endif
+#ifdef O_APPEND
+        { "O_APPEND", uint64_t(O_APPEND) },
+#endif
+#ifdef O_NONBLOCK
+        { "O_NONBLOCK", uint64_t(O_NONBLOCK) },
+#endif
+#ifdef O_DSYNC
+        { "O_DSYNC", uint64_t(O_DSYNC) },
+#endif
+#ifdef O_SYNC
+        { "O_SYNC", uint64_t(O_SYNC) },
+#endif
+#ifdef O_ASYNC
+        { "O_ASYNC", uint64_t(O_ASYNC) },
+#endif
+#ifdef O_DIRECT
+        { "O_DIRECT", uint64_t(O_DIRECT) },
+#endif
+#ifdef O_DIRECTORY
+        { "O_DIRECTORY", uint64_t(O_DIRECTORY) },
+#endif
+#ifdef O_NOFOLLOW
+        { "O_NOFOLLOW", uint64_t(O_NOFOLLOW) },
+#endif
+#ifdef O_NOATIME
+        { "O_NOATIME", uint64_t(O_NOATIME) },
+#endif
+#ifdef O_CLOEXEC
+        { "O_CLOEXEC", uint64_t(O_CLOEXEC) },
+#endif
+#ifdef O_PATH
+        { "O_PATH", uint64_t(O_PATH) },
+#endif
+#ifdef O_TMPFILE
+        { "O_TMPFILE", uint64_t(O_TMPFILE) },
+#endif
+
+        // mmap(2) protections and flags, from <sys/mman.h>
+#ifdef PROT_NONE
+        { "PROT_NONE", uint64_t(PROT_NONE) },
+#endif
+#ifdef PROT_READ
+        { "PROT_READ", uint64_t(PROT_READ) },
+#endif
+#ifdef PROT_WRITE
+        { "PROT_WRITE", uint64_t(PROT_WRITE) },
+#endif
+#ifdef PROT_EXEC
+        { "PROT_EXEC", uint64_t(PROT_EXEC) },
+#endif
+#ifdef PROT_GROWSDOWN
+        { "PROT_GROWSDOWN", uint64_t(PROT_GROWSDOWN) },
+#endif
+#ifdef PROT_GROWSUP
+        { "PROT_GROWSUP", uint64_t(PROT_GROWSUP) },
+#endif
+#ifdef MAP_SHARED
+        { "MAP_SHARED", uint64_t(MAP_SHARED) },
+#endif
+#ifdef MAP_PRIVATE
+        { "MAP_PRIVATE", uint64_t(MAP_PRIVATE) },
+#endif
+#ifdef MAP_SHARED_VALIDATE
+        { "MAP_SHARED_VALIDATE", uint64_t(MAP_SHARED_VALIDATE) },
+#endif
+#ifdef MAP_FIXED
+        { "MAP_FIXED", uint64_t(MAP_FIXED) },
+#endif
+#ifdef MAP_ANONYMOUS
+        { "MAP_ANONYMOUS", uint64_t(MAP_ANONYMOUS) },
+#endif
+#ifdef MAP_32BIT
+        { "MAP_32BIT", uint64_t(MAP_32BIT) },
+#endif
+#ifdef MAP_GROWSDOWN
+        { "MAP_GROWSDOWN", uint64_t(MAP_GROWSDOWN) },
+#endif
+#ifdef MAP_DENYWRITE
+        { "MAP_DENYWRITE", uint64_t(MAP_DENYWRITE) },
+#endif
+#ifdef MAP_EXECUTABLE
+        { "MAP_EXECUTABLE", uint64_t(MAP_EXECUTABLE) },
+#endif
+#ifdef MAP_LOCKED
+        { "MAP_LOCKED", uint64_t(MAP_LOCKED) },
+#endif
+#ifdef MAP_NORESERVE
+        { "MAP_NORESERVE", uint64_t(MAP_NORESERVE) },
+#endif
+#ifdef MAP_POPULATE
+        { "MAP_POPULATE", uint64_t(MAP_POPULATE) },
+#endif
+#ifdef MAP_NONBLOCK
+        { "MAP_NONBLOCK", uint64_t(MAP_NONBLOCK) },
+#endif
+#ifdef MAP_STACK
+        { "MAP_STACK", uint64_t(MAP_STACK) },
+#endif
+#ifdef MAP_HUGETLB
+        { "MAP_HUGETLB", uint64_t(MAP_HUGETLB) },
+#endif
+#ifdef MAP_SYNC
+        { "MAP_SYNC", uint64_t(MAP_SYNC) },
+#endif
+#ifdef MAP_FIXED_NOREPLACE
+        { "MAP_FIXED_NOREPLACE", uint64_t(MAP_FIXED_NOREPLACE) },
+#endif
+
+        // socket(2) address families, from <sys/socket.h>
+#ifdef AF_UNSPEC
+        { "AF_UNSPEC", uint64_t(AF_UNSPEC) },
+#endif
+#ifdef AF_UNIX
+        { "AF_UNIX", uint64_t(AF_UNIX) },
+#endif
+#ifdef AF_INET
+        { "AF_INET", uint64_t(AF_INET) },
+#endif
+#ifdef AF_INET6
+        { "AF_INET6", uint64_t(AF_INET6) },
+#endif
+#ifdef AF_NETLINK
+        { "AF_NETLINK", uint64_t(AF_NETLINK) },
+#endif
+#ifdef AF_PACKET
+        { "AF_PACKET", uint64_t(AF_PACKET) },
+#endif
+#ifdef AF_BLUETOOTH
+        { "AF_BLUETOOTH", uint64_t(AF_BLUETOOTH) },
+#endif
+#ifdef AF_ALG
+        { "AF_ALG", uint64_t(AF_ALG) },
+#endif
+#ifdef AF_VSOCK
+        { "AF_VSOCK", uint64_t(AF_VSOCK) },
+#endif
+#ifdef AF_XDP
+        { "AF_XDP", uint64_t(AF_XDP) },
+#endif
+
+        // clone(2) flags, from <sched.h>
+#ifdef CLONE_VM
+        { "CLONE_VM", uint64_t(CLONE_VM) },
+#endif
+#ifdef CLONE_FS
+        { "CLONE_FS", uint64_t(CLONE_FS) },
+#endif
+#ifdef CLONE_FILES
+        { "CLONE_FILES", uint64_t(CLONE_FILES) },
+#endif
+#ifdef CLONE_SIGHAND
+        { "CLONE_SIGHAND", uint64_t(CLONE_SIGHAND) },
+#endif
+#ifdef CLONE_PIDFD
+        { "CLONE_PIDFD", uint64_t(CLONE_PIDFD) },
+#endif
+#ifdef CLONE_PTRACE
+        { "CLONE_PTRACE", uint64_t(CLONE_PTRACE) },
+#endif
+#ifdef CLONE_VFORK
+        { "CLONE_VFORK", uint64_t(CLONE_VFORK) },
+#endif
+#ifdef CLONE_PARENT
+        { "CLONE_PARENT", uint64_t(CLONE_PARENT) },
+#endif
+#ifdef CLONE_THREAD
+        { "CLONE_THREAD", uint64_t(CLONE_THREAD) },
+#endif
+#ifdef CLONE_NEWNS
+        { "CLONE_NEWNS", uint64_t(CLONE_NEWNS) },
+#endif
+#ifdef CLONE_SYSVSEM
+        { "CLONE_SYSVSEM", uint64_t(CLONE_SYSVSEM) },
+#endif
+#ifdef CLONE_SETTLS
+        { "CLONE_SETTLS", uint64_t(CLONE_SETTLS) },
+#endif
+#ifdef CLONE_PARENT_SETTID
+        { "CLONE_PARENT_SETTID", uint64_t(CLONE_PARENT_SETTID) },
+#endif
+#ifdef CLONE_CHILD_CLEARTID
+        { "CLONE_CHILD_CLEARTID", uint64_t(CLONE_CHILD_CLEARTID) },
+#endif
+#ifdef CLONE_DETACHED
+        { "CLONE_DETACHED", uint64_t(CLONE_DETACHED) },
+#endif
+#ifdef CLONE_UNTRACED
+        { "CLONE_UNTRACED", uint64_t(CLONE_UNTRACED) },
+#endif
+#ifdef CLONE_CHILD_SETTID
+        { "CLONE_CHILD_SETTID", uint64_t(CLONE_CHILD_SETTID) },
+#endif
+#ifdef CLONE_NEWCGROUP
+        { "CLONE_NEWCGROUP", uint64_t(CLONE_NEWCGROUP) },
+#endif
+#ifdef CLONE_NEWUTS
+        { "CLONE_NEWUTS", uint64_t(CLONE_NEWUTS) },
+#endif
+#ifdef CLONE_NEWIPC
+        { "CLONE_NEWIPC", uint64_t(CLONE_NEWIPC) },
+#endif
+#ifdef CLONE_NEWUSER
+        { "CLONE_NEWUSER", uint64_t(CLONE_NEWUSER) },
+#endif
+#ifdef CLONE_NEWPID
+        { "CLONE_NEWPID", uint64_t(CLONE_NEWPID) },
+#endif
+#ifdef CLONE_NEWNET
+        { "CLONE_NEWNET", uint64_t(CLONE_NEWNET) },
+#endif
+#ifdef CLONE_IO
+        { "CLONE_IO", uint64_t(CLONE_IO) },
+#endif
+#ifdef CLONE_NEWTIME
+        { "CLONE_NEWTIME", uint64_t(CLONE_NEWTIME) },
+#endif
+    };
+
+    /// The value of a named constant, or false if it is not known.
+    inline bool arg_constant(char const *name, uint64_t &value)
+    {
+        for (ArgConstant const &c : arg_constants) {
+            if (strcmp(c.name, name) == 0) {
+                value = c.value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+}
+
+// EOF
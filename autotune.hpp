@@ -0,0 +1,355 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+#include "bpf_eval_batch.hpp"
+#include "bpf_sim.hpp"
+#include "policy.hpp"
+#include "policy_compiler.hpp"
+#include "seccomp_child.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+/// Picks the layout of a policy that is fastest for a recorded workload.
+///
+/// Every candidate layout is first checked against Policy::decide() and scored by replaying the
+/// trace through the simulator, which is cheap. The best few are then timed in the kernel: a child
+/// installs each of them and makes the recorded system calls. Every return in the timed filters is
+/// turned into SECCOMP_RET_ERRNO, so no call actually runs and the child survives any trace. That
+/// also keeps the kernel's action cache out of the timing, which only caches allowed calls; the
+/// simulator scores include it.
+
+namespace seccomp {
+
+    struct AutotuneOptions {
+        /// How many of the best candidates offline are timed in the kernel. 0 only scores offline.
+        size_t timed = 4;
+
+        /// System calls made per timing run, from the start of the trace.
+        size_t timing_calls = 100000;
+
+        /// Timing runs per candidate, each paired with one of an empty filter, as kernel_cost()
+        /// does.
+        unsigned repetitions = 5;
+    };
+
+    struct AutotuneCandidate {
+        Layout layout;
+        std::vector<sock_filter> filter;
+
+        /// Instructions per call when replaying the trace, with the action cache.
+        double instructions = 0;
+
+        /// Nanoseconds per call the filter adds in the kernel, or negative if it was not timed.
+        double nanoseconds = -1;
+    };
+
+    struct AutotuneResult {
+        /// Best first. Timed candidates are ranked by their time, the others by instructions.
+        std::vector<AutotuneCandidate> candidates;
+
+        AutotuneCandidate const &winner() const { return candidates.front(); }
+    };
+
+    inline SyscallWeights syscall_weights(TraceReader const &trace)
+    {
+        SyscallWeights weights;
+        trace.for_each([&] (TraceRecord const &r) {
+            weights[r.nr]++;
+        });
+        return weights;
+    }
+
+    /// Every dispatch, with and without ranges and sharing.
+    inline std::vector<Layout> candidate_layouts()
+    {
+        std::vector<Layout> layouts;
+        for (int d = 0; d < 4; d++) {
+            for (int flags = 0; flags < 4; flags++) {
+                Layout l;
+                l.dispatch = d < 2 ? Dispatch::LINEAR : d == 2 ? Dispatch::BALANCED_TREE : Dispatch::WEIGHTED_TREE;
+                l.profile_order = d == 1;
+                l.ranges = flags & 1;
+                l.share = flags & 2;
+                layouts.push_back(l);
+            }
+        }
+        return layouts;
+    }
+
+    namespace autotune_detail {
+
+        /// Calls the trace may not have made: each rule's system call with arguments that pass
+        /// its checks and with all zeroes, its neighbours, and another architecture.
+        inline std::vector<seccomp_data> probes(Policy const &policy)
+        {
+            std::vector<seccomp_data> out;
+            for (PolicyRule const &r : policy.rules) {
+                seccomp_data d {};
+                d.arch = policy.arch;
+                for (uint32_t nr : { r.nr - 1, r.nr, r.nr + 1 }) {
+                    d.nr = int(nr);
+                    out.push_back(d);
+                }
+
+                d.nr = int(r.nr);
+                for (ArgCheck const &c : r.checks) {
+                    d.args[c.index] = (d.args[c.index] & ~c.mask) | c.value;
+                }
+                out.push_back(d);
+
+                d.arch = ~policy.arch;
+                out.push_back(d);
+            }
+            return out;
+        }
+
+        /// For each candidate, whether it returns what policy decides for every record of trace and
+        /// every probe.
+        inline std::vector<bool> verify(Policy const &policy, std::vector<AutotuneCandidate> const &candidates,
+                                        TraceReader const &trace, WorkStealingPool &pool)
+        {
+            struct Worker {
+                std::vector<TraceRecord> records;
+                std::vector<uint8_t> buffer;
+                std::vector<seccomp_data> data;
+                std::vector<uint32_t> expected;
+                std::vector<BatchResult> results;
+                char pad[64];
+            };
+
+            std::unique_ptr<std::atomic<bool>[]> wrong(new std::atomic<bool>[candidates.size()]);
+            for (size_t c = 0; c < candidates.size(); c++) {
+                wrong[c] = false;
+            }
+            std::vector<Worker> workers(pool.workers());
+
+            auto const check = [&] (Worker &w) {
+                w.expected.clear();
+                for (seccomp_data const &d : w.data) {
+                    w.expected.push_back(policy.decide(d));
+                }
+                for (size_t c = 0; c < candidates.size(); c++) {
+                    evaluate_batch(candidates[c].filter, w.data, w.results);
+                    for (size_t i = 0; i < w.data.size(); i++) {
+                        if (w.results[i].action != w.expected[i]) {
+                            wrong[c] = true;
+                        }
+                    }
+                }
+            };
+
+            pool.run(trace.blocks() + 1, [&] (unsigned worker, size_t task) {
+                Worker &w = workers[worker];
+                if (task == trace.blocks()) {
+                    w.data = probes(policy);
+                } else {
+                    trace.decode(task, w.records, w.buffer);
+                    w.data.clear();
+                    for (TraceRecord const &r : w.records) {
+                        w.data.push_back(r.data());
+                    }
+                }
+                check(w);
+            });
+
+            std::vector<bool> ok;
+            for (size_t c = 0; c < candidates.size(); c++) {
+                ok.push_back(!wrong[c]);
+            }
+            return ok;
+        }
+
+        /// filter behind a prologue that lets the child read the clock and exit, with every return
+        /// changed to an error.
+        inline std::vector<sock_filter> timing_filter(std::vector<sock_filter> const &filter)
+        {
+            std::vector<sock_filter> f {
+                BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_exit_group, 1, 0),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_clock_gettime, 0, 1),
+                BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+            };
+            for (sock_filter insn : filter) {
+                if (insn.code == (BPF_RET | BPF_K)) {
+                    insn.k = SECCOMP_RET_ERRNO | ENOSYS;
+                }
+                f.push_back(insn);
+            }
+            return f;
+        }
+
+        /// Nanoseconds per call to make calls in a child with filter installed, or negative if the
+        /// child failed.
+        inline double time_calls(std::vector<sock_filter> const &filter, std::vector<TraceRecord> const &calls)
+        {
+            void *const shared = mmap(nullptr, sizeof(double), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (shared == MAP_FAILED) {
+                die_errno("mmap");
+            }
+            double *const result = static_cast<double *>(shared);
+            *result = -1;
+
+            SeccompChild child(timing_filter(filter));
+            child.run([&] {
+                struct timespec begin, end;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                for (TraceRecord const &r : calls) {
+                    syscall(long(r.nr), r.args[0], r.args[1], r.args[2], r.args[3], r.args[4], r.args[5]);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                *result = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / calls.size();
+                return 0;
+            });
+
+            double const ns = child.wait_for_child() == 0 ? *result : -1;
+            munmap(shared, sizeof(double));
+            return ns;
+        }
+
+    }
+
+    /// Whether the child can make r to time it. The prologue of timing_filter() lets the two calls
+    /// the child needs itself through, so those would not be filtered.
+    inline bool can_time(TraceRecord const &r)
+    {
+        return r.arch == AUDIT_ARCH_X86_64 && r.nr != SYS_exit_group && r.nr != SYS_clock_gettime;
+    }
+
+    /// Nanoseconds per call that filter adds in the kernel to calls, all of which can_time(). Runs
+    /// alternate with runs of a filter that does nothing, and the median difference of a pair
+    /// counts, which is steadier than comparing the fastest runs. Negative if it could not be
+    /// measured.
+    inline double kernel_cost(std::vector<sock_filter> const &filter, std::vector<TraceRecord> const &calls,
+                              unsigned repetitions = 5)
+    {
+        std::vector<sock_filter> const baseline { BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO) };
+        std::vector<double> differences;
+
+        for (unsigned rep = 0; rep < repetitions; rep++) {
+            double const b = autotune_detail::time_calls(baseline, calls);
+            double const t = autotune_detail::time_calls(filter, calls);
+            if (b < 0 || t < 0) {
+                return -1;
+            }
+            differences.push_back(t - b);
+        }
+        if (differences.empty()) {
+            return -1;
+        }
+
+        std::sort(differences.begin(), differences.end());
+        return std::max(0.0, differences[differences.size() / 2]);
+    }
+
+    inline AutotuneResult autotune(Policy const &policy, TraceReader const &trace, WorkStealingPool &pool,
+                                   AutotuneOptions const &opts = AutotuneOptions())
+    {
+        using namespace autotune_detail;
+
+        SyscallWeights const weights = syscall_weights(trace);
+
+        std::vector<AutotuneCandidate> all;
+        for (Layout const &l : candidate_layouts()) {
+            all.push_back({ l, compile(policy, l, weights) });
+        }
+
+        // A candidate that does not mean what the policy says is a compiler bug, never a choice.
+        AutotuneResult result;
+        std::vector<bool> const ok = verify(policy, all, trace, pool);
+        for (size_t c = 0; c < all.size(); c++) {
+            if (!ok[c]) {
+                fprintf(stderr, "autotune: layout %s disagrees with the policy, skipped\n", all[c].layout.name().c_str());
+            } else if (all[c].filter.size() > BPF_MAXINSNS) {
+                fprintf(stderr, "autotune: layout %s is too long, skipped\n", all[c].layout.name().c_str());
+            } else {
+                result.candidates.push_back(std::move(all[c]));
+            }
+        }
+        if (result.candidates.empty()) {
+            fprintf(stderr, "autotune: no usable layout\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (AutotuneCandidate &c : result.candidates) {
+            SimReport const r = FilterSimulator(c.filter, {}).replay(trace, pool);
+            c.instructions = r.calls ? double(r.executed) / r.calls : 0.0;
+        }
+
+        auto const offline = [] (AutotuneCandidate const &x, AutotuneCandidate const &y) {
+            return x.instructions != y.instructions ? x.instructions < y.instructions
+                : x.filter.size() < y.filter.size();
+        };
+        std::stable_sort(result.candidates.begin(), result.candidates.end(), offline);
+
+        std::vector<TraceRecord> calls;
+        if (policy.arch == AUDIT_ARCH_X86_64 && opts.timed > 0) {
+            std::vector<TraceRecord> records;
+            std::vector<uint8_t> buffer;
+            for (size_t b = 0; b < trace.blocks() && calls.size() < opts.timing_calls; b++) {
+                trace.decode(b, records, buffer);
+                for (TraceRecord const &r : records) {
+                    if (can_time(r) && calls.size() < opts.timing_calls) {
+                        calls.push_back(r);
+                    }
+                }
+            }
+        }
+        if (calls.empty()) {
+            return result;
+        }
+
+        // Timed the same way as the gate times them, so that the numbers agree.
+        size_t const timed = std::min(opts.timed, result.candidates.size());
+        for (size_t c = 0; c < timed; c++) {
+            result.candidates[c].nanoseconds = kernel_cost(result.candidates[c].filter, calls, opts.repetitions);
+        }
+
+        std::stable_sort(result.candidates.begin(), result.candidates.begin() + timed,
+                         [] (AutotuneCandidate const &x, AutotuneCandidate const &y) {
+                             return (x.nanoseconds >= 0) != (y.nanoseconds >= 0) ? x.nanoseconds >= 0
+                                 : x.nanoseconds < y.nanoseconds;
+                         });
+        return result;
+    }
+
+    inline void print_autotune(FILE *out, AutotuneResult const &r)
+    {
+        fprintf(out, "%-28s %6s %10s %8s\n", "layout", "insns", "insns/call", "ns/call");
+        for (AutotuneCandidate const &c : r.candidates) {
+            fprintf(out, "%-28s %6zu %10.2f ", c.layout.name().c_str(), c.filter.size(), c.instructions);
+            if (c.nanoseconds >= 0) {
+                fprintf(out, "%8.1f\n", c.nanoseconds);
+            } else {
+                fprintf(out, "%8s\n", "-");
+            }
+        }
+
+        AutotuneCandidate const &w = r.winner();
+        fprintf(out, "winner: %s, %.2f instructions per call", w.layout.name().c_str(), w.instructions);
+        if (w.nanoseconds >= 0) {
+            fprintf(out, ", %.1f ns per call in the kernel", w.nanoseconds);
+        }
+        fprintf(out, "\n");
+    }
+
+}
+
+// EOF
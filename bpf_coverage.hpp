@@ -0,0 +1,153 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "bpf_disasm.hpp"
+#include "bpf_sim.hpp"
+#include "syscall_names.hpp"
+
+/// Which parts of a filter a replayed trace exercised, and which rules it never needed.
+///
+/// A rule that never decided a call only costs: every call that reaches it runs through its
+/// instructions and moves on. Those instructions are what pruning it would save.
+
+namespace seccomp {
+
+    struct RuleCoverage {
+        /// Instructions [begin, end) of the rule.
+        size_t begin, end;
+
+        /// System call number the rule tests for, or -1 if it does not compare nr to a constant.
+        long syscall;
+
+        /// Calls that ran the rule's first instruction. Calls the action cache answered never do.
+        uint64_t entered = 0;
+
+        /// Calls the rule decided, cached ones included.
+        uint64_t fired = 0;
+
+        /// Instructions executed inside the rule, over all calls.
+        uint64_t executed = 0;
+
+        /// How many of its instructions ran at least once.
+        size_t covered = 0;
+    };
+
+    struct CoverageReport {
+        uint64_t calls = 0;
+        Profile profile;
+
+        /// How many instructions ran at least once.
+        size_t covered = 0;
+
+        /// Empty without rule bounds.
+        std::vector<RuleCoverage> rules;
+
+        /// Rules that never decided a call.
+        std::vector<size_t> dead_rules() const
+        {
+            std::vector<size_t> dead;
+            for (size_t r = 0; r < rules.size(); r++) {
+                if (rules[r].fired == 0) {
+                    dead.push_back(r);
+                }
+            }
+            return dead;
+        }
+    };
+
+    /// Coverage of prog from a report of FilterSimulator with the same rule_bounds.
+    inline CoverageReport coverage(std::vector<sock_filter> const &prog, std::vector<size_t> const &rule_bounds,
+                                   SimReport const &sim)
+    {
+        CoverageReport r;
+        r.calls = sim.calls;
+        r.profile = sim.profile;
+        r.profile.resize(prog.size(), 0);
+
+        for (uint64_t count : r.profile) {
+            r.covered += count != 0;
+        }
+
+        std::vector<long> const fields = disasm_detail::loaded_fields(prog);
+        for (size_t i = 0; i + 1 < rule_bounds.size(); i++) {
+            RuleCoverage c { rule_bounds[i], rule_bounds[i + 1], -1 };
+            c.entered = c.begin < c.end ? r.profile[c.begin] : 0;
+            c.fired = i < sim.rule_hits.size() ? sim.rule_hits[i] : 0;
+
+            for (size_t pc = c.begin; pc < c.end; pc++) {
+                c.executed += r.profile[pc];
+                c.covered += r.profile[pc] != 0;
+
+                if (c.syscall < 0 && prog[pc].code == (BPF_JMP | BPF_JEQ | BPF_K) &&
+                    fields[pc] == long(offsetof(seccomp_data, nr))) {
+                    c.syscall = long(prog[pc].k);
+                }
+            }
+            r.rules.push_back(c);
+        }
+
+        return r;
+    }
+
+    /// The listing with how often each instruction ran, gcov style, then every rule and what
+    /// pruning the dead ones would save.
+    inline void print_coverage(FILE *out, std::vector<sock_filter> const &prog, CoverageReport const &r)
+    {
+        double const calls = r.calls ? double(r.calls) : 1.0;
+        std::vector<long> const fields = disasm_detail::loaded_fields(prog);
+
+        fprintf(out, "%zu of %zu instructions executed (%.1f%%) over %" PRIu64 " calls\n", r.covered, prog.size(),
+                prog.empty() ? 0.0 : 100.0 * r.covered / prog.size(), r.calls);
+
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            for (size_t i = 0; i < r.rules.size(); i++) {
+                if (r.rules[i].begin == pc) {
+                    fprintf(out, "rule %zu:\n", i);
+                }
+            }
+
+            if (r.profile[pc] != 0) {
+                fprintf(out, "%12" PRIu64, r.profile[pc]);
+            } else {
+                fprintf(out, "%12s", "#####");
+            }
+            fprintf(out, " %4zu: %s\n", pc, disassemble_insn(prog[pc], pc, fields[pc]).c_str());
+        }
+
+        if (r.rules.empty()) {
+            return;
+        }
+
+        fprintf(out, "rule  system call        entered        fired   instructions  covered\n");
+        for (size_t i = 0; i < r.rules.size(); i++) {
+            RuleCoverage const &c = r.rules[i];
+            char const *name = c.syscall >= 0 ? syscall_name(uint32_t(c.syscall)) : nullptr;
+            fprintf(out, "%4zu  %-16s %10" PRIu64 " %12" PRIu64 " %14" PRIu64 "  %3zu/%-3zu%s\n",
+                    i, name ? name : c.syscall >= 0 ? std::to_string(c.syscall).c_str() : "?",
+                    c.entered, c.fired, c.executed, c.covered, c.end - c.begin,
+                    c.fired ? "" : "  never fired");
+        }
+
+        uint64_t saved = 0;
+        size_t size = 0;
+        for (size_t i : r.dead_rules()) {
+            saved += r.rules[i].executed;
+            size += r.rules[i].end - r.rules[i].begin;
+        }
+        if (size != 0) {
+            fprintf(out, "pruning the %zu rules that never fired saves %zu instructions and %.2f executed per call\n",
+                    r.dead_rules().size(), size, saved / calls);
+        }
+    }
+
+}
+
+// EOF
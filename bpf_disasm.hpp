@@ -0,0 +1,350 @@
+#pragma once
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "syscall_names.hpp"
+
+/// Human readable output for compiled filters: a disassembler that knows about seccomp_data and
+/// system call names, and a Graphviz export of the control flow graph.
+
+namespace seccomp {
+
+    namespace disasm_detail {
+
+        inline std::string format(char const *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+        inline std::string format(char const *fmt, ...)
+        {
+            char buf[128];
+            va_list ap;
+            va_start(ap, fmt);
+            vsnprintf(buf, sizeof(buf), fmt, ap);
+            va_end(ap);
+            return buf;
+        }
+
+        inline std::string field_name(uint32_t off)
+        {
+            size_t const args = offsetof(struct seccomp_data, args);
+            size_t const ip = offsetof(struct seccomp_data, instruction_pointer);
+
+            if (off == offsetof(struct seccomp_data, nr)) {
+                return "nr";
+            }
+            if (off == offsetof(struct seccomp_data, arch)) {
+                return "arch";
+            }
+            if (off == ip || off == ip + 4) {
+                return off == ip ? "instruction_pointer.lo" : "instruction_pointer.hi";
+            }
+            if (off >= args && off < sizeof(struct seccomp_data) && off % 4 == 0) {
+                return format("args[%zu].%s", (off - args) / 8, (off - args) % 8 ? "hi" : "lo");
+            }
+            return format("%u", off);
+        }
+
+        inline char const *arch_name(uint32_t arch)
+        {
+            switch (arch) {
+            case AUDIT_ARCH_X86_64:  return "AUDIT_ARCH_X86_64";
+            case AUDIT_ARCH_I386:    return "AUDIT_ARCH_I386";
+            case AUDIT_ARCH_AARCH64: return "AUDIT_ARCH_AARCH64";
+            case AUDIT_ARCH_ARM:     return "AUDIT_ARCH_ARM";
+            default:                 return nullptr;
+            }
+        }
+
+        /// What the accumulator was last loaded from, so constants can be named.
+        inline std::vector<long> loaded_fields(std::vector<sock_filter> const &prog)
+        {
+            long const unreached = -2;
+            long const unknown = -1;
+            std::vector<long> field(prog.size() + 1, unreached);
+
+            auto flow = [&] (size_t to, long f) {
+                long &t = field[std::min(to, prog.size())];
+                t = (t == unreached || t == f) ? f : unknown;
+            };
+
+            if (!prog.empty()) {
+                field[0] = unknown;
+            }
+
+            for (size_t pc = 0; pc < prog.size(); pc++) {
+                sock_filter const &insn = prog[pc];
+
+                switch (BPF_CLASS(insn.code)) {
+                case BPF_RET:
+                    break;
+                case BPF_LD:
+                    flow(pc + 1, insn.code == (BPF_LD | BPF_W | BPF_ABS) ? long(insn.k) : unknown);
+                    break;
+                case BPF_JMP:
+                    if (BPF_OP(insn.code) == BPF_JA) {
+                        flow(pc + 1 + insn.k, field[pc]);
+                    } else {
+                        flow(pc + 1 + insn.jt, field[pc]);
+                        flow(pc + 1 + insn.jf, field[pc]);
+                    }
+                    break;
+                case BPF_ALU:
+                    // Masked values are still compared against values of the same field.
+                    flow(pc + 1, BPF_OP(insn.code) == BPF_AND ? field[pc] : unknown);
+                    break;
+                default:
+                    flow(pc + 1, field[pc]);
+                    break;
+                }
+            }
+
+            return field;
+        }
+
+        inline std::string constant(uint32_t k, long field)
+        {
+            std::string s = format("#%#x", k);
+            char const *name = nullptr;
+
+            if (field == long(offsetof(struct seccomp_data, nr))) {
+                name = syscall_name(k);
+            } else if (field == long(offsetof(struct seccomp_data, arch))) {
+                name = arch_name(k);
+            }
+
+            if (name != nullptr) {
+                s += format(" (%s)", name);
+            }
+            return s;
+        }
+
+        inline char const *alu_name(uint16_t op)
+        {
+            switch (op) {
+            case BPF_ADD: return "add";
+            case BPF_SUB: return "sub";
+            case BPF_MUL: return "mul";
+            case BPF_DIV: return "div";
+            case BPF_MOD: return "mod";
+            case BPF_AND: return "and";
+            case BPF_OR:  return "or";
+            case BPF_XOR: return "xor";
+            case BPF_LSH: return "lsh";
+            case BPF_RSH: return "rsh";
+            case BPF_NEG: return "neg";
+            default:      return "alu?";
+            }
+        }
+
+        inline char const *jump_name(uint16_t op)
+        {
+            switch (op) {
+            case BPF_JEQ:  return "jeq";
+            case BPF_JGT:  return "jgt";
+            case BPF_JGE:  return "jge";
+            case BPF_JSET: return "jset";
+            default:       return "j?";
+            }
+        }
+
+    }
+
+    /// A return value as text, e.g. "ERRNO(1)" or "ALLOW".
+    inline std::string action_name(uint32_t k)
+    {
+        uint32_t const data = k & SECCOMP_RET_DATA;
+
+        switch (k & SECCOMP_RET_ACTION_FULL) {
+        case SECCOMP_RET_KILL_PROCESS: return "KILL_PROCESS";
+        case SECCOMP_RET_KILL_THREAD:  return "KILL";
+        case SECCOMP_RET_TRAP:         return disasm_detail::format("TRAP(%u)", data);
+        case SECCOMP_RET_ERRNO:        return disasm_detail::format("ERRNO(%u)", data);
+        case SECCOMP_RET_USER_NOTIF:   return "USER_NOTIF";
+        case SECCOMP_RET_TRACE:        return disasm_detail::format("TRACE(%u)", data);
+        case SECCOMP_RET_LOG:          return "LOG";
+        case SECCOMP_RET_ALLOW:        return "ALLOW";
+        default:                       return disasm_detail::format("%#x", k);
+        }
+    }
+
+    /// One instruction as text, with jump targets resolved to absolute offsets. field is what the
+    /// accumulator was loaded from (a seccomp_data offset) or -1.
+    inline std::string disassemble_insn(sock_filter const &insn, size_t pc, long field = -1)
+    {
+        using namespace disasm_detail;
+
+        uint32_t const k = insn.k;
+
+        switch (insn.code) {
+        case BPF_LD | BPF_W | BPF_ABS:  return "ld   [" + field_name(k) + "]";
+        case BPF_LD | BPF_W | BPF_LEN:  return "ld   #len";
+        case BPF_LDX | BPF_W | BPF_LEN: return "ldx  #len";
+        case BPF_LD | BPF_IMM:          return format("ld   #%#x", k);
+        case BPF_LDX | BPF_IMM:         return format("ldx  #%#x", k);
+        case BPF_LD | BPF_MEM:          return format("ld   M[%u]", k);
+        case BPF_LDX | BPF_MEM:         return format("ldx  M[%u]", k);
+        case BPF_ST:                    return format("st   M[%u]", k);
+        case BPF_STX:                   return format("stx  M[%u]", k);
+        case BPF_MISC | BPF_TAX:        return "tax";
+        case BPF_MISC | BPF_TXA:        return "txa";
+        case BPF_RET | BPF_A:           return "ret  a";
+        case BPF_RET | BPF_K:           return "ret  " + action_name(k);
+        case BPF_JMP | BPF_JA:          return format("ja   %zu", pc + 1 + k);
+        }
+
+        switch (BPF_CLASS(insn.code)) {
+        case BPF_ALU:
+            if (BPF_OP(insn.code) == BPF_NEG) {
+                return "neg";
+            }
+            return format("%-4s ", alu_name(BPF_OP(insn.code))) +
+                (BPF_SRC(insn.code) == BPF_X ? std::string("x") : format("#%#x", k));
+        case BPF_JMP:
+            return format("%-4s ", jump_name(BPF_OP(insn.code))) +
+                (BPF_SRC(insn.code) == BPF_X ? std::string("x") : constant(k, field)) +
+                format("  jt %zu  jf %zu", pc + 1 + insn.jt, pc + 1 + insn.jf);
+        default:
+            return format(".insn %#x, %u, %u, %#x", insn.code, insn.jt, insn.jf, k);
+        }
+    }
+
+    /// Print a listing of the whole program.
+    inline void disassemble(FILE *out, std::vector<sock_filter> const &prog)
+    {
+        std::vector<long> const fields = disasm_detail::loaded_fields(prog);
+
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            fprintf(out, "%4zu: %s\n", pc, disassemble_insn(prog[pc], pc, fields[pc]).c_str());
+        }
+    }
+
+    /// Per instruction execution counts, e.g. from replaying recorded system calls.
+    using Profile = std::vector<uint64_t>;
+
+    /// Profiles are stored as text, one "pc count" pair per line.
+    inline bool read_profile(char const *path, Profile &profile)
+    {
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            return false;
+        }
+
+        size_t pc;
+        uint64_t count;
+        while (fscanf(f, "%zu %" SCNu64, &pc, &count) == 2) {
+            if (pc >= profile.size()) {
+                profile.resize(pc + 1);
+            }
+            profile[pc] += count;
+        }
+
+        fclose(f);
+        return true;
+    }
+
+    inline bool write_profile(char const *path, Profile const &profile)
+    {
+        FILE *f = fopen(path, "w");
+        if (f == nullptr) {
+            return false;
+        }
+
+        for (size_t pc = 0; pc < profile.size(); pc++) {
+            fprintf(f, "%zu %" PRIu64 "\n", pc, profile[pc]);
+        }
+        return fclose(f) == 0;
+    }
+
+    /// Write the control flow graph in Graphviz format. With a profile, every basic block shows
+    /// how often it ran and hotter blocks are drawn darker.
+    inline void write_dot(FILE *out, std::vector<sock_filter> const &prog, Profile const &profile = Profile())
+    {
+        using namespace disasm_detail;
+
+        std::vector<long> const fields = loaded_fields(prog);
+
+        // Basic blocks start at 0, at every jump target and after every jump or return.
+        std::vector<bool> leader(prog.size() + 1, false);
+        leader[0] = true;
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            sock_filter const &insn = prog[pc];
+            uint16_t const cls = BPF_CLASS(insn.code);
+
+            if (cls == BPF_JMP) {
+                if (BPF_OP(insn.code) == BPF_JA) {
+                    leader[std::min(prog.size(), pc + 1 + insn.k)] = true;
+                } else {
+                    leader[std::min(prog.size(), pc + 1 + insn.jt)] = true;
+                    leader[std::min(prog.size(), pc + 1 + insn.jf)] = true;
+                }
+            }
+            if (cls == BPF_JMP || cls == BPF_RET) {
+                leader[pc + 1] = true;
+            }
+        }
+
+        uint64_t const hottest = profile.empty() ? 0 : *std::max_element(profile.begin(), profile.end());
+        auto count = [&] (size_t pc) -> uint64_t { return pc < profile.size() ? profile[pc] : 0; };
+
+        fprintf(out, "digraph filter {\n");
+        fprintf(out, "    node [shape=box, fontname=monospace, style=filled, fillcolor=white];\n");
+
+        for (size_t begin = 0; begin < prog.size(); ) {
+            size_t end = begin + 1;
+            while (end < prog.size() && !leader[end]) {
+                end++;
+            }
+
+            std::string label;
+            for (size_t pc = begin; pc < end; pc++) {
+                label += format("%zu: ", pc) + disassemble_insn(prog[pc], pc, fields[pc]) + "\\l";
+            }
+
+            fprintf(out, "    b%zu [label=\"%s\"", begin, label.c_str());
+            if (!profile.empty()) {
+                uint64_t const c = count(begin);
+                // Share of all runs, and grey levels from white (never) to dark (hottest).
+                double const share = count(0) ? 100.0 * double(c) / double(count(0)) : 0.0;
+                unsigned const shade = hottest ? unsigned(255 - 160 * double(c) / double(hottest)) : 255;
+                fprintf(out, ", xlabel=\"%" PRIu64 " (%.1f%%)\", fillcolor=\"#%02x%02x%02x\"",
+                        c, share, shade, shade, shade);
+            }
+            fprintf(out, "];\n");
+
+            sock_filter const &last = prog[end - 1];
+            auto edge = [&] (size_t to, char const *label) {
+                if (to < prog.size()) {
+                    fprintf(out, "    b%zu -> b%zu [label=\"%s\"];\n", begin, to, label);
+                }
+            };
+
+            if (BPF_CLASS(last.code) == BPF_JMP) {
+                if (BPF_OP(last.code) == BPF_JA) {
+                    edge(end + last.k, "");
+                } else {
+                    edge(end + last.jt, "T");
+                    edge(end + last.jf, "F");
+                }
+            } else if (BPF_CLASS(last.code) != BPF_RET) {
+                edge(end, "");
+            }
+
+            begin = end;
+        }
+
+        fprintf(out, "}\n");
+    }
+
+}
+
+// EOF
@@ -0,0 +1,547 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+/// A small expression-template DSL for seccomp rules with argument predicates:
+///
+///     allow(SYS_write).when(arg(0) == 1 || arg(0) == 2)
+///     allow(SYS_mmap).when((arg(2) & PROT_EXEC) == 0)
+///     allow(SYS_clone).when(only(arg(0), CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD))
+///     allow(SYS_openat).when(signed_arg(0) == AT_FDCWD || signed_arg(0) >= 0)
+///
+/// The structure of a predicate is part of its type, so malformed predicates are rejected by the
+/// compiler. Each node knows its size in instructions, which lets it be lowered straight into cBPF
+/// with all jump offsets computed for us instead of counted by hand.
+
+namespace seccomp {
+namespace dsl {
+
+    /// Appends instructions to a filter and turns absolute jump targets (counted from where the
+    /// emitter started) into the relative offsets cBPF wants.
+    template <typename VECTOR>
+    class Emitter {
+        VECTOR &v_;
+        size_t const base_;
+
+        static unsigned char offset(size_t from, size_t to)
+        {
+            // cBPF can only jump forward and conditional offsets are 8 bit.
+            assert(to > from && to - from - 1 <= 0xff);
+            return static_cast<unsigned char>(to - from - 1);
+        }
+
+    public:
+        explicit Emitter(VECTOR &v)
+            : v_(v), base_(v.size())
+        {}
+
+        /// Position of the next instruction.
+        size_t pc() const { return v_.size() - base_; }
+
+        void load(uint32_t offset)
+        {
+            v_.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset));
+        }
+
+        void alu_and(uint32_t k)
+        {
+            v_.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, k));
+        }
+
+        void ret(uint32_t k)
+        {
+            v_.push_back(BPF_STMT(BPF_RET | BPF_K, k));
+        }
+
+        void jump(size_t target)
+        {
+            assert(target > pc());
+            v_.push_back(BPF_STMT(BPF_JMP | BPF_JA, static_cast<uint32_t>(target - pc() - 1)));
+        }
+
+        void alu_xor(uint32_t k)
+        {
+            v_.push_back(BPF_STMT(BPF_ALU | BPF_XOR | BPF_K, k));
+        }
+
+        void jeq(uint32_t k, size_t t, size_t f)
+        {
+            v_.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, k, offset(pc(), t), offset(pc(), f)));
+        }
+
+        void jgt(uint32_t k, size_t t, size_t f)
+        {
+            v_.push_back(BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, k, offset(pc(), t), offset(pc(), f)));
+        }
+
+        void jge(uint32_t k, size_t t, size_t f)
+        {
+            v_.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, k, offset(pc(), t), offset(pc(), f)));
+        }
+    };
+
+    /// One 64-bit system call argument, optionally masked. Ordered comparisons treat it as signed
+    /// or unsigned; equality does not care.
+    struct Arg {
+        unsigned index;
+        uint64_t mask;
+        bool is_signed = false;
+    };
+
+    inline Arg arg(unsigned index)
+    {
+        assert(index < 6);
+        return Arg { index, ~uint64_t(0) };
+    }
+
+    /// An argument that holds a signed number, such as a file descriptor that may be AT_FDCWD.
+    inline Arg signed_arg(unsigned index)
+    {
+        assert(index < 6);
+        return Arg { index, ~uint64_t(0), true };
+    }
+
+    // Plain integers only: this keeps things like `arg(2) & PROT_EXEC == 0` (which C++ parses as
+    // `arg(2) & (PROT_EXEC == 0)`) from compiling.
+    template <typename T>
+    using enable_if_value = std::enable_if_t<std::is_integral<T>::value &&
+                                             !std::is_same<T, bool>::value>;
+
+    template <typename T, typename = enable_if_value<T>>
+    Arg operator&(Arg a, T mask)
+    {
+        a.mask &= static_cast<uint64_t>(mask);
+        return a;
+    }
+
+    template <typename T> struct is_predicate : std::false_type {};
+
+    /// (arg & mask) == value or (arg & mask) != value.
+    class Compare {
+        Arg arg_;
+        uint64_t value_;
+        bool equal_;
+
+        static size_t half_size(uint32_t mask)
+        {
+            return mask == 0 ? 0 : (mask == ~uint32_t(0) ? 2 : 3);
+        }
+
+        template <typename EMITTER>
+        static void emit_half(EMITTER &e, uint32_t offset, uint32_t mask, uint32_t value,
+                              size_t match, size_t mismatch)
+        {
+            if (mask == 0) {
+                return;
+            }
+
+            e.load(offset);
+            if (mask != ~uint32_t(0)) {
+                e.alu_and(mask);
+            }
+            e.jeq(value, match, mismatch);
+        }
+
+        /// The result does not depend on the argument at all.
+        bool is_constant() const
+        {
+            return arg_.mask == 0 || (value_ & ~arg_.mask) != 0;
+        }
+
+    public:
+        Compare(Arg arg, uint64_t value, bool equal)
+            : arg_(arg), value_(value), equal_(equal)
+        {}
+
+        size_t size() const
+        {
+            if (is_constant()) {
+                return 1;
+            }
+
+            return half_size(static_cast<uint32_t>(arg_.mask)) +
+                half_size(static_cast<uint32_t>(arg_.mask >> 32));
+        }
+
+        template <typename EMITTER>
+        void emit(EMITTER &e, size_t t, size_t f) const
+        {
+            size_t const match    = equal_ ? t : f;
+            size_t const mismatch = equal_ ? f : t;
+
+            if (is_constant()) {
+                // Either nothing is compared or bits outside of the mask are expected to be set.
+                e.jump(arg_.mask == 0 && value_ == 0 ? match : mismatch);
+                return;
+            }
+
+            uint32_t const offset  = offsetof(struct seccomp_data, args) + arg_.index * sizeof(uint64_t);
+            uint32_t const mask_lo = static_cast<uint32_t>(arg_.mask);
+            uint32_t const mask_hi = static_cast<uint32_t>(arg_.mask >> 32);
+
+            // If the upper half still needs checking, a matching lower half continues right there.
+            size_t const lo_match = mask_hi != 0 ? e.pc() + half_size(mask_lo) : match;
+
+            emit_half(e, offset, mask_lo, static_cast<uint32_t>(value_), lo_match, mismatch);
+            emit_half(e, offset + sizeof(uint32_t), mask_hi, static_cast<uint32_t>(value_ >> 32),
+                      match, mismatch);
+        }
+    };
+
+    /// (arg & mask) >= value, or < value when inverted. cBPF only compares 32-bit words unsigned,
+    /// so the upper words are compared first and the lower ones only where the upper ones are equal;
+    /// for signed numbers the sign bit is flipped first, which orders them like unsigned ones. Words
+    /// the mask or the value make irrelevant are not looked at.
+    class AtLeast {
+        Arg arg_;
+        uint64_t value_;
+        bool invert_;
+        bool never_;
+
+        enum Outcome { FALSE, TRUE, TEST };
+
+        /// What to emit, worked out the same way for size() and emit().
+        struct Plan {
+            /// If not TEST, the result is known without looking at the argument.
+            Outcome constant = TEST;
+
+            bool hi = false, hi_and = false, hi_xor = false;
+            uint32_t hi_k = 0;
+
+            /// What equal upper words mean: TEST compares the lower ones.
+            Outcome hi_equal = TEST;
+
+            bool lo_and = false;
+            uint32_t lo_k = 0;
+        };
+
+        Plan plan() const
+        {
+            Plan p;
+            uint64_t const mask = arg_.mask;
+            bool sign = arg_.is_signed && (mask >> 63) != 0;
+
+            if (never_) {
+                p.constant = FALSE;
+                return p;
+            }
+            if (arg_.is_signed && !sign) {
+                // Without its sign bit the argument is never negative.
+                if (int64_t(value_) < 0) {
+                    p.constant = TRUE;
+                    return p;
+                }
+            }
+            if (sign ? value_ == uint64_t(1) << 63 : value_ == 0) {
+                p.constant = TRUE;
+                return p;
+            }
+            if (!sign && value_ > mask) {
+                p.constant = FALSE;
+                return p;
+            }
+
+            uint32_t const mask_hi = uint32_t(mask >> 32);
+            uint32_t const mask_lo = uint32_t(mask);
+            p.lo_and = mask_lo != ~uint32_t(0);
+            p.lo_k = uint32_t(value_);
+            p.hi_equal = p.lo_k == 0 ? TRUE : mask_lo == 0 ? FALSE : TEST;
+
+            // Unsigned and with the upper word masked off, value fits the lower one.
+            p.hi = mask_hi != 0;
+            p.hi_and = mask_hi != ~uint32_t(0);
+            p.hi_xor = sign;
+            p.hi_k = uint32_t(value_ >> 32) ^ (sign ? 0x80000000u : 0);
+            return p;
+        }
+
+        static size_t hi_size(Plan const &p)
+        {
+            if (!p.hi) {
+                return 0;
+            }
+            size_t const compare = p.hi_equal != TEST || p.hi_k == 0 || p.hi_k == ~uint32_t(0) ? 1 : 2;
+            return 1 + p.hi_and + p.hi_xor + compare;
+        }
+
+        static size_t lo_size(Plan const &p)
+        {
+            return p.hi_equal == TEST ? 2 + p.lo_and : 0;
+        }
+
+    public:
+        AtLeast(Arg arg, uint64_t value, bool invert, bool never = false)
+            : arg_(arg), value_(value), invert_(invert), never_(never)
+        {}
+
+        /// a > value is a >= value + 1, unless nothing is greater than value.
+        static AtLeast greater(Arg a, uint64_t value, bool invert)
+        {
+            uint64_t const max = a.is_signed ? ~uint64_t(0) >> 1 : ~uint64_t(0);
+            return AtLeast(a, value + 1, invert, value == max);
+        }
+
+        size_t size() const
+        {
+            Plan const p = plan();
+            return p.constant != TEST ? 1 : hi_size(p) + lo_size(p);
+        }
+
+        template <typename EMITTER>
+        void emit(EMITTER &e, size_t t, size_t f) const
+        {
+            if (invert_) {
+                std::swap(t, f);
+            }
+
+            Plan const p = plan();
+            if (p.constant != TEST) {
+                e.jump(p.constant == TRUE ? t : f);
+                return;
+            }
+
+            uint32_t const offset = offsetof(struct seccomp_data, args) + arg_.index * sizeof(uint64_t);
+            size_t const lo = e.pc() + hi_size(p);
+
+            if (p.hi) {
+                e.load(offset + sizeof(uint32_t));
+                if (p.hi_and) {
+                    e.alu_and(uint32_t(arg_.mask >> 32));
+                }
+                if (p.hi_xor) {
+                    e.alu_xor(0x80000000u);
+                }
+
+                if (p.hi_equal == TRUE) {
+                    e.jge(p.hi_k, t, f);
+                } else if (p.hi_equal == FALSE) {
+                    e.jgt(p.hi_k, t, f);
+                } else if (p.hi_k == ~uint32_t(0)) {
+                    e.jeq(p.hi_k, lo, f);  // nothing is greater
+                } else if (p.hi_k == 0) {
+                    e.jgt(p.hi_k, t, lo);  // nothing is less
+                } else {
+                    e.jgt(p.hi_k, t, e.pc() + 1);
+                    e.jeq(p.hi_k, lo, f);
+                }
+            }
+
+            if (p.hi_equal == TEST) {
+                e.load(offset);
+                if (p.lo_and) {
+                    e.alu_and(uint32_t(arg_.mask));
+                }
+                e.jge(p.lo_k, t, f);
+            }
+        }
+    };
+
+    template <typename L, typename R>
+    class And {
+        L l_;
+        R r_;
+
+    public:
+        And(L const &l, R const &r) : l_(l), r_(r) {}
+
+        size_t size() const { return l_.size() + r_.size(); }
+
+        template <typename EMITTER>
+        void emit(EMITTER &e, size_t t, size_t f) const
+        {
+            l_.emit(e, e.pc() + l_.size(), f);
+            r_.emit(e, t, f);
+        }
+    };
+
+    template <typename L, typename R>
+    class Or {
+        L l_;
+        R r_;
+
+    public:
+        Or(L const &l, R const &r) : l_(l), r_(r) {}
+
+        size_t size() const { return l_.size() + r_.size(); }
+
+        template <typename EMITTER>
+        void emit(EMITTER &e, size_t t, size_t f) const
+        {
+            l_.emit(e, t, e.pc() + l_.size());
+            r_.emit(e, t, f);
+        }
+    };
+
+    template <typename E>
+    class Not {
+        E e_;
+
+    public:
+        explicit Not(E const &e) : e_(e) {}
+
+        size_t size() const { return e_.size(); }
+
+        template <typename EMITTER>
+        void emit(EMITTER &e, size_t t, size_t f) const
+        {
+            e_.emit(e, f, t);
+        }
+    };
+
+    template <> struct is_predicate<Compare> : std::true_type {};
+    template <> struct is_predicate<AtLeast> : std::true_type {};
+    template <typename L, typename R> struct is_predicate<And<L, R>> : std::true_type {};
+    template <typename L, typename R> struct is_predicate<Or<L, R>> : std::true_type {};
+    template <typename E> struct is_predicate<Not<E>> : std::true_type {};
+
+    template <typename L, typename R>
+    using enable_if_predicates = std::enable_if_t<is_predicate<L>::value && is_predicate<R>::value>;
+
+    template <typename T, typename = enable_if_value<T>>
+    Compare operator==(Arg a, T value) { return Compare(a, static_cast<uint64_t>(value), true); }
+
+    template <typename T, typename = enable_if_value<T>>
+    Compare operator!=(Arg a, T value) { return Compare(a, static_cast<uint64_t>(value), false); }
+
+    template <typename T, typename = enable_if_value<T>>
+    Compare operator==(T value, Arg a) { return a == value; }
+
+    template <typename T, typename = enable_if_value<T>>
+    Compare operator!=(T value, Arg a) { return a != value; }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator>=(Arg a, T value) { return AtLeast(a, static_cast<uint64_t>(value), false); }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator<(Arg a, T value) { return AtLeast(a, static_cast<uint64_t>(value), true); }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator>(Arg a, T value) { return AtLeast::greater(a, static_cast<uint64_t>(value), false); }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator<=(Arg a, T value) { return AtLeast::greater(a, static_cast<uint64_t>(value), true); }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator<=(T value, Arg a) { return a >= value; }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator>(T value, Arg a) { return a < value; }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator<(T value, Arg a) { return a > value; }
+
+    template <typename T, typename = enable_if_value<T>>
+    AtLeast operator>=(T value, Arg a) { return a <= value; }
+
+    /// All of flags are set: one masked comparison.
+    template <typename T, typename = enable_if_value<T>>
+    Compare has(Arg a, T flags)
+    {
+        a.mask &= static_cast<uint64_t>(flags);
+        return Compare(a, a.mask, true);
+    }
+
+    /// None of flags is set.
+    template <typename T, typename = enable_if_value<T>>
+    Compare lacks(Arg a, T flags)
+    {
+        a.mask &= static_cast<uint64_t>(flags);
+        return Compare(a, 0, true);
+    }
+
+    /// No flag but those in flags is set, which an equality per allowed combination would take.
+    template <typename T, typename = enable_if_value<T>>
+    Compare only(Arg a, T flags)
+    {
+        a.mask &= ~static_cast<uint64_t>(flags);
+        return Compare(a, 0, true);
+    }
+
+    template <typename L, typename R, typename = enable_if_predicates<L, R>>
+    And<L, R> operator&&(L const &l, R const &r) { return And<L, R>(l, r); }
+
+    template <typename L, typename R, typename = enable_if_predicates<L, R>>
+    Or<L, R> operator||(L const &l, R const &r) { return Or<L, R>(l, r); }
+
+    template <typename E, typename = std::enable_if_t<is_predicate<E>::value>>
+    Not<E> operator!(E const &e) { return Not<E>(e); }
+
+    /// A system call that gets `action` when its arguments satisfy PRED. Otherwise the following
+    /// rules decide.
+    template <typename PRED>
+    class SeccompRule {
+        unsigned sysnr_;
+        uint32_t action_;
+        PRED pred_;
+
+    public:
+        SeccompRule(unsigned sysnr, uint32_t action, PRED const &pred)
+            : sysnr_(sysnr), action_(action), pred_(pred)
+        {}
+
+        template <typename VECTOR>
+        void push_into(VECTOR &v) const
+        {
+            Emitter<VECTOR> e(v);
+
+            // Load nr, compare, predicate, return. Past the end is the next rule.
+            size_t const end = 3 + pred_.size();
+
+            e.load(offsetof(struct seccomp_data, nr));
+            e.jeq(sysnr_, e.pc() + 1, end);
+            pred_.emit(e, end - 1, end);
+            e.ret(action_);
+
+            assert(e.pc() == end);
+        }
+    };
+
+    /// A system call that gets `action` regardless of its arguments, unless narrowed with when().
+    class SeccompRuleBuilder {
+        unsigned sysnr_;
+        uint32_t action_;
+
+    public:
+        SeccompRuleBuilder(unsigned sysnr, uint32_t action)
+            : sysnr_(sysnr), action_(action)
+        {}
+
+        template <typename PRED>
+        SeccompRule<PRED> when(PRED const &pred) const
+        {
+            static_assert(is_predicate<PRED>::value,
+                          "when() expects a predicate on arguments, e.g. arg(0) == 1");
+            return SeccompRule<PRED>(sysnr_, action_, pred);
+        }
+
+        template <typename VECTOR>
+        void push_into(VECTOR &v) const
+        {
+            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))));
+            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr_, 0, 1));
+            v.push_back(BPF_STMT(BPF_RET | BPF_K, action_));
+        }
+    };
+
+    inline SeccompRuleBuilder allow(unsigned sysnr)
+    {
+        return SeccompRuleBuilder(sysnr, SECCOMP_RET_ALLOW);
+    }
+
+    /// Fail the system call with the given errno instead of killing the process.
+    inline SeccompRuleBuilder deny(unsigned sysnr, int err)
+    {
+        return SeccompRuleBuilder(sysnr, SECCOMP_RET_ERRNO | (err & SECCOMP_RET_DATA));
+    }
+
+}
+}
+
+// EOF
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// A userspace model of how the kernel runs a seccomp cBPF program. It implements the subset of
+/// classic BPF that seccomp accepts, with loads going to struct seccomp_data.
+
+namespace seccomp {
+
+    struct EvalResult {
+        /// The SECCOMP_RET_* value the program returned.
+        uint32_t action;
+
+        /// Number of instructions executed, including the final return.
+        size_t executed;
+
+        /// Accumulator when the program returned.
+        uint32_t a;
+    };
+
+    struct EvalNoVisit {
+        void operator()(size_t) const {}
+    };
+
+    /// Run prog on data, calling visit(pc) for every executed instruction.
+    ///
+    /// The kernel checks programs when they are installed, so malformed programs (out of bounds
+    /// jumps or loads, falling off the end) are not expected here. They are treated as killing the
+    /// caller, which is what the kernel would refuse to install in the first place.
+    template <typename VISIT>
+    EvalResult evaluate(sock_filter const *prog, size_t len, seccomp_data const &data, VISIT &&visit)
+    {
+        uint32_t a = 0;
+        uint32_t x = 0;
+        uint32_t mem[BPF_MEMWORDS] = {};
+        size_t executed = 0;
+
+        for (size_t pc = 0; pc < len; pc++) {
+            sock_filter const &insn = prog[pc];
+            uint32_t const k = insn.k;
+
+            visit(pc);
+            executed++;
+
+            switch (insn.code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+                if (k % sizeof(uint32_t) != 0 || k + sizeof(uint32_t) > sizeof(data)) {
+                    return { SECCOMP_RET_KILL, executed, a };
+                }
+                memcpy(&a, reinterpret_cast<char const *>(&data) + k, sizeof(a));
+                break;
+            case BPF_LD | BPF_W | BPF_LEN:  a = sizeof(data); break;
+            case BPF_LDX | BPF_W | BPF_LEN: x = sizeof(data); break;
+            case BPF_LD | BPF_IMM:          a = k; break;
+            case BPF_LDX | BPF_IMM:         x = k; break;
+            case BPF_LD | BPF_MEM:          a = mem[k % BPF_MEMWORDS]; break;
+            case BPF_LDX | BPF_MEM:         x = mem[k % BPF_MEMWORDS]; break;
+            case BPF_ST:                    mem[k % BPF_MEMWORDS] = a; break;
+            case BPF_STX:                   mem[k % BPF_MEMWORDS] = x; break;
+
+            case BPF_ALU | BPF_ADD | BPF_K: a += k; break;
+            case BPF_ALU | BPF_ADD | BPF_X: a += x; break;
+            case BPF_ALU | BPF_SUB | BPF_K: a -= k; break;
+            case BPF_ALU | BPF_SUB | BPF_X: a -= x; break;
+            case BPF_ALU | BPF_MUL | BPF_K: a *= k; break;
+            case BPF_ALU | BPF_MUL | BPF_X: a *= x; break;
+            case BPF_ALU | BPF_DIV | BPF_K: a = k ? a / k : 0; break;
+            case BPF_ALU | BPF_DIV | BPF_X:
+                if (x == 0) {
+                    return { 0, executed, a };
+                }
+                a /= x;
+                break;
+            case BPF_ALU | BPF_MOD | BPF_K: a = k ? a % k : 0; break;
+            case BPF_ALU | BPF_MOD | BPF_X:
+                if (x == 0) {
+                    return { 0, executed, a };
+                }
+                a %= x;
+                break;
+            case BPF_ALU | BPF_AND | BPF_K: a &= k; break;
+            case BPF_ALU | BPF_AND | BPF_X: a &= x; break;
+            case BPF_ALU | BPF_OR | BPF_K:  a |= k; break;
+            case BPF_ALU | BPF_OR | BPF_X:  a |= x; break;
+            case BPF_ALU | BPF_XOR | BPF_K: a ^= k; break;
+            case BPF_ALU | BPF_XOR | BPF_X: a ^= x; break;
+            case BPF_ALU | BPF_LSH | BPF_K: a = k < 32 ? a << k : 0; break;
+            case BPF_ALU | BPF_LSH | BPF_X: a = x < 32 ? a << x : 0; break;
+            case BPF_ALU | BPF_RSH | BPF_K: a = k < 32 ? a >> k : 0; break;
+            case BPF_ALU | BPF_RSH | BPF_X: a = x < 32 ? a >> x : 0; break;
+            case BPF_ALU | BPF_NEG:         a = -a; break;
+
+            case BPF_JMP | BPF_JA:          pc += k; break;
+            case BPF_JMP | BPF_JEQ | BPF_K: pc += (a == k) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JEQ | BPF_X: pc += (a == x) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JGT | BPF_K: pc += (a > k) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JGT | BPF_X: pc += (a > x) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JGE | BPF_K: pc += (a >= k) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JGE | BPF_X: pc += (a >= x) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JSET | BPF_K: pc += (a & k) ? insn.jt : insn.jf; break;
+            case BPF_JMP | BPF_JSET | BPF_X: pc += (a & x) ? insn.jt : insn.jf; break;
+
+            case BPF_RET | BPF_K:           return { k, executed, a };
+            case BPF_RET | BPF_A:           return { a, executed, a };
+
+            case BPF_MISC | BPF_TAX:        x = a; break;
+            case BPF_MISC | BPF_TXA:        a = x; break;
+
+            default:
+                return { SECCOMP_RET_KILL, executed, a };
+            }
+        }
+
+        return { SECCOMP_RET_KILL, executed, a };
+    }
+
+    inline EvalResult evaluate(std::vector<sock_filter> const &prog, seccomp_data const &data)
+    {
+        return evaluate(prog.data(), prog.size(), data, EvalNoVisit());
+    }
+
+    /// What the kernel decides with filters installed one after another, in this order: the most
+    /// restrictive action, and of equally restrictive ones the last installed.
+    inline uint32_t evaluate_stacked(std::vector<std::vector<sock_filter>> const &filters, seccomp_data const &data)
+    {
+        uint32_t result = SECCOMP_RET_ALLOW;
+        for (auto f = filters.rbegin(); f != filters.rend(); ++f) {
+            uint32_t const action = evaluate(*f, data).action;
+            if (int32_t(action & SECCOMP_RET_ACTION_FULL) < int32_t(result & SECCOMP_RET_ACTION_FULL)) {
+                result = action;
+            }
+        }
+        return result;
+    }
+
+}
+
+// EOF
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "bpf_eval.hpp"
+
+/// Runs one filter over many seccomp_data records at once.
+///
+/// All lanes start at instruction 0. Every step picks the lowest instruction any lane is waiting
+/// at and runs it for the lanes that are there while the others wait. Jumps only go forward, so
+/// lanes meet again where paths join and every instruction runs at most once per batch. Loads read
+/// each lane's own record with a gather, and the per-instruction counts of a profile fall out for
+/// free.
+///
+/// The lanes are GCC vector extensions, so the same code is compiled for AVX2 (8 lanes) and
+/// AVX-512 (16 lanes) and picked at run time. Other machines use the scalar interpreter.
+
+namespace seccomp {
+
+    struct BatchResult {
+        uint32_t action;
+
+        /// Instructions executed, including the final return.
+        uint32_t executed;
+
+        /// Last instruction executed. For valid programs this is the return that decided.
+        uint32_t ret_pc;
+    };
+
+    enum class SimdLevel {
+        SCALAR,
+        AVX2,
+        AVX512,
+    };
+
+    inline char const *simd_level_name(SimdLevel level)
+    {
+        switch (level) {
+        case SimdLevel::AVX2:   return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        default:                return "scalar";
+        }
+    }
+
+    /// Best level this machine supports.
+    inline SimdLevel simd_level()
+    {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx512f")) {
+            return SimdLevel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::AVX2;
+        }
+#endif
+        return SimdLevel::SCALAR;
+    }
+
+    namespace batch_detail {
+
+        inline void evaluate_scalar(sock_filter const *prog, size_t len, seccomp_data const *data, size_t count,
+                                    BatchResult *out, uint64_t *profile)
+        {
+            for (size_t i = 0; i < count; i++) {
+                uint32_t ret_pc = 0;
+                EvalResult const r = evaluate(prog, len, data[i], [&] (size_t pc) {
+                    ret_pc = pc;
+                    if (profile != nullptr) {
+                        profile[pc]++;
+                    }
+                });
+
+                out[i] = { r.action, uint32_t(r.executed), ret_pc };
+            }
+        }
+
+#if defined(__x86_64__)
+
+        typedef uint32_t u32x8 __attribute__((vector_size(32)));
+        typedef uint32_t u32x16 __attribute__((vector_size(64)));
+
+        size_t const words_per_record = sizeof(seccomp_data) / sizeof(uint32_t);
+
+        // The helpers that need intrinsics come in one version per instruction set. The lane code
+        // calls them without knowing which, and the entry points flatten everything into
+        // themselves, so each ends up with its own copy compiled for its own instruction set.
+        // Results go through a reference, a 64 byte vector cannot be returned without AVX-512.
+
+        __attribute__((target("avx2")))
+        inline void gather(uint32_t const *base, u32x8 const &index, u32x8 &out)
+        {
+            out = (u32x8) _mm256_i32gather_epi32(reinterpret_cast<int const *>(base), (__m256i) index, 4);
+        }
+
+        __attribute__((target("avx512f")))
+        inline void gather(uint32_t const *base, u32x16 const &index, u32x16 &out)
+        {
+            out = (u32x16) _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xffff, (__m512i) index, base, 4);
+        }
+
+        /// Number of lanes that are all ones.
+        __attribute__((target("avx2")))
+        inline uint32_t lane_count(u32x8 const &mask)
+        {
+            return __builtin_popcount(_mm256_movemask_ps((__m256) mask));
+        }
+
+        __attribute__((target("avx512f")))
+        inline uint32_t lane_count(u32x16 const &mask)
+        {
+            return __builtin_popcount(_mm512_test_epi32_mask((__m512i) mask, (__m512i) mask));
+        }
+
+        /// Set the lanes of to where mask is all ones from value. Spelled out with bit operations
+        /// because GCC sometimes falls back to one lane at a time for ?: on 64 byte vectors.
+        template <typename V>
+        inline void blend(V &to, V const &mask, V const &value)
+        {
+            to = (value & mask) | (to & ~mask);
+        }
+
+        /// One batch of up to N records. pending is a bit set of the instructions some lane waits
+        /// at, with bit len standing for having fallen off the end. It is all zero before and
+        /// after.
+        template <typename V, unsigned N>
+        inline void evaluate_lanes(sock_filter const *prog, uint32_t len, seccomp_data const *data, size_t count,
+                                   BatchResult *out, uint64_t *profile, uint64_t *pending)
+        {
+            uint32_t const done = UINT32_MAX;
+
+            V pc, index;
+            for (unsigned i = 0; i < N; i++) {
+                pc[i] = i < count ? 0 : done;
+                index[i] = i < count ? i * words_per_record : 0;
+            }
+
+            V a = {}, x = {}, executed = {}, action = {}, ret_pc = {};
+            V mem[BPF_MEMWORDS] = {};
+            V const zero = {};
+            uint32_t const *words = reinterpret_cast<uint32_t const *>(data);
+
+            pending[0] = 1;
+
+            for (uint32_t word = 0; word <= len / 64; ) {
+                if (pending[word] == 0) {
+                    word++;
+                    continue;
+                }
+
+                uint32_t const now = word * 64 + __builtin_ctzll(pending[word]);
+                pending[word] &= pending[word] - 1;
+
+                V const here = pc == now;  // all ones in lanes at this instruction
+
+                // Falling off the end kills, like the scalar interpreter.
+                if (now == len) {
+                    blend(action, here, zero + SECCOMP_RET_KILL);
+                    break;
+                }
+
+                sock_filter const &insn = prog[now];
+                uint32_t const k = insn.k;
+
+                executed -= here;
+                blend(ret_pc, here, zero + now);
+                if (profile != nullptr) {
+                    profile[now] += lane_count(here);
+                }
+
+                // Where lanes go next, to if_true where taken is set and to if_false elsewhere, and
+                // which ones end here with result.
+                uint64_t if_true = now + 1;
+                uint64_t if_false = now + 1;
+                V taken = here;
+                V stop = zero;
+                V result = zero;
+                V set_a = a;
+
+                switch (insn.code) {
+                case BPF_LD | BPF_W | BPF_ABS:
+                    if (k % sizeof(uint32_t) != 0 || k + sizeof(uint32_t) > sizeof(seccomp_data)) {
+                        stop = here;
+                        result = zero + SECCOMP_RET_KILL;
+                    } else {
+                        gather(words + k / sizeof(uint32_t), index, set_a);
+                    }
+                    break;
+                case BPF_LD | BPF_W | BPF_LEN:  set_a = zero + uint32_t(sizeof(seccomp_data)); break;
+                case BPF_LDX | BPF_W | BPF_LEN: blend(x, here, zero + uint32_t(sizeof(seccomp_data))); break;
+                case BPF_LD | BPF_IMM:          set_a = zero + k; break;
+                case BPF_LDX | BPF_IMM:         blend(x, here, zero + k); break;
+                case BPF_LD | BPF_MEM:          set_a = mem[k % BPF_MEMWORDS]; break;
+                case BPF_LDX | BPF_MEM:         blend(x, here, mem[k % BPF_MEMWORDS]); break;
+                case BPF_ST:                    blend(mem[k % BPF_MEMWORDS], here, a); break;
+                case BPF_STX:                   blend(mem[k % BPF_MEMWORDS], here, x); break;
+
+                case BPF_ALU | BPF_ADD | BPF_K: set_a = a + k; break;
+                case BPF_ALU | BPF_ADD | BPF_X: set_a = a + x; break;
+                case BPF_ALU | BPF_SUB | BPF_K: set_a = a - k; break;
+                case BPF_ALU | BPF_SUB | BPF_X: set_a = a - x; break;
+                case BPF_ALU | BPF_MUL | BPF_K: set_a = a * k; break;
+                case BPF_ALU | BPF_MUL | BPF_X: set_a = a * x; break;
+                case BPF_ALU | BPF_DIV | BPF_K: set_a = k ? a / k : zero; break;
+                case BPF_ALU | BPF_MOD | BPF_K: set_a = k ? a % k : zero; break;
+                case BPF_ALU | BPF_DIV | BPF_X:
+                case BPF_ALU | BPF_MOD | BPF_X: {
+                    // Dividing by zero returns 0, so those lanes stop before dividing.
+                    V const by_zero = x == 0;
+                    stop = here & by_zero;
+                    V safe = x;
+                    blend(safe, by_zero, zero + 1);
+                    set_a = BPF_OP(insn.code) == BPF_DIV ? a / safe : a % safe;
+                    break;
+                }
+                case BPF_ALU | BPF_AND | BPF_K: set_a = a & k; break;
+                case BPF_ALU | BPF_AND | BPF_X: set_a = a & x; break;
+                case BPF_ALU | BPF_OR | BPF_K:  set_a = a | k; break;
+                case BPF_ALU | BPF_OR | BPF_X:  set_a = a | x; break;
+                case BPF_ALU | BPF_XOR | BPF_K: set_a = a ^ k; break;
+                case BPF_ALU | BPF_XOR | BPF_X: set_a = a ^ x; break;
+                case BPF_ALU | BPF_LSH | BPF_K: set_a = k < 32 ? a << k : zero; break;
+                case BPF_ALU | BPF_LSH | BPF_X: set_a = (a << (x & 31)) & (x < 32); break;
+                case BPF_ALU | BPF_RSH | BPF_K: set_a = k < 32 ? a >> k : zero; break;
+                case BPF_ALU | BPF_RSH | BPF_X: set_a = (a >> (x & 31)) & (x < 32); break;
+                case BPF_ALU | BPF_NEG:         set_a = -a; break;
+
+                case BPF_JMP | BPF_JA:
+                    if_true = now + 1 + uint64_t(k);
+                    break;
+                case BPF_JMP | BPF_JEQ | BPF_K:
+                case BPF_JMP | BPF_JEQ | BPF_X:
+                case BPF_JMP | BPF_JGT | BPF_K:
+                case BPF_JMP | BPF_JGT | BPF_X:
+                case BPF_JMP | BPF_JGE | BPF_K:
+                case BPF_JMP | BPF_JGE | BPF_X:
+                case BPF_JMP | BPF_JSET | BPF_K:
+                case BPF_JMP | BPF_JSET | BPF_X: {
+                    V const b = BPF_SRC(insn.code) == BPF_X ? x : zero + k;
+                    switch (BPF_OP(insn.code)) {
+                    case BPF_JEQ: taken = a == b; break;
+                    case BPF_JGT: taken = a > b; break;
+                    case BPF_JGE: taken = a >= b; break;
+                    default:      taken = (a & b) != 0; break;
+                    }
+                    if_true += insn.jt;
+                    if_false += insn.jf;
+                    break;
+                }
+
+                case BPF_RET | BPF_K:
+                    stop = here;
+                    result = zero + k;
+                    break;
+                case BPF_RET | BPF_A:
+                    stop = here;
+                    result = a;
+                    break;
+
+                case BPF_MISC | BPF_TAX:        blend(x, here, a); break;
+                case BPF_MISC | BPF_TXA:        set_a = x; break;
+
+                default:
+                    stop = here;
+                    result = zero + SECCOMP_RET_KILL;
+                    break;
+                }
+
+                if_true = std::min<uint64_t>(if_true, len);
+                if_false = std::min<uint64_t>(if_false, len);
+
+                V const go = here & ~stop;
+                V const go_true = go & taken;
+                V const go_false = go & ~taken;
+
+                blend(a, here, set_a);
+                blend(action, stop, result);
+                blend(pc, stop, zero + done);
+                blend(pc, go_false, zero + uint32_t(if_false));
+                blend(pc, go_true, zero + uint32_t(if_true));
+
+                if (lane_count(go_true) != 0) {
+                    pending[if_true / 64] |= 1ULL << (if_true % 64);
+                }
+                if (lane_count(go_false) != 0) {
+                    pending[if_false / 64] |= 1ULL << (if_false % 64);
+                }
+            }
+
+            for (unsigned i = 0; i < N && i < count; i++) {
+                out[i] = { action[i], executed[i], ret_pc[i] };
+            }
+        }
+
+        __attribute__((target("avx2"), flatten))
+        inline void evaluate_avx2(sock_filter const *prog, size_t len, seccomp_data const *data, size_t count,
+                                  BatchResult *out, uint64_t *profile)
+        {
+            uint64_t pending[BPF_MAXINSNS / 64 + 1] = {};
+            for (size_t i = 0; i < count; i += 8) {
+                evaluate_lanes<u32x8, 8>(prog, len, data + i, count - i, out + i, profile, pending);
+            }
+        }
+
+        __attribute__((target("avx512f"), flatten))
+        inline void evaluate_avx512(sock_filter const *prog, size_t len, seccomp_data const *data, size_t count,
+                                    BatchResult *out, uint64_t *profile)
+        {
+            uint64_t pending[BPF_MAXINSNS / 64 + 1] = {};
+            for (size_t i = 0; i < count; i += 16) {
+                evaluate_lanes<u32x16, 16>(prog, len, data + i, count - i, out + i, profile, pending);
+            }
+        }
+
+#endif
+
+    }
+
+    /// Evaluate prog for count records. With a profile, profile[pc] is increased once for every
+    /// record that executes instruction pc.
+    inline void evaluate_batch(sock_filter const *prog, size_t len, seccomp_data const *data, size_t count,
+                               BatchResult *out, uint64_t *profile = nullptr, SimdLevel level = simd_level())
+    {
+        // The kernel does not take longer programs, and the lanes only keep track of that many.
+        if (len > BPF_MAXINSNS) {
+            level = SimdLevel::SCALAR;
+        }
+
+        switch (level) {
+#if defined(__x86_64__)
+        case SimdLevel::AVX512:
+            batch_detail::evaluate_avx512(prog, len, data, count, out, profile);
+            break;
+        case SimdLevel::AVX2:
+            batch_detail::evaluate_avx2(prog, len, data, count, out, profile);
+            break;
+#endif
+        default:
+            batch_detail::evaluate_scalar(prog, len, data, count, out, profile);
+            break;
+        }
+    }
+
+    inline void evaluate_batch(std::vector<sock_filter> const &prog, std::vector<seccomp_data> const &data,
+                               std::vector<BatchResult> &out, uint64_t *profile = nullptr,
+                               SimdLevel level = simd_level())
+    {
+        out.resize(data.size());
+        evaluate_batch(prog.data(), prog.size(), data.data(), data.size(), out.data(), profile, level);
+    }
+
+}
+
+// EOF
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/// Static checks and a cost model for compiled seccomp filters.
+///
+/// The filter is run symbolically once per system call number with the architecture and number
+/// known and the arguments unknown, which is also how the kernel decides which system calls it can
+/// cache as always allowed. Where the program branches on an argument, both sides are followed.
+
+namespace seccomp {
+
+    /// What a filter can do for one system call number.
+    struct SyscallPaths {
+        /// Every action some combination of arguments leads to.
+        std::set<uint32_t> actions;
+
+        /// Shortest and longest number of executed instructions.
+        size_t min_len = 0;
+        size_t max_len = 0;
+
+        /// First instruction the kernel's cache check does not follow, if any: a load of anything
+        /// but nr or arch, or arithmetic other than and with a constant. The kernel cannot cache
+        /// the verdict for this system call then.
+        size_t first_uncacheable = SIZE_MAX;
+
+        /// Which instructions can execute.
+        std::vector<bool> visited;
+
+        /// Whether the kernel's action cache can skip the filter for this system call.
+        bool cacheable() const
+        {
+            return first_uncacheable == SIZE_MAX && actions.size() == 1 && *actions.begin() == SECCOMP_RET_ALLOW;
+        }
+    };
+
+    inline SyscallPaths analyze_syscall(std::vector<sock_filter> const &prog, uint32_t arch, uint32_t nr)
+    {
+        struct State {
+            bool reached = false;
+            bool known = false;
+            uint32_t a = 0;
+            size_t min_len = SIZE_MAX;
+            size_t max_len = 0;
+        };
+
+        SyscallPaths result;
+        result.visited.assign(prog.size(), false);
+        result.min_len = SIZE_MAX;
+
+        std::vector<State> states(prog.size() + 1);
+        states[0].reached = true;
+        states[0].known = true;
+        states[0].min_len = 0;
+
+        auto flow = [&] (size_t to, State const &from, bool known, uint32_t a) {
+            State &s = states[std::min(to, prog.size())];
+            if (!s.reached) {
+                s.reached = true;
+                s.known = known;
+                s.a = a;
+            } else if (!known || !s.known || s.a != a) {
+                s.known = false;
+            }
+            s.min_len = std::min(s.min_len, from.min_len + 1);
+            s.max_len = std::max(s.max_len, from.max_len + 1);
+        };
+
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            State const &s = states[pc];
+            if (!s.reached) {
+                continue;
+            }
+            result.visited[pc] = true;
+
+            sock_filter const &insn = prog[pc];
+            uint32_t const k = insn.k;
+
+            switch (BPF_CLASS(insn.code)) {
+            case BPF_LD:
+                if (insn.code == (BPF_LD | BPF_W | BPF_ABS) && k == offsetof(struct seccomp_data, nr)) {
+                    flow(pc + 1, s, true, nr);
+                } else if (insn.code == (BPF_LD | BPF_W | BPF_ABS) && k == offsetof(struct seccomp_data, arch)) {
+                    flow(pc + 1, s, true, arch);
+                } else {
+                    // Like the kernel's check, constants and the length are not followed either.
+                    result.first_uncacheable = std::min(result.first_uncacheable, pc);
+                    flow(pc + 1, s, false, 0);
+                }
+                break;
+            case BPF_ALU:
+                // seccomp_is_const_allow() only follows and with a constant.
+                if (insn.code == (BPF_ALU | BPF_AND | BPF_K)) {
+                    flow(pc + 1, s, s.known, s.a & k);
+                } else {
+                    result.first_uncacheable = std::min(result.first_uncacheable, pc);
+                    flow(pc + 1, s, false, 0);
+                }
+                break;
+            case BPF_JMP: {
+                if (BPF_OP(insn.code) == BPF_JA) {
+                    flow(pc + 1 + k, s, s.known, s.a);
+                    break;
+                }
+
+                if (BPF_SRC(insn.code) == BPF_X) {
+                    result.first_uncacheable = std::min(result.first_uncacheable, pc);
+                }
+                bool taken = false;
+                bool const known = s.known && BPF_SRC(insn.code) == BPF_K;
+                if (known) {
+                    switch (BPF_OP(insn.code)) {
+                    case BPF_JEQ:  taken = s.a == k; break;
+                    case BPF_JGT:  taken = s.a > k; break;
+                    case BPF_JGE:  taken = s.a >= k; break;
+                    case BPF_JSET: taken = (s.a & k) != 0; break;
+                    }
+                }
+
+                if (!known || taken) {
+                    flow(pc + 1 + insn.jt, s, s.known, s.a);
+                }
+                if (!known || !taken) {
+                    flow(pc + 1 + insn.jf, s, s.known, s.a);
+                }
+                break;
+            }
+            case BPF_RET:
+                // Returning A or X depends on more than we know.
+                result.actions.insert(BPF_RVAL(insn.code) == BPF_K ? k : SECCOMP_RET_ACTION_FULL);
+                result.min_len = std::min(result.min_len, s.min_len + 1);
+                result.max_len = std::max(result.max_len, s.max_len + 1);
+                break;
+            default:
+                // Scratch memory and X are not tracked, nor followed by the kernel.
+                result.first_uncacheable = std::min(result.first_uncacheable, pc);
+                flow(pc + 1, s, false, 0);
+                break;
+            }
+        }
+
+        // Falling off the end is not a valid program, but do not hide it either.
+        if (states[prog.size()].reached) {
+            result.actions.insert(SECCOMP_RET_KILL);
+        }
+
+        if (result.min_len == SIZE_MAX) {
+            result.min_len = 0;
+        }
+
+        return result;
+    }
+
+    struct LintOptions {
+        uint32_t arch = AUDIT_ARCH_X86_64;
+
+        /// System call numbers 0 to max_syscall - 1 are checked.
+        unsigned max_syscall = 1024;
+
+        /// System calls that should be decided quickly.
+        std::vector<unsigned> hot_syscalls;
+
+        /// Instructions a hot system call may take in the worst case.
+        size_t hot_max_len = 8;
+    };
+
+    struct LintFinding {
+        enum Severity { WARNING, ERROR } severity;
+
+        /// Index of the rule the finding is about, or -1 if it is about the filter as a whole.
+        long rule;
+
+        std::string message;
+    };
+
+    struct LintReport {
+        std::vector<LintFinding> findings;
+
+        /// Longest path any system call takes through the filter.
+        size_t worst_len = 0;
+
+        /// Average over all system call numbers of their longest path.
+        double average_len = 0;
+
+        size_t errors() const
+        {
+            return std::count_if(findings.begin(), findings.end(),
+                                 [] (LintFinding const &f) { return f.severity == LintFinding::ERROR; });
+        }
+    };
+
+    /// Check a compiled filter. rule_bounds are the offsets where each rule begins, in order,
+    /// followed by where the last one ends. What comes before and after is the prologue and the
+    /// default action. It can be empty, then findings are reported by instruction only.
+    inline LintReport lint(std::vector<sock_filter> const &prog, std::vector<size_t> const &rule_bounds,
+                           LintOptions const &opts)
+    {
+        LintReport report;
+
+        auto rule_of = [&] (size_t pc) -> long {
+            if (rule_bounds.empty() || pc >= rule_bounds.back()) {
+                return -1;
+            }
+            auto it = std::upper_bound(rule_bounds.begin(), rule_bounds.end(), pc);
+            return long(it - rule_bounds.begin()) - 1;
+        };
+        auto add = [&] (LintFinding::Severity severity, long rule, std::string const &message) {
+            report.findings.push_back({ severity, rule, message });
+        };
+
+        std::vector<bool> reachable(prog.size(), false);
+        std::map<size_t, std::vector<unsigned>> uncached;
+        double total_len = 0;
+
+        for (unsigned nr = 0; nr < opts.max_syscall; nr++) {
+            SyscallPaths const paths = analyze_syscall(prog, opts.arch, nr);
+
+            for (size_t pc = 0; pc < prog.size(); pc++) {
+                if (paths.visited[pc]) {
+                    reachable[pc] = true;
+                }
+            }
+
+            report.worst_len = std::max(report.worst_len, paths.max_len);
+            total_len += paths.max_len;
+
+            // The kernel only caches system calls that are always allowed. If this one would be
+            // allowed anyway, the first instruction its check cannot follow is in the way.
+            bool const allowed_anyway = paths.first_uncacheable != SIZE_MAX &&
+                paths.actions.size() == 1 && *paths.actions.begin() == SECCOMP_RET_ALLOW;
+            if (allowed_anyway) {
+                uncached[paths.first_uncacheable].push_back(nr);
+            }
+
+            if (std::find(opts.hot_syscalls.begin(), opts.hot_syscalls.end(), nr) != opts.hot_syscalls.end() &&
+                paths.max_len > opts.hot_max_len) {
+                add(LintFinding::WARNING, -1,
+                    "hot system call " + std::to_string(nr) + " takes up to " + std::to_string(paths.max_len) +
+                    " instructions (limit " + std::to_string(opts.hot_max_len) + "), move its rule further up");
+            }
+        }
+
+        report.average_len = opts.max_syscall ? total_len / opts.max_syscall : 0;
+
+        for (auto const &u : uncached) {
+            std::string nrs;
+            for (size_t i = 0; i < u.second.size() && i < 8; i++) {
+                nrs += (i ? ", " : "") + std::to_string(u.second[i]);
+            }
+            if (u.second.size() > 8) {
+                nrs += ", ...";
+            }
+
+            add(LintFinding::WARNING, rule_of(u.first),
+                "instruction " + std::to_string(u.first) + " " +
+                (BPF_CLASS(prog[u.first].code) == BPF_ALU ? "does arithmetic" :
+                 prog[u.first].code == (BPF_LD | BPF_W | BPF_ABS) ? "loads an argument" :
+                 "uses X, scratch memory or a constant") +
+                " on the way to " +
+                std::to_string(u.second.size()) + " system calls that are always allowed (" + nrs +
+                "), so the kernel cannot cache them");
+        }
+
+        // A rule is dead if none of its returns can be reached.
+        for (size_t r = 0; r + 1 < rule_bounds.size(); r++) {
+            size_t const begin = rule_bounds[r];
+            size_t const end = rule_bounds[r + 1];
+            bool live = false;
+
+            for (size_t pc = begin; pc < end; pc++) {
+                if (BPF_CLASS(prog[pc].code) == BPF_RET && reachable[pc]) {
+                    live = true;
+                }
+            }
+
+            if (!live) {
+                add(LintFinding::ERROR, long(r), "rule can never decide anything, it is shadowed by earlier rules");
+            }
+        }
+
+        // Reloading nr while A already holds it. Only straight-line knowledge is used: a load is
+        // redundant if every way to reach it comes with A = nr.
+        std::vector<int> holds_nr(prog.size() + 1, -1);
+        holds_nr[0] = 0;
+        auto flow = [&] (size_t to, bool nr) {
+            int &h = holds_nr[std::min(to, prog.size())];
+            h = (h == -1) ? nr : (h && nr);
+        };
+
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            sock_filter const &insn = prog[pc];
+            bool const is_nr_load = insn.code == (BPF_LD | BPF_W | BPF_ABS) &&
+                insn.k == offsetof(struct seccomp_data, nr);
+
+            if (is_nr_load && holds_nr[pc] == 1 && reachable[pc]) {
+                add(LintFinding::WARNING, rule_of(pc),
+                    "instruction " + std::to_string(pc) + " reloads nr, which is already in the accumulator");
+            }
+
+            switch (BPF_CLASS(insn.code)) {
+            case BPF_RET:
+                break;
+            case BPF_JMP:
+                if (BPF_OP(insn.code) == BPF_JA) {
+                    flow(pc + 1 + insn.k, holds_nr[pc] == 1);
+                } else {
+                    flow(pc + 1 + insn.jt, holds_nr[pc] == 1);
+                    flow(pc + 1 + insn.jf, holds_nr[pc] == 1);
+                }
+                break;
+            case BPF_LD:
+                flow(pc + 1, is_nr_load);
+                break;
+            case BPF_ST:
+            case BPF_STX:
+            case BPF_LDX:
+                flow(pc + 1, holds_nr[pc] == 1);
+                break;
+            default:
+                flow(pc + 1, false);
+                break;
+            }
+        }
+
+        return report;
+    }
+
+    inline void print_lint_report(FILE *out, LintReport const &report)
+    {
+        for (LintFinding const &f : report.findings) {
+            fprintf(out, "%s: ", f.severity == LintFinding::ERROR ? "error" : "warning");
+            if (f.rule >= 0) {
+                fprintf(out, "rule %ld: ", f.rule);
+            }
+            fprintf(out, "%s\n", f.message.c_str());
+        }
+
+        fprintf(out, "cost: worst case %zu instructions, %.1f on average per system call number\n",
+                report.worst_len, report.average_len);
+        fprintf(out, "%zu errors, %zu warnings\n", report.errors(), report.findings.size() - report.errors());
+    }
+
+}
+
+// EOF
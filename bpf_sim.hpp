@@ -0,0 +1,369 @@
+#pragma once
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "bpf_disasm.hpp"
+#include "bpf_eval.hpp"
+#include "bpf_eval_batch.hpp"
+#include "bpf_lint.hpp"
+#include "syscall_names.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+/// Replays recorded system calls through a compiled filter to see what it costs on real traffic.
+///
+/// Besides running the filter, the model includes the kernel's action cache: system calls the
+/// filter always allows without looking at their arguments never run the filter at all.
+
+namespace seccomp {
+
+    struct SimOptions {
+        /// Architecture the kernel keeps its action cache for. Calls from other architectures
+        /// always run the filter.
+        uint32_t arch = AUDIT_ARCH_X86_64;
+
+        /// System call numbers the action cache covers.
+        unsigned max_syscall = 1024;
+
+        /// Turn off to see what the filter would cost on kernels before 5.11.
+        bool action_cache = true;
+
+        /// How to run the filter over many records.
+        SimdLevel simd = simd_level();
+    };
+
+    struct SyscallCost {
+        uint64_t calls = 0;
+        uint64_t executed = 0;
+        uint64_t cached = 0;
+        size_t min_len = SIZE_MAX;
+        size_t max_len = 0;
+
+        void merge(SyscallCost const &other)
+        {
+            calls += other.calls;
+            executed += other.executed;
+            cached += other.cached;
+            min_len = std::min(min_len, other.min_len);
+            max_len = std::max(max_len, other.max_len);
+        }
+    };
+
+    struct SimReport {
+        uint64_t calls = 0;
+        uint64_t executed = 0;
+
+        /// Calls answered by the action cache without running the filter.
+        uint64_t cached = 0;
+
+        std::map<uint32_t, SyscallCost> syscalls;
+
+        /// How many calls executed exactly i instructions. Cached calls count as 0.
+        std::vector<uint64_t> path_lengths;
+
+        /// How many calls each rule decided. The last entry counts calls decided outside of any
+        /// rule, by the prologue or the default action. Empty without rule bounds.
+        std::vector<uint64_t> rule_hits;
+
+        /// How many calls ended in each return value.
+        std::map<uint32_t, uint64_t> actions;
+
+        /// How often each instruction executed, in the format write_dot takes.
+        Profile profile;
+
+        /// Add the counts of another replay, e.g. of another part of the same trace.
+        void merge(SimReport const &other)
+        {
+            calls += other.calls;
+            executed += other.executed;
+            cached += other.cached;
+
+            for (auto const &s : other.syscalls) {
+                syscalls[s.first].merge(s.second);
+            }
+
+            auto add = [] (std::vector<uint64_t> &to, std::vector<uint64_t> const &from) {
+                to.resize(std::max(to.size(), from.size()), 0);
+                for (size_t i = 0; i < from.size(); i++) {
+                    to[i] += from[i];
+                }
+            };
+            add(path_lengths, other.path_lengths);
+            add(rule_hits, other.rule_hits);
+            add(profile, other.profile);
+
+            for (auto const &a : other.actions) {
+                actions[a.first] += a.second;
+            }
+        }
+
+        /// Smallest path length that at least fraction p of all calls stay within.
+        size_t percentile(double p) const
+        {
+            uint64_t const want = uint64_t(p * calls + 0.5);
+            uint64_t seen = 0;
+            for (size_t len = 0; len < path_lengths.size(); len++) {
+                seen += path_lengths[len];
+                if (seen >= want && seen > 0) {
+                    return len;
+                }
+            }
+            return path_lengths.empty() ? 0 : path_lengths.size() - 1;
+        }
+    };
+
+    class FilterSimulator {
+        std::vector<sock_filter> const prog_;
+        std::vector<size_t> const rule_bounds_;
+        SimOptions const opts_;
+        std::vector<bool> cached_;
+
+        bool cached(TraceRecord const &rec) const
+        {
+            return rec.arch == opts_.arch && rec.nr < cached_.size() && cached_[rec.nr];
+        }
+
+        /// Count one call the filter decided as in result, except for its action. The profile is
+        /// up to the caller.
+        void account(BatchResult const &result, bool from_cache, SyscallCost &c, SimReport &report) const
+        {
+            size_t const len = from_cache ? 0 : result.executed;
+
+            report.calls++;
+            report.executed += len;
+            report.cached += from_cache;
+
+            c.calls++;
+            c.executed += len;
+            c.cached += from_cache;
+            c.min_len = std::min(c.min_len, len);
+            c.max_len = std::max(c.max_len, len);
+
+            if (report.path_lengths.size() <= len) {
+                report.path_lengths.resize(len + 1, 0);
+            }
+            report.path_lengths[len]++;
+
+            if (!rule_bounds_.empty()) {
+                auto const it = std::upper_bound(rule_bounds_.begin(), rule_bounds_.end(), result.ret_pc);
+                size_t const rule = (it == rule_bounds_.begin() || it == rule_bounds_.end())
+                    ? rule_bounds_.size() - 1 : size_t(it - rule_bounds_.begin()) - 1;
+                report.rule_hits[rule]++;
+            }
+        }
+
+    public:
+        /// rule_bounds are as for lint(): where each rule begins followed by where the last one
+        /// ends. It can be empty.
+        FilterSimulator(std::vector<sock_filter> const &prog, std::vector<size_t> const &rule_bounds,
+                        SimOptions const &opts = SimOptions())
+            : prog_(prog), rule_bounds_(rule_bounds), opts_(opts), cached_(opts.max_syscall, false)
+        {
+            if (opts_.action_cache) {
+                for (unsigned nr = 0; nr < opts_.max_syscall; nr++) {
+                    cached_[nr] = analyze_syscall(prog_, opts_.arch, nr).cacheable();
+                }
+            }
+        }
+
+        /// An empty report sized for this filter.
+        SimReport report() const
+        {
+            SimReport r;
+            r.profile.assign(prog_.size(), 0);
+            if (!rule_bounds_.empty()) {
+                r.rule_hits.assign(rule_bounds_.size(), 0);
+            }
+            return r;
+        }
+
+        void replay(TraceRecord const &rec, SimReport &report) const
+        {
+            bool const c = cached(rec);
+            seccomp_data const data = rec.data();
+            BatchResult result;
+            evaluate_batch(prog_.data(), prog_.size(), &data, 1, &result,
+                           c ? nullptr : report.profile.data(), SimdLevel::SCALAR);
+            account(result, c, report.syscalls[rec.nr], report);
+            report.actions[result.action]++;
+        }
+
+        /// Buffers for replaying many records at once, kept between calls.
+        struct Scratch {
+            std::vector<seccomp_data> data[2];
+            std::vector<TraceRecord const *> which[2];
+            std::vector<BatchResult> results;
+            std::vector<SyscallCost> per_nr;
+            std::vector<std::pair<uint32_t, uint64_t>> actions;
+        };
+
+        /// Replay many records at once with the batch evaluator.
+        void replay(TraceRecord const *recs, size_t count, SimReport &report, Scratch &scratch) const
+        {
+            // Cached calls do not run the filter, so they stay out of the profile.
+            for (int c = 0; c < 2; c++) {
+                scratch.data[c].clear();
+                scratch.which[c].clear();
+            }
+            for (size_t i = 0; i < count; i++) {
+                bool const c = cached(recs[i]);
+                scratch.data[c].push_back(recs[i].data());
+                scratch.which[c].push_back(&recs[i]);
+            }
+
+            // Looking up the maps of the report for every call would cost more than running the
+            // filter, so this counts into flat arrays first.
+            std::vector<SyscallCost> &per_nr = scratch.per_nr;
+            std::vector<std::pair<uint32_t, uint64_t>> &actions = scratch.actions;
+            per_nr.assign(opts_.max_syscall, SyscallCost());
+            actions.clear();
+
+            for (int c = 0; c < 2; c++) {
+                std::vector<BatchResult> &results = scratch.results;
+                evaluate_batch(prog_, scratch.data[c], results, c ? nullptr : report.profile.data(), opts_.simd);
+
+                for (size_t i = 0; i < results.size(); i++) {
+                    uint32_t const nr = scratch.which[c][i]->nr;
+                    account(results[i], c, nr < per_nr.size() ? per_nr[nr] : report.syscalls[nr], report);
+
+                    auto a = std::find_if(actions.begin(), actions.end(), [&] (auto const &p) {
+                        return p.first == results[i].action;
+                    });
+                    if (a == actions.end()) {
+                        a = actions.insert(a, { results[i].action, 0 });
+                    }
+                    a->second++;
+                }
+            }
+
+            for (uint32_t nr = 0; nr < per_nr.size(); nr++) {
+                if (per_nr[nr].calls != 0) {
+                    report.syscalls[nr].merge(per_nr[nr]);
+                }
+            }
+            for (auto const &a : actions) {
+                report.actions[a.first] += a.second;
+            }
+        }
+
+        SimReport replay(TraceReader const &trace) const
+        {
+            SimReport r = report();
+            std::vector<TraceRecord> records;
+            std::vector<uint8_t> buffer;
+            Scratch scratch;
+            for (size_t b = 0; b < trace.blocks(); b++) {
+                trace.decode(b, records, buffer);
+                replay(records.data(), records.size(), r, scratch);
+            }
+            return r;
+        }
+
+        /// Replay on every worker of pool. Each task is a run of whole blocks, and every worker
+        /// counts into its own report. They are only merged once all tasks are done.
+        SimReport replay(TraceReader const &trace, WorkStealingPool &pool) const
+        {
+            struct Worker {
+                SimReport report;
+                std::vector<TraceRecord> records;
+                std::vector<uint8_t> buffer;
+                Scratch scratch;
+                char pad[64];  // keeps the counters of neighbours off each other's cache lines
+            };
+
+            std::vector<Worker> workers(pool.workers());
+            for (Worker &w : workers) {
+                w.report = report();
+            }
+
+            // Enough tasks that stealing can even out the load, few enough to keep them cheap.
+            size_t const per_task = std::max<size_t>(1, trace.blocks() / (pool.workers() * 16));
+            size_t const tasks = (trace.blocks() + per_task - 1) / per_task;
+
+            pool.run(tasks, [&] (unsigned worker, size_t task) {
+                Worker &w = workers[worker];
+                size_t const end = std::min(trace.blocks(), (task + 1) * per_task);
+                for (size_t b = task * per_task; b < end; b++) {
+                    trace.decode(b, w.records, w.buffer);
+                    replay(w.records.data(), w.records.size(), w.report, w.scratch);
+                }
+            });
+
+            SimReport r = report();
+            for (Worker const &w : workers) {
+                r.merge(w.report);
+            }
+            return r;
+        }
+
+        SimReport replay(TraceStream &trace) const
+        {
+            SimReport r = report();
+            TraceRecord rec;
+            while (trace.next(rec)) {
+                replay(rec, r);
+            }
+            return r;
+        }
+    };
+
+    /// Summary, path length distribution, the `top` system calls that cost the most and what every
+    /// rule decided.
+    inline void print_sim_report(FILE *out, SimReport const &r, size_t top = 20)
+    {
+        double const calls = r.calls ? double(r.calls) : 1.0;
+
+        fprintf(out, "%" PRIu64 " calls, %" PRIu64 " instructions, %.2f per call, %.1f%% cached\n",
+                r.calls, r.executed, r.executed / calls, 100.0 * r.cached / calls);
+        fprintf(out, "path length: p50 %zu, p90 %zu, p99 %zu, max %zu\n",
+                r.percentile(0.5), r.percentile(0.9), r.percentile(0.99), r.percentile(1.0));
+
+        for (size_t len = 0; len < r.path_lengths.size(); len++) {
+            if (r.path_lengths[len] != 0) {
+                fprintf(out, "  %4zu %12" PRIu64 " %6.2f%%\n", len, r.path_lengths[len],
+                        100.0 * r.path_lengths[len] / calls);
+            }
+        }
+
+        std::vector<std::pair<uint32_t, SyscallCost>> costly(r.syscalls.begin(), r.syscalls.end());
+        std::sort(costly.begin(), costly.end(), [] (auto const &a, auto const &b) {
+            return a.second.executed > b.second.executed;
+        });
+
+        fprintf(out, "system call          calls  instructions  %%total  avg   min  max  cached\n");
+        for (size_t i = 0; i < costly.size() && i < top; i++) {
+            SyscallCost const &c = costly[i].second;
+            char const *name = syscall_name(costly[i].first);
+            fprintf(out, "%-16s %9" PRIu64 " %13" PRIu64 "  %5.1f%% %5.2f %4zu %4zu  %5.1f%%\n",
+                    name ? name : std::to_string(costly[i].first).c_str(), c.calls, c.executed,
+                    r.executed ? 100.0 * c.executed / r.executed : 0.0, double(c.executed) / c.calls,
+                    c.min_len, c.max_len, 100.0 * c.cached / c.calls);
+        }
+
+        for (size_t rule = 0; rule < r.rule_hits.size(); rule++) {
+            if (rule + 1 < r.rule_hits.size()) {
+                fprintf(out, "rule %zu: ", rule);
+            } else {
+                fprintf(out, "prologue or default: ");
+            }
+            fprintf(out, "%" PRIu64 " calls (%.1f%%)\n", r.rule_hits[rule], 100.0 * r.rule_hits[rule] / calls);
+        }
+
+        for (auto const &a : r.actions) {
+            fprintf(out, "%s: %" PRIu64 " calls\n", action_name(a.first).c_str(), a.second);
+        }
+    }
+
+}
+
+// EOF
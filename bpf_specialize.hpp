@@ -0,0 +1,289 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "policy_compiler.hpp"
+
+/// Filters cut down to the system calls of one architecture and number.
+///
+/// The program is followed from the start with what is known about the accumulator and the index
+/// register: nothing, until they are loaded with the architecture, the number or a constant.
+/// Jumps that this decides are dropped along with everything only they lead to. What is left
+/// decides those system calls as the whole program does, usually in a few instructions.
+
+namespace seccomp {
+
+    namespace specialize_detail {
+
+        struct State {
+            size_t pc;
+            bool a_known, x_known;
+            uint32_t a, x;
+
+            bool operator<(State const &o) const
+            {
+                return std::tie(pc, a_known, a, x_known, x) < std::tie(o.pc, o.a_known, o.a, o.x_known, o.x);
+            }
+        };
+
+        /// The accumulator after an ALU instruction, if it is known.
+        inline bool alu(sock_filter const &insn, State const &s, uint32_t &a)
+        {
+            bool const use_x = BPF_SRC(insn.code) == BPF_X;
+            if (!s.a_known || (use_x && !s.x_known)) {
+                return false;
+            }
+            uint32_t const v = use_x ? s.x : insn.k;
+            a = s.a;
+
+            switch (BPF_OP(insn.code)) {
+            case BPF_ADD: a += v; return true;
+            case BPF_SUB: a -= v; return true;
+            case BPF_MUL: a *= v; return true;
+            case BPF_DIV: if (v == 0) { return false; } a /= v; return true;
+            case BPF_MOD: if (v == 0) { return false; } a %= v; return true;
+            case BPF_AND: a &= v; return true;
+            case BPF_OR:  a |= v; return true;
+            case BPF_XOR: a ^= v; return true;
+            case BPF_LSH: a = v < 32 ? a << v : 0; return true;
+            case BPF_RSH: a = v < 32 ? a >> v : 0; return true;
+            case BPF_NEG: a = -a; return true;
+            default: return false;
+            }
+        }
+
+        /// Where a conditional jump goes, if the state decides it.
+        inline bool decide(sock_filter const &insn, State const &s, bool &taken)
+        {
+            bool const use_x = BPF_SRC(insn.code) == BPF_X;
+            if (!s.a_known || (use_x && !s.x_known)) {
+                return false;
+            }
+            uint32_t const v = use_x ? s.x : insn.k;
+
+            switch (BPF_OP(insn.code)) {
+            case BPF_JEQ:  taken = s.a == v; return true;
+            case BPF_JGT:  taken = s.a > v; return true;
+            case BPF_JGE:  taken = s.a >= v; return true;
+            case BPF_JSET: taken = (s.a & v) != 0; return true;
+            default: return false;
+            }
+        }
+
+        class Specializer {
+            struct Node {
+                State state;
+
+                /// Nodes that are not emitted stand for the one they lead to.
+                bool emitted = true;
+                size_t next = SIZE_MAX, taken = SIZE_MAX;
+                int label = -1;
+            };
+
+            std::vector<sock_filter> const &prog_;
+            uint32_t const arch_, nr_;
+            std::map<State, size_t> ids_;
+            std::vector<Node> nodes_;
+
+            size_t node(State const &s)
+            {
+                auto const it = ids_.find(s);
+                if (it != ids_.end()) {
+                    return it->second;
+                }
+                ids_.emplace(s, nodes_.size());
+                nodes_.push_back({ s });
+                return nodes_.size() - 1;
+            }
+
+            /// Follow nodes that are not emitted.
+            size_t resolve(size_t id) const
+            {
+                while (!nodes_[id].emitted) {
+                    id = nodes_[id].next;
+                }
+                return id;
+            }
+
+            void visit(size_t id)
+            {
+                State const s = nodes_[id].state;
+                sock_filter const &insn = prog_[s.pc];
+                State n = s;
+                n.pc++;
+
+                switch (BPF_CLASS(insn.code)) {
+                case BPF_RET:
+                    return;
+
+                case BPF_JMP: {
+                    bool taken;
+                    if (BPF_OP(insn.code) == BPF_JA) {
+                        n.pc += insn.k;
+                        size_t const to = node(n);
+                        nodes_[id].emitted = false;
+                        nodes_[id].next = to;
+                        return;
+                    }
+                    State t = n;
+                    t.pc += insn.jt;
+                    n.pc += insn.jf;
+                    if (decide(insn, s, taken) || insn.jt == insn.jf) {
+                        size_t const to = node(insn.jt == insn.jf || taken ? t : n);
+                        nodes_[id].emitted = false;
+                        nodes_[id].next = to;
+                        return;
+                    }
+                    size_t const to = node(t), next = node(n);
+                    nodes_[id].taken = to;
+                    nodes_[id].next = next;
+                    return;
+                }
+
+                case BPF_LD:
+                    n.a_known = BPF_MODE(insn.code) == BPF_IMM || BPF_MODE(insn.code) == BPF_LEN ||
+                        (BPF_MODE(insn.code) == BPF_ABS && (insn.k == offsetof(seccomp_data, nr) ||
+                                                            insn.k == offsetof(seccomp_data, arch)));
+                    n.a = BPF_MODE(insn.code) == BPF_IMM ? insn.k : BPF_MODE(insn.code) == BPF_LEN ?
+                        uint32_t(sizeof(seccomp_data)) : insn.k == offsetof(seccomp_data, nr) ? nr_ : arch_;
+                    if (!n.a_known) {
+                        n.a = 0;
+                    }
+                    break;
+
+                case BPF_LDX:
+                    n.x_known = BPF_MODE(insn.code) == BPF_IMM || BPF_MODE(insn.code) == BPF_LEN;
+                    n.x = BPF_MODE(insn.code) == BPF_IMM ? insn.k : n.x_known ? uint32_t(sizeof(seccomp_data)) : 0;
+                    break;
+
+                case BPF_ALU:
+                    n.a_known = alu(insn, s, n.a);
+                    if (!n.a_known) {
+                        n.a = 0;
+                    }
+                    break;
+
+                case BPF_MISC:
+                    if (BPF_MISCOP(insn.code) == BPF_TAX) {
+                        n.x_known = s.a_known;
+                        n.x = s.a;
+                    } else {
+                        n.a_known = s.x_known;
+                        n.a = s.x;
+                    }
+                    break;
+
+                default:
+                    break;  // stores change neither register
+                }
+                size_t const next = node(n);
+                nodes_[id].next = next;
+            }
+
+        public:
+            Specializer(std::vector<sock_filter> const &prog, uint32_t arch, uint32_t nr)
+                : prog_(prog), arch_(arch), nr_(nr)
+            {}
+
+            std::vector<sock_filter> run()
+            {
+                // Nothing is assumed about the registers, so the result can run after other code.
+                node({ 0, false, false, 0, 0 });
+                for (size_t id = 0; id < nodes_.size(); id++) {
+                    visit(id);
+                }
+
+                // Jumps only go forward, so in order of pc every jump still does.
+                std::vector<size_t> order;
+                for (auto const &e : ids_) {
+                    if (nodes_[e.second].emitted) {
+                        order.push_back(e.second);
+                    }
+                }
+                std::sort(order.begin(), order.end(), [this] (size_t a, size_t b) {
+                    return nodes_[a].state < nodes_[b].state;
+                });
+
+                compiler_detail::Assembler a;
+                for (size_t id : order) {
+                    nodes_[id].label = a.label();
+                    a.place(nodes_[id].label);
+                }
+
+                for (size_t i = 0; i < order.size(); i++) {
+                    Node const &n = nodes_[order[i]];
+                    sock_filter const &insn = prog_[n.state.pc];
+                    int const l = n.label;
+
+                    if (BPF_CLASS(insn.code) == BPF_RET) {
+                        a.stmt(l, insn.code, insn.k);
+                        continue;
+                    }
+
+                    size_t const next = resolve(n.next);
+                    if (BPF_CLASS(insn.code) == BPF_JMP) {
+                        size_t const taken = resolve(n.taken);
+                        if (taken == next) {
+                            a.jump(l, BPF_JMP | BPF_JA, 0, nodes_[next].label, compiler_detail::Assembler::NEXT);
+                        } else {
+                            a.jump(l, insn.code, insn.k, nodes_[taken].label, nodes_[next].label);
+                        }
+                        continue;
+                    }
+
+                    a.stmt(l, insn.code, insn.k);
+                    if (i + 1 == order.size() || order[i + 1] != next) {
+                        a.jump(l, BPF_JMP | BPF_JA, 0, nodes_[next].label, compiler_detail::Assembler::NEXT);
+                    }
+                }
+                return a.assemble();
+            }
+        };
+
+    }
+
+    /// prog as it runs for system call nr of arch. It decides those as prog does.
+    inline std::vector<sock_filter> specialize(std::vector<sock_filter> const &prog, uint32_t arch, uint32_t nr)
+    {
+        return specialize_detail::Specializer(prog, arch, nr).run();
+    }
+
+    /// A filter that decides the system calls nrs of arch as prog does and allows everything else.
+    /// Stacked on a filter that allows more of them than prog, it takes that back.
+    inline std::vector<sock_filter> restrict_to(std::vector<sock_filter> const &prog, uint32_t arch,
+                                                std::vector<uint32_t> const &nrs)
+    {
+        std::vector<sock_filter> out {
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, arch))),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, arch, 1, 0),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))),
+        };
+
+        // A comparison and a jump to the body per number, so no body is too far.
+        size_t const dispatch = out.size() + 2 * nrs.size() + 1;
+        std::vector<sock_filter> bodies;
+        for (size_t i = 0; i < nrs.size(); i++) {
+            size_t const jump = out.size() + 1;
+            out.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nrs[i], 0, 1));
+            out.push_back(BPF_STMT(BPF_JMP | BPF_JA, uint32_t(dispatch + bodies.size() - jump - 1)));
+
+            std::vector<sock_filter> const body = specialize(prog, arch, nrs[i]);
+            bodies.insert(bodies.end(), body.begin(), body.end());
+        }
+        out.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+        out.insert(out.end(), bodies.begin(), bodies.end());
+        return out;
+    }
+
+}
+
+// EOF
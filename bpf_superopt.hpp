@@ -0,0 +1,1029 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <random>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "bpf_eval.hpp"
+
+/// A superoptimizer for the short stretch of filter code that every system call runs through
+/// (architecture check, hot system calls).
+///
+/// Candidates are built from the loads, constants and return values of the original fragment.
+/// Small lengths are enumerated exhaustively, longer fragments are improved by a stochastic search
+/// that mutates the program and keeps the cheapest variant that still agrees with the original.
+/// Agreement is checked on every combination of interesting values of the loaded seccomp_data
+/// fields: the constants the fragment compares against and their neighbours, the bits of every
+/// mask, and values that agree with a constant on the masked bits but not on the others. Candidates
+/// may only compare a field under a mask and against a constant the original compares it with.
+
+namespace seccomp {
+
+    struct SuperoptOptions {
+        /// Candidates up to this length are enumerated exhaustively.
+        size_t exhaustive_len = 3;
+
+        /// Number of mutations tried by the stochastic search.
+        unsigned iterations = 20000;
+
+        /// The search is deterministic for a given seed.
+        unsigned seed = 1;
+
+        /// Fragments with more inputs than this are left as they are: a rewrite is only accepted
+        /// once it agrees with the original on all of them.
+        size_t max_inputs = 1 << 14;
+    };
+
+    namespace superopt_detail {
+
+        char const cache_magic[8] = { 'S', 'O', 'P', 'T', 'C', 'A', 'C', 'H' };
+
+        /// Changes whenever the search could have produced a wrong result before, so that files
+        /// written by older versions are not used.
+        uint32_t const cache_version = 2;
+
+    }
+
+    /// Optimized fragments by hash of the input fragment, so each fragment is searched once.
+    /// Entries keep the fragment they were found for, and superoptimize() checks a hit against it
+    /// before using it, so neither a collision nor a damaged file can put a wrong one in a filter.
+    class SuperoptCache {
+    public:
+        struct Entry {
+            std::vector<sock_filter> fragment;
+            std::vector<uint32_t> continuations;
+            uint32_t live_mask;
+
+            std::vector<sock_filter> optimized;
+        };
+
+    private:
+        std::unordered_map<uint64_t, Entry> entries_;
+
+        static bool read_vector(FILE *f, std::vector<sock_filter> &v)
+        {
+            uint32_t len;
+            if (fread(&len, sizeof(len), 1, f) != 1 || len == 0 || len > BPF_MAXINSNS) {
+                return false;
+            }
+            v.resize(len);
+            return fread(v.data(), sizeof(sock_filter), len, f) == len;
+        }
+
+        static bool read_vector(FILE *f, std::vector<uint32_t> &v)
+        {
+            uint32_t len;
+            if (fread(&len, sizeof(len), 1, f) != 1 || len > BPF_MAXINSNS) {
+                return false;
+            }
+            v.resize(len);
+            return fread(v.data(), sizeof(uint32_t), len, f) == len;
+        }
+
+        template <typename T>
+        static void write_vector(FILE *f, std::vector<T> const &v)
+        {
+            uint32_t const len = v.size();
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(v.data(), sizeof(T), len, f);
+        }
+
+    public:
+        static uint64_t hash(std::vector<sock_filter> const &fragment, std::vector<uint32_t> const &continuations,
+                             uint32_t live_mask)
+        {
+            // FNV-1a
+            uint64_t h = 0xcbf29ce484222325ULL;
+            auto mix = [&h] (uint32_t v) {
+                for (unsigned i = 0; i < 4; i++) {
+                    h = (h ^ ((v >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+                }
+            };
+
+            mix(superopt_detail::cache_version);
+            mix(live_mask);
+            mix(uint32_t(continuations.size()));
+            for (uint32_t c : continuations) {
+                mix(c);
+            }
+            for (sock_filter const &insn : fragment) {
+                mix(insn.code | (insn.jt << 16) | (insn.jf << 24));
+                mix(insn.k);
+            }
+            return h;
+        }
+
+        Entry const *find(uint64_t key) const
+        {
+            auto it = entries_.find(key);
+            return it == entries_.end() ? nullptr : &it->second;
+        }
+
+        void insert(uint64_t key, Entry entry)
+        {
+            entries_[key] = std::move(entry);
+        }
+
+        size_t size() const { return entries_.size(); }
+
+        /// Load entries from a file written by save(). A missing file is an empty cache; one of
+        /// another version, or cut short or garbled anywhere, is not used at all.
+        bool load(char const *path)
+        {
+            FILE *f = fopen(path, "rb");
+            if (f == nullptr) {
+                return false;
+            }
+
+            std::unordered_map<uint64_t, Entry> loaded;
+            char magic[sizeof(superopt_detail::cache_magic)];
+            uint32_t version;
+            bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+                memcmp(magic, superopt_detail::cache_magic, sizeof(magic)) == 0 &&
+                fread(&version, sizeof(version), 1, f) == 1 && version == superopt_detail::cache_version;
+
+            uint64_t key;
+            while (ok && fread(&key, sizeof(key), 1, f) == 1) {
+                Entry e;
+                ok = fread(&e.live_mask, sizeof(e.live_mask), 1, f) == 1 && read_vector(f, e.continuations) &&
+                    read_vector(f, e.fragment) && read_vector(f, e.optimized) &&
+                    hash(e.fragment, e.continuations, e.live_mask) == key;
+                loaded[key] = std::move(e);
+            }
+            ok = ok && feof(f) && !ferror(f);
+
+            fclose(f);
+            if (!ok) {
+                return false;
+            }
+            for (auto &e : loaded) {
+                entries_[e.first] = std::move(e.second);
+            }
+            return true;
+        }
+
+        bool save(char const *path) const
+        {
+            FILE *f = fopen(path, "wb");
+            if (f == nullptr) {
+                return false;
+            }
+
+            fwrite(superopt_detail::cache_magic, sizeof(superopt_detail::cache_magic), 1, f);
+            fwrite(&superopt_detail::cache_version, sizeof(superopt_detail::cache_version), 1, f);
+            for (auto const &e : entries_) {
+                fwrite(&e.first, sizeof(e.first), 1, f);
+                fwrite(&e.second.live_mask, sizeof(e.second.live_mask), 1, f);
+                write_vector(f, e.second.continuations);
+                write_vector(f, e.second.fragment);
+                write_vector(f, e.second.optimized);
+            }
+
+            return fclose(f) == 0;
+        }
+    };
+
+    namespace superopt_detail {
+
+        inline bool is_cond_jump(sock_filter const &insn)
+        {
+            return BPF_CLASS(insn.code) == BPF_JMP && BPF_OP(insn.code) != BPF_JA;
+        }
+
+        /// Only straight-forward seccomp code is searched: absolute loads, masking, comparisons
+        /// with constants and constant returns.
+        inline bool is_supported(sock_filter const &insn)
+        {
+            switch (insn.code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+            case BPF_ALU | BPF_AND | BPF_K:
+            case BPF_JMP | BPF_JA:
+            case BPF_JMP | BPF_JEQ | BPF_K:
+            case BPF_JMP | BPF_JGT | BPF_K:
+            case BPF_JMP | BPF_JGE | BPF_K:
+            case BPF_JMP | BPF_JSET | BPF_K:
+            case BPF_RET | BPF_K:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        /// Whether every path through the fragment ends in a return inside it.
+        inline bool is_closed(std::vector<sock_filter> const &code)
+        {
+            for (size_t pc = 0; pc < code.size(); pc++) {
+                sock_filter const &insn = code[pc];
+                size_t const next = pc + 1;
+
+                if (BPF_CLASS(insn.code) == BPF_RET) {
+                    continue;
+                }
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    if (next + insn.k >= code.size()) {
+                        return false;
+                    }
+                } else if (is_cond_jump(insn)) {
+                    if (next + std::max(insn.jt, insn.jf) >= code.size()) {
+                        return false;
+                    }
+                } else if (next >= code.size()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        struct Expected {
+            uint32_t action;
+            uint32_t a;
+        };
+
+        /// A fragment to optimize: a closed program, plus the return values that stand for
+        /// "continue with the rest of the filter". For some of them the accumulator is still used
+        /// afterwards and has to match as well.
+        class Problem {
+            size_t const max_inputs_;
+
+            std::vector<sock_filter> loads_;
+            std::vector<sock_filter> insns_;
+            std::vector<uint32_t> rets_;
+
+            /// Loaded fields, and the masks (true) and constants (false) applied to each under
+            /// the mask it has been and-ed with by then.
+            std::vector<uint32_t> offsets_;
+            std::set<std::tuple<long, uint32_t, bool, uint32_t>> uses_;
+
+            std::vector<seccomp_data> inputs_;
+            std::vector<Expected> expected_;
+            bool exhaustive_ = false;
+
+            std::vector<uint32_t> continuations_;
+            uint32_t live_mask_;
+
+            int continuation(uint32_t action) const
+            {
+                auto it = std::find(continuations_.begin(), continuations_.end(), action);
+                return it == continuations_.end() ? -1 : int(it - continuations_.begin());
+            }
+
+            void build_alphabet(std::vector<sock_filter> const &code)
+            {
+                std::set<uint32_t> offsets, consts, masks, rets;
+
+                for (sock_filter const &insn : code) {
+                    switch (insn.code) {
+                    case BPF_LD | BPF_W | BPF_ABS:   offsets.insert(insn.k); break;
+                    case BPF_ALU | BPF_AND | BPF_K:  masks.insert(insn.k); break;
+                    case BPF_JMP | BPF_JSET | BPF_K: masks.insert(insn.k); break;
+                    case BPF_RET | BPF_K:            rets.insert(insn.k); break;
+                    case BPF_JMP | BPF_JA:           break;
+                    default:                         consts.insert(insn.k); break;
+                    }
+                }
+
+                for (uint32_t off : offsets) {
+                    loads_.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, off));
+                }
+                for (uint32_t m : masks) {
+                    insns_.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, m));
+                    insns_.push_back(BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, m, 0, 0));
+                }
+                for (uint32_t c : consts) {
+                    insns_.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, c, 0, 0));
+                    insns_.push_back(BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, c, 0, 0));
+                    insns_.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, c, 0, 0));
+                }
+                insns_.insert(insns_.end(), loads_.begin(), loads_.end());
+                insns_.push_back(BPF_STMT(BPF_JMP | BPF_JA, 0));
+                rets_.assign(rets.begin(), rets.end());
+
+                offsets_.assign(offsets.begin(), offsets.end());
+                build_inputs(code);
+            }
+
+            /// Follow which field the accumulator was loaded from and what it has been and-ed with,
+            /// and call use(source, insn) for every instruction that masks or compares it. The
+            /// field is kZero before anything was loaded and kUnknown where paths with different
+            /// sources meet.
+            static long const kZero = -1;
+            static long const kUnknown = -2;
+
+            struct Source {
+                long field;
+                uint32_t mask;
+
+                bool operator==(Source const &o) const { return field == o.field && mask == o.mask; }
+            };
+
+            template <typename USE>
+            void trace_fields(std::vector<sock_filter> const &code, USE &&use) const
+            {
+                long const unreached = -3;
+                std::vector<Source> source(code.size() + 1, Source { unreached, 0 });
+
+                auto flow = [&] (size_t to, Source src) {
+                    Source &s = source[std::min(to, code.size())];
+                    s = (s.field == unreached || s == src) ? src : Source { kUnknown, 0 };
+                };
+
+                source[0] = { kZero, ~uint32_t(0) };
+                for (size_t pc = 0; pc < code.size(); pc++) {
+                    sock_filter const &insn = code[pc];
+                    Source const src = source[pc];
+
+                    switch (insn.code) {
+                    case BPF_LD | BPF_W | BPF_ABS:
+                        flow(pc + 1, { long(std::lower_bound(offsets_.begin(), offsets_.end(), insn.k) - offsets_.begin()),
+                                       ~uint32_t(0) });
+                        break;
+                    case BPF_ALU | BPF_AND | BPF_K:
+                        use(src, insn);
+                        flow(pc + 1, { src.field, src.mask & insn.k });
+                        break;
+                    case BPF_RET | BPF_K:
+                        break;
+                    case BPF_JMP | BPF_JA:
+                        flow(pc + 1 + insn.k, src);
+                        break;
+                    default:
+                        use(src, insn);
+                        flow(pc + 1 + insn.jt, src);
+                        flow(pc + 1 + insn.jf, src);
+                        break;
+                    }
+                }
+            }
+
+            static bool is_mask(sock_filter const &insn)
+            {
+                return insn.code == (BPF_ALU | BPF_AND | BPF_K) || insn.code == (BPF_JMP | BPF_JSET | BPF_K);
+            }
+
+            /// Inputs are every combination of interesting values of the loaded fields. To keep
+            /// that number down, a constant is only used for the field it is compared against.
+            /// There are none if the combinations are more than max_inputs_.
+            void build_inputs(std::vector<sock_filter> const &code)
+            {
+                std::vector<std::set<uint32_t>> values(offsets_.size(), std::set<uint32_t> { 0, ~uint32_t(0) });
+
+                trace_fields(code, [&] (Source const &src, sock_filter const &insn) {
+                    uint32_t const k = insn.k;
+                    uint32_t const outside = ~src.mask;
+                    uses_.emplace(src.field, src.mask, is_mask(insn), k);
+
+                    for (size_t f = 0; f < values.size(); f++) {
+                        if (src.field >= 0 && size_t(src.field) != f) {
+                            continue;
+                        }
+
+                        if (is_mask(insn)) {
+                            values[f].insert({ k, ~k });
+                            for (unsigned bit = 0; bit < 32; bit++) {
+                                if (k & (1u << bit)) {
+                                    values[f].insert(1u << bit);
+                                }
+                            }
+                        } else {
+                            values[f].insert({ k - 1, k, k + 1 });
+                        }
+
+                        // The same under the mask, different outside it.
+                        if (outside != 0) {
+                            values[f].insert({ k | outside, k | (outside & 0x55555555), k | (outside & 0xaaaaaaaa) });
+                        }
+                    }
+                });
+
+                double combinations = 1;
+                for (auto const &v : values) {
+                    combinations *= v.size();
+                }
+
+                auto store = [&] (std::vector<size_t> const &choice) {
+                    seccomp_data d {};
+                    for (size_t i = 0; i < offsets_.size(); i++) {
+                        uint32_t const v = *std::next(values[i].begin(), choice[i]);
+                        memcpy(reinterpret_cast<char *>(&d) + offsets_[i], &v, sizeof(v));
+                    }
+                    inputs_.push_back(d);
+                };
+
+                if (combinations > max_inputs_) {
+                    return;
+                }
+                exhaustive_ = true;
+
+                std::vector<size_t> choice(offsets_.size(), 0);
+                for (;;) {
+                    store(choice);
+
+                    size_t i = 0;
+                    for (; i < choice.size(); i++) {
+                        if (++choice[i] < values[i].size()) {
+                            break;
+                        }
+                        choice[i] = 0;
+                    }
+                    if (i == choice.size()) {
+                        break;
+                    }
+                }
+            }
+
+        public:
+            Problem(std::vector<sock_filter> const &code, std::vector<uint32_t> const &continuations,
+                    uint32_t live_mask, size_t max_inputs)
+                : max_inputs_(max_inputs), continuations_(continuations), live_mask_(live_mask)
+            {
+                build_alphabet(code);
+
+                for (seccomp_data const &d : inputs_) {
+                    EvalResult const r = evaluate(code.data(), code.size(), d, EvalNoVisit());
+                    expected_.push_back({ r.action, r.a });
+                }
+            }
+
+            std::vector<sock_filter> const &alphabet() const { return insns_; }
+            std::vector<uint32_t> const &returns() const { return rets_; }
+            size_t inputs() const { return inputs_.size(); }
+
+            /// Whether there were few enough combinations of inputs to try them all. If not,
+            /// nothing is known to agree with the original.
+            bool exhaustive() const { return exhaustive_; }
+
+            /// Instructions executed over all inputs, not counting the returns that stand for
+            /// continuing, or SIZE_MAX if the candidate disagrees with the original anywhere.
+            size_t cost(std::vector<sock_filter> const &candidate) const
+            {
+                size_t total = 0;
+                if (!exhaustive_ || candidate.empty() || candidate.size() > BPF_MAXINSNS || !is_closed(candidate) ||
+                    !std::all_of(candidate.begin(), candidate.end(), is_supported)) {
+                    return SIZE_MAX;
+                }
+
+                // The inputs only cover the original's uses of each field. A candidate that
+                // compares a field under another mask or against anything else could differ where
+                // nobody looked.
+                bool covered = true;
+                trace_fields(candidate, [&] (Source const &src, sock_filter const &insn) {
+                    if (src.field == kUnknown ||
+                        (src.field >= 0 && !uses_.count(std::make_tuple(src.field, src.mask, is_mask(insn), insn.k)))) {
+                        covered = false;
+                    }
+                });
+                if (!covered) {
+                    return SIZE_MAX;
+                }
+
+                for (size_t i = 0; i < inputs_.size(); i++) {
+                    EvalResult const r = evaluate(candidate.data(), candidate.size(), inputs_[i], EvalNoVisit());
+                    Expected const &e = expected_[i];
+
+                    if (r.action != e.action) {
+                        return SIZE_MAX;
+                    }
+
+                    int const cont = continuation(r.action);
+                    if (cont >= 0 && (live_mask_ & (1u << cont)) && r.a != e.a) {
+                        return SIZE_MAX;
+                    }
+
+                    total += r.executed - (cont >= 0 ? 1 : 0);
+                }
+
+                return total;
+            }
+        };
+
+        inline bool better(size_t cost, size_t len, size_t best_cost, size_t best_len)
+        {
+            return cost < best_cost || (cost == best_cost && len < best_len);
+        }
+
+        /// Try every program of exactly `len` instructions.
+        inline void enumerate(Problem const &p, std::vector<sock_filter> &cur, size_t len,
+                              std::vector<sock_filter> &best, size_t &best_cost)
+        {
+            size_t const pc = cur.size();
+
+            if (pc + 1 == len) {
+                for (uint32_t r : p.returns()) {
+                    cur.push_back(BPF_STMT(BPF_RET | BPF_K, r));
+                    size_t const c = p.cost(cur);
+                    if (better(c, cur.size(), best_cost, best.size())) {
+                        best = cur;
+                        best_cost = c;
+                    }
+                    cur.pop_back();
+                }
+                return;
+            }
+
+            // Targets must stay inside the program.
+            unsigned char const max_off = static_cast<unsigned char>(std::min<size_t>(len - pc - 2, 0xff));
+
+            for (sock_filter insn : p.alphabet()) {
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    // Only useful to skip something.
+                    for (unsigned k = 1; k <= max_off; k++) {
+                        insn.k = k;
+                        cur.push_back(insn);
+                        enumerate(p, cur, len, best, best_cost);
+                        cur.pop_back();
+                    }
+                } else if (is_cond_jump(insn)) {
+                    for (unsigned jt = 0; jt <= max_off; jt++) {
+                        for (unsigned jf = 0; jf <= max_off; jf++) {
+                            if (jt == jf) {
+                                continue;
+                            }
+                            insn.jt = jt;
+                            insn.jf = jf;
+                            cur.push_back(insn);
+                            enumerate(p, cur, len, best, best_cost);
+                            cur.pop_back();
+                        }
+                    }
+                } else {
+                    cur.push_back(insn);
+                    enumerate(p, cur, len, best, best_cost);
+                    cur.pop_back();
+                }
+            }
+        }
+
+        /// Remove instruction i and keep all jumps pointing at the same instructions. Jumps to i
+        /// end up at what followed it.
+        inline void erase(std::vector<sock_filter> &code, size_t i)
+        {
+            for (size_t pc = 0; pc < i; pc++) {
+                sock_filter &insn = code[pc];
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    if (pc + 1 + insn.k > i) {
+                        insn.k--;
+                    }
+                } else if (is_cond_jump(insn)) {
+                    if (pc + 1 + insn.jt > i) {
+                        insn.jt--;
+                    }
+                    if (pc + 1 + insn.jf > i) {
+                        insn.jf--;
+                    }
+                }
+            }
+            code.erase(code.begin() + i);
+        }
+
+        /// Remove the instructions no path from the start reaches.
+        inline void strip_unreachable(std::vector<sock_filter> &code)
+        {
+            std::vector<bool> reached(code.size() + 1, false);
+            reached[0] = true;
+            for (size_t pc = 0; pc < code.size(); pc++) {
+                sock_filter const &insn = code[pc];
+                if (!reached[pc] || BPF_CLASS(insn.code) == BPF_RET) {
+                    continue;
+                }
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    reached[std::min(code.size(), pc + 1 + insn.k)] = true;
+                } else if (is_cond_jump(insn)) {
+                    reached[std::min(code.size(), pc + 1 + insn.jt)] = true;
+                    reached[std::min(code.size(), pc + 1 + insn.jf)] = true;
+                } else {
+                    reached[pc + 1] = true;
+                }
+            }
+            for (size_t pc = code.size(); pc-- > 0;) {
+                if (!reached[pc]) {
+                    erase(code, pc);
+                }
+            }
+        }
+
+        /// Insert before position i. Jumps to i keep going to the old instruction. Returns false
+        /// if an offset would overflow.
+        inline bool insert(std::vector<sock_filter> &code, size_t i, sock_filter const &new_insn)
+        {
+            std::vector<sock_filter> copy = code;
+
+            for (size_t pc = 0; pc < i; pc++) {
+                sock_filter &insn = copy[pc];
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    if (pc + 1 + insn.k >= i) {
+                        insn.k++;
+                    }
+                } else if (is_cond_jump(insn)) {
+                    if (pc + 1 + insn.jt >= i) {
+                        if (insn.jt == 0xff) {
+                            return false;
+                        }
+                        insn.jt++;
+                    }
+                    if (pc + 1 + insn.jf >= i) {
+                        if (insn.jf == 0xff) {
+                            return false;
+                        }
+                        insn.jf++;
+                    }
+                }
+            }
+            copy.insert(copy.begin() + i, new_insn);
+            code = std::move(copy);
+            return true;
+        }
+
+        class Search {
+            Problem const &p_;
+            std::mt19937 rng_;
+
+            size_t random(size_t n) { return n == 0 ? 0 : rng_() % n; }
+
+            unsigned char random_offset(size_t pc, size_t len)
+            {
+                return static_cast<unsigned char>(random(std::min<size_t>(len - pc - 1, 0x100)));
+            }
+
+            sock_filter random_insn(size_t pc, size_t len)
+            {
+                if (pc + 1 == len || random(4) == 0) {
+                    return BPF_STMT(BPF_RET | BPF_K, p_.returns()[random(p_.returns().size())]);
+                }
+
+                sock_filter insn = p_.alphabet()[random(p_.alphabet().size())];
+                if (insn.code == (BPF_JMP | BPF_JA)) {
+                    insn.k = random_offset(pc, len);
+                } else if (is_cond_jump(insn)) {
+                    insn.jt = random_offset(pc, len);
+                    insn.jf = random_offset(pc, len);
+                }
+                return insn;
+            }
+
+        public:
+            Search(Problem const &p, unsigned seed)
+                : p_(p), rng_(seed)
+            {}
+
+            std::vector<sock_filter> mutate(std::vector<sock_filter> code)
+            {
+                size_t const i = random(code.size());
+                sock_filter &insn = code[i];
+
+                switch (random(5)) {
+                case 0:
+                    if (code.size() > 1) {
+                        erase(code, i);
+                    }
+                    break;
+                case 1:
+                    insn = random_insn(i, code.size());
+                    break;
+                case 2:
+                    if (is_cond_jump(insn)) {
+                        (random(2) ? insn.jt : insn.jf) = random_offset(i, code.size());
+                    } else if (insn.code == (BPF_JMP | BPF_JA)) {
+                        insn.k = random_offset(i, code.size());
+                    }
+                    break;
+                case 3:
+                    insert(code, i, random_insn(i, code.size() + 1));
+                    break;
+                case 4: {
+                    // Keep the shape, swap the constant.
+                    sock_filter const other = p_.alphabet()[random(p_.alphabet().size())];
+                    if (BPF_CLASS(insn.code) == BPF_CLASS(other.code) &&
+                        insn.code != (BPF_JMP | BPF_JA) && other.code != (BPF_JMP | BPF_JA)) {
+                        insn.code = other.code;
+                        insn.k = other.k;
+                    }
+                    break;
+                }
+                }
+
+                return code;
+            }
+        };
+
+    }
+
+    /// Search for the cheapest program that agrees with `fragment`, a program where every path
+    /// ends in a return. `continuations` are return values that mean "go on with the rest of the
+    /// filter"; bit i of `live_mask` says the accumulator is still used after continuations[i].
+    /// Returns the input if nothing better is found, or if the fragment has too many inputs to
+    /// check a rewrite on all of them.
+    inline std::vector<sock_filter> superoptimize(std::vector<sock_filter> const &fragment,
+                                                  std::vector<uint32_t> const &continuations,
+                                                  uint32_t live_mask,
+                                                  SuperoptOptions const &opts,
+                                                  SuperoptCache *cache = nullptr)
+    {
+        using namespace superopt_detail;
+
+        if (fragment.empty() || !is_closed(fragment) ||
+            !std::all_of(fragment.begin(), fragment.end(), is_supported)) {
+            return fragment;
+        }
+
+        Problem const p(fragment, continuations, live_mask, opts.max_inputs);
+        if (!p.exhaustive()) {
+            return fragment;
+        }
+
+        uint64_t const key = SuperoptCache::hash(fragment, continuations, live_mask);
+        if (cache != nullptr) {
+            SuperoptCache::Entry const *hit = cache->find(key);
+            if (hit != nullptr && hit->live_mask == live_mask && hit->continuations == continuations &&
+                hit->fragment.size() == fragment.size() &&
+                memcmp(hit->fragment.data(), fragment.data(), fragment.size() * sizeof(sock_filter)) == 0 &&
+                p.cost(hit->optimized) != SIZE_MAX) {
+                return hit->optimized;
+            }
+        }
+
+        std::vector<sock_filter> best = fragment;
+        size_t best_cost = p.cost(fragment);
+
+        for (size_t len = 1; len <= std::min(opts.exhaustive_len, fragment.size()); len++) {
+            std::vector<sock_filter> cur;
+            enumerate(p, cur, len, best, best_cost);
+        }
+
+        // Metropolis search over correct programs, starting from the best one so far.
+        Search search(p, opts.seed);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::mt19937 rng(opts.seed);
+
+        std::vector<sock_filter> cur = best;
+        size_t cur_cost = best_cost;
+
+        for (unsigned i = 0; i < opts.iterations; i++) {
+            std::vector<sock_filter> const next = search.mutate(cur);
+            if (!is_closed(next)) {
+                continue;
+            }
+
+            size_t const next_cost = p.cost(next);
+            if (next_cost == SIZE_MAX) {
+                continue;
+            }
+
+            double const delta = (double(next_cost) - double(cur_cost)) / p.inputs();
+            if (delta <= 0 || uniform(rng) < std::exp(-delta)) {
+                cur = next;
+                cur_cost = next_cost;
+            }
+
+            if (better(cur_cost, cur.size(), best_cost, best.size())) {
+                best = cur;
+                best_cost = cur_cost;
+            }
+        }
+
+        strip_unreachable(best);
+        if (cache != nullptr) {
+            cache->insert(key, { fragment, continuations, live_mask, best });
+        }
+
+        return best;
+    }
+
+    /// Superoptimize the first `prefix_len` instructions of a complete filter. Wherever the prefix
+    /// continues into the rest of the filter, the optimized version continues at the same place.
+    inline std::vector<sock_filter> superoptimize_prefix(std::vector<sock_filter> const &program,
+                                                         size_t prefix_len,
+                                                         SuperoptOptions const &opts,
+                                                         SuperoptCache *cache = nullptr)
+    {
+        using namespace superopt_detail;
+
+        size_t const n = std::min(prefix_len, program.size());
+        std::vector<sock_filter> fragment(program.begin(), program.begin() + n);
+
+        if (!std::all_of(fragment.begin(), fragment.end(), is_supported)) {
+            return program;
+        }
+
+        // Exits from the prefix by absolute target. Falling through from the prefix goes first,
+        // so the return standing in for it ends up right behind the prefix.
+        std::map<size_t, size_t> exits;
+        exits[n] = 0;
+
+        auto exit_for = [&] (size_t target) -> size_t {
+            auto it = exits.find(target);
+            if (it == exits.end()) {
+                it = exits.emplace(target, exits.size()).first;
+            }
+            return it->second;
+        };
+
+        std::vector<std::pair<size_t, size_t>> jt_exits, jf_exits;
+        for (size_t pc = 0; pc < n; pc++) {
+            sock_filter const &insn = fragment[pc];
+            if (insn.code == (BPF_JMP | BPF_JA)) {
+                if (pc + 1 + insn.k >= n) {
+                    jt_exits.emplace_back(pc, exit_for(pc + 1 + insn.k));
+                }
+            } else if (is_cond_jump(insn)) {
+                if (pc + 1 + insn.jt >= n) {
+                    jt_exits.emplace_back(pc, exit_for(pc + 1 + insn.jt));
+                }
+                if (pc + 1 + insn.jf >= n) {
+                    jf_exits.emplace_back(pc, exit_for(pc + 1 + insn.jf));
+                }
+            }
+        }
+
+        if (exits.size() > 32) {
+            return program;
+        }
+
+        // Pick continuation values that do not clash with anything the prefix returns.
+        std::set<uint32_t> used;
+        for (sock_filter const &insn : fragment) {
+            if (BPF_CLASS(insn.code) == BPF_RET) {
+                used.insert(insn.k);
+            }
+        }
+
+        std::vector<size_t> targets(exits.size());
+        std::vector<uint32_t> continuations(exits.size());
+        uint32_t live_mask = 0;
+        uint32_t next_value = 0xfffff000;
+
+        for (auto const &e : exits) {
+            while (used.count(next_value)) {
+                next_value++;
+            }
+            targets[e.second] = e.first;
+            continuations[e.second] = next_value++;
+
+            // The rest of the filter does not care about A if it starts with a load.
+            bool const reloads = e.first < program.size() &&
+                BPF_CLASS(program[e.first].code) == BPF_LD;
+            if (!reloads) {
+                live_mask |= 1u << e.second;
+            }
+        }
+
+        // Close the fragment: exits jump to returns appended behind the prefix.
+        for (size_t i = 0; i < exits.size(); i++) {
+            fragment.push_back(BPF_STMT(BPF_RET | BPF_K, continuations[i]));
+        }
+        for (auto const &e : jt_exits) {
+            sock_filter &insn = fragment[e.first];
+            size_t const off = n + e.second - e.first - 1;
+            if (insn.code == (BPF_JMP | BPF_JA)) {
+                insn.k = off;
+            } else if (off > 0xff) {
+                return program;
+            } else {
+                insn.jt = off;
+            }
+        }
+        for (auto const &e : jf_exits) {
+            size_t const off = n + e.second - e.first - 1;
+            if (off > 0xff) {
+                return program;
+            }
+            fragment[e.first].jf = off;
+        }
+
+        std::vector<sock_filter> const optimized = superoptimize(fragment, continuations, live_mask, opts, cache);
+
+        // Materialize: continuation returns become jumps into the rest of the filter, with
+        // absolute targets. Negative targets are exits, -1 - index.
+        struct Node {
+            sock_filter insn;
+            long jt, jf;
+        };
+
+        auto exit_of = [&] (sock_filter const &insn) -> long {
+            if (insn.code != (BPF_RET | BPF_K)) {
+                return -1;
+            }
+            auto it = std::find(continuations.begin(), continuations.end(), insn.k);
+            return it == continuations.end() ? -1 : long(it - continuations.begin());
+        };
+
+        std::vector<Node> nodes;
+        for (size_t pc = 0; pc < optimized.size(); pc++) {
+            sock_filter const &insn = optimized[pc];
+            long const exit = exit_of(insn);
+            Node node { insn, long(pc + 1), long(pc + 1) };
+
+            if (exit >= 0) {
+                node.insn = BPF_STMT(BPF_JMP | BPF_JA, 0);
+                node.jt = node.jf = -1 - exit;
+            } else if (insn.code == (BPF_JMP | BPF_JA)) {
+                node.jt = node.jf = long(pc + 1 + insn.k);
+            } else if (is_cond_jump(insn)) {
+                node.jt = long(pc + 1 + insn.jt);
+                node.jf = long(pc + 1 + insn.jf);
+            }
+            nodes.push_back(node);
+        }
+
+        // Conditional jumps to a continuation go there directly.
+        for (Node &node : nodes) {
+            if (!is_cond_jump(node.insn)) {
+                continue;
+            }
+            for (long *t : { &node.jt, &node.jf }) {
+                if (*t >= 0 && nodes[*t].insn.code == (BPF_JMP | BPF_JA) && nodes[*t].jt < 0) {
+                    *t = nodes[*t].jt;
+                }
+            }
+        }
+
+        // Drop what is no longer reachable and jumps to the next instruction.
+        std::vector<bool> keep(nodes.size(), false);
+        std::vector<bool> reached(nodes.size(), false);
+        reached[0] = true;
+        for (size_t pc = 0; pc < nodes.size(); pc++) {
+            Node const &node = nodes[pc];
+            if (!reached[pc]) {
+                continue;
+            }
+            keep[pc] = true;
+            if (BPF_CLASS(node.insn.code) == BPF_RET) {
+                continue;
+            }
+            for (long t : { node.jt, node.jf }) {
+                if (t >= 0) {
+                    reached[t] = true;
+                }
+            }
+        }
+
+        std::vector<size_t> position(nodes.size() + 1);
+        size_t len = 0;
+        for (size_t pc = 0; pc < nodes.size(); pc++) {
+            position[pc] = len;
+            len += keep[pc];
+        }
+        position[nodes.size()] = len;
+
+        // A trailing jump to where the prefix falls through anyway is not needed. Anything
+        // jumping to it now resolves to the end of the prefix, which is the same place.
+        size_t last = nodes.size();
+        while (last > 0 && !keep[last - 1]) {
+            last--;
+        }
+        if (last > 0) {
+            Node const &node = nodes[last - 1];
+            if (node.insn.code == (BPF_JMP | BPF_JA) && node.jt < 0 && targets[-1 - node.jt] == n) {
+                keep[last - 1] = false;
+                len--;
+            }
+        }
+
+        auto resolve = [&] (long t) -> size_t {
+            return t >= 0 ? position[t] : len + targets[-1 - t] - n;
+        };
+
+        std::vector<sock_filter> result;
+        for (size_t pc = 0; pc < nodes.size(); pc++) {
+            if (!keep[pc]) {
+                continue;
+            }
+
+            Node const &node = nodes[pc];
+            sock_filter insn = node.insn;
+            size_t const here = result.size();
+
+            if (insn.code == (BPF_JMP | BPF_JA)) {
+                insn = BPF_STMT(BPF_JMP | BPF_JA, static_cast<uint32_t>(resolve(node.jt) - here - 1));
+            } else if (is_cond_jump(insn)) {
+                size_t const jt = resolve(node.jt) - here - 1;
+                size_t const jf = resolve(node.jf) - here - 1;
+                if (jt > 0xff || jf > 0xff) {
+                    return program;
+                }
+                insn.jt = jt;
+                insn.jf = jf;
+            }
+            result.push_back(insn);
+        }
+
+        result.insert(result.end(), program.begin() + n, program.end());
+        return result;
+    }
+
+}
+
+// EOF
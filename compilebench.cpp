@@ -0,0 +1,499 @@
+#include <linux/filter.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bpf_eval.hpp"
+#include "policy.hpp"
+#include "policy_batch.hpp"
+#include "policy_incremental.hpp"
+#include "policy_registry.hpp"
+#include "policy_compiler.hpp"
+
+/// How the filter compiler scales with the size of a policy: synthetic policies from a few to
+/// a hundred thousand rules, compiled in several layouts, with time, peak memory and output size
+/// for each. The growth column is the exponent between neighbouring sizes, about 1 for linear
+/// work; quadratic behaviour shows up as 2.
+///
+/// Then a batch of tenant policies is compiled as a supervisor would at startup: one by one, and
+/// with compile_batch() on one and on all threads, then with a FilterStore: cold, when it is
+/// empty, and warm, when another process has filled it. After that a PolicyRegistry of tenants
+/// that each override a few rules of a common base, and last an IncrementalPolicy under random
+/// edits, each checked against compile() of the edited policy on the calls of probe_calls().
+
+namespace {
+
+    enum class Complexity {
+        /// Only system call numbers.
+        NONE,
+
+        /// One exact check of the first argument.
+        SIMPLE,
+
+        /// One to four checks on 64-bit values, half of them masked.
+        COMPLEX,
+    };
+
+    char const *name_of(Complexity c)
+    {
+        return c == Complexity::NONE ? "none" : c == Complexity::SIMPLE ? "simple" : "complex";
+    }
+
+    /// Rules for tenants of a multi-tenant host: each allows a random system call with its own
+    /// arguments, so most system calls end up with long lists of rules.
+    seccomp::Policy synthetic_policy(size_t rules, Complexity complexity, uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        seccomp::Policy p;
+        p.default_action = SECCOMP_RET_ERRNO | 1;
+
+        for (size_t i = 0; i < rules; i++) {
+            uint32_t const nr = uint32_t(rng() % 450);
+            uint32_t const action = rng() % 8 ? SECCOMP_RET_ALLOW : SECCOMP_RET_TRAP;
+            std::vector<seccomp::ArgCheck> checks;
+
+            switch (complexity) {
+            case Complexity::NONE:
+                break;
+            case Complexity::SIMPLE:
+                checks.push_back({ 0, ~0ULL, rng() % 1024 });
+                break;
+            case Complexity::COMPLEX:
+                for (unsigned n = 1 + rng() % 4, arg = 0; n > 0; n--, arg += 1 + rng() % 2) {
+                    uint64_t const mask = rng() % 2 ? ~0ULL : rng();
+                    checks.push_back({ arg % 6, mask, rng() & mask });
+                }
+                break;
+            }
+            p.add(nr, action, checks);
+        }
+        return p;
+    }
+
+    struct Measurement {
+        double ms = -1;
+
+        /// Most heap memory the compiler had allocated at once, in KiB.
+        double peak_kib = 0;
+
+        size_t instructions = 0;
+    };
+
+    /// Heap use, as counted by the operator new below. Each block starts with its size.
+    std::atomic<size_t> allocated { 0 };
+    std::atomic<size_t> peak { 0 };
+    size_t const header = alignof(std::max_align_t);
+
+    Measurement measure(seccomp::Policy const &policy, seccomp::Layout const &layout)
+    {
+        Measurement m;
+        size_t const before = allocated;
+        peak = allocated.load();
+
+        auto const start = std::chrono::steady_clock::now();
+        std::vector<sock_filter> const filter = seccomp::compile(policy, layout);
+        auto const end = std::chrono::steady_clock::now();
+
+        m.ms = std::chrono::duration<double, std::milli>(end - start).count();
+        m.peak_kib = double(peak - before) / 1024;
+        m.instructions = filter.size();
+        return m;
+    }
+
+    /// Tenant policies built from a few templates. The rules of different system calls come in
+    /// a different order for each tenant, which does not change what a policy means.
+    std::vector<std::pair<std::string, seccomp::Policy>> tenant_policies(size_t tenants, size_t templates,
+                                                                         uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<std::pair<std::string, seccomp::Policy>> policies;
+
+        for (size_t t = 0; t < tenants; t++) {
+            seccomp::Policy p = synthetic_policy(200, Complexity::COMPLEX, uint32_t(seed + t % templates));
+
+            std::vector<uint64_t> key(450);
+            for (uint64_t &k : key) {
+                k = rng();
+            }
+            std::stable_sort(p.rules.begin(), p.rules.end(), [&] (auto const &a, auto const &b) {
+                return key[a.nr] < key[b.nr];
+            });
+            policies.emplace_back("tenant" + std::to_string(t), std::move(p));
+        }
+        return policies;
+    }
+
+    /// A base policy, and for each tenant one to three rules of its own in front of it. The
+    /// tenants' rules come from a pool of a few hundred.
+    std::vector<std::pair<std::string, seccomp::Policy>> overriding_tenants(size_t tenants, uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        seccomp::Policy const base = synthetic_policy(300, Complexity::COMPLEX, seed);
+        std::vector<std::pair<std::string, seccomp::Policy>> policies;
+
+        for (size_t t = 0; t < tenants; t++) {
+            seccomp::Policy p = base;
+            for (unsigned n = 1 + rng() % 3; n > 0; n--) {
+                uint64_t const pick = rng() % 300;
+                p.rules.insert(p.rules.begin(), { uint32_t(pick * 7 % 450), { { 0, ~0ULL, pick % 16 } },
+                                                  SECCOMP_RET_ALLOW });
+            }
+            policies.emplace_back("tenant" + std::to_string(t), std::move(p));
+        }
+        return policies;
+    }
+
+    /// p.probes(), and a thousand calls with random numbers up to well past the highest one and
+    /// random arguments, half of them the values some rule checks for.
+    std::vector<seccomp_data> probe_calls(seccomp::Policy const &p, uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<seccomp_data> calls = p.probes();
+        uint32_t highest = 0;
+        for (seccomp::PolicyRule const &r : p.rules) {
+            highest = std::max(highest, r.nr);
+        }
+
+        for (unsigned i = 0; i < 1000; i++) {
+            seccomp_data d {};
+            d.arch = p.arch;
+            d.nr = int(rng() % (highest + 64));
+            for (auto &a : d.args) {
+                a = rng();
+            }
+            if (!p.rules.empty() && rng() % 2) {
+                seccomp::PolicyRule const &r = p.rules[rng() % p.rules.size()];
+                d.nr = int(r.nr);
+                for (seccomp::ArgCheck const &c : r.checks) {
+                    d.args[c.index] = (d.args[c.index] & ~c.mask) | c.value;
+                }
+            }
+            calls.push_back(d);
+        }
+        return calls;
+    }
+
+    /// Whether filter decides like p on calls.
+    bool decides_like(std::vector<sock_filter> const &filter, seccomp::Policy const &p,
+                      std::vector<seccomp_data> const &calls)
+    {
+        for (seccomp_data const &d : calls) {
+            if (seccomp::evaluate(filter, d).action != p.decide(d)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool decides_like(std::vector<sock_filter> const &filter, seccomp::Policy const &p)
+    {
+        return decides_like(filter, p, probe_calls(p, 1));
+    }
+
+    /// Whether two filters decide alike on calls, cheaper than Policy::decide() for long policies.
+    bool decides_like(std::vector<sock_filter> const &filter, std::vector<sock_filter> const &reference,
+                      std::vector<seccomp_data> const &calls)
+    {
+        for (seccomp_data const &d : calls) {
+            if (seccomp::evaluate(filter, d).action != seccomp::evaluate(reference, d).action) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// A shared filter was compiled from some other tenant's policy.
+    bool all_decide_like(seccomp::PolicyTable const &table,
+                         std::vector<std::pair<std::string, seccomp::Policy>> const &policies)
+    {
+        for (auto const &p : policies) {
+            if (!decides_like(*table.find(p.first), p.second)) {
+                fprintf(stderr, "the filter published for %s does not match its policy\n", p.first.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename FN>
+    double milliseconds(FN const &fn)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    seccomp::Layout layout(seccomp::Dispatch dispatch, bool ranges, bool share)
+    {
+        seccomp::Layout l;
+        l.dispatch = dispatch;
+        l.ranges = ranges;
+        l.share = share;
+        return l;
+    }
+
+}
+
+void *operator new(size_t size)
+{
+    char *const block = static_cast<char *>(malloc(header + size));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t *>(block) = size;
+    size_t const now = allocated += size;
+    size_t p = peak;
+    while (now > p && !peak.compare_exchange_weak(p, now)) {
+    }
+    return block + header;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    if (ptr != nullptr) {
+        char *const p = static_cast<char *>(ptr) - header;
+        allocated -= *reinterpret_cast<size_t *>(p);
+        free(p);
+    }
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_rules = 100000;
+    double max_growth = 1.5;
+    uint32_t seed = 1;
+    size_t batch = 2000;
+    unsigned jobs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string const opt = argv[i];
+
+        if (opt == "--max-rules" && i + 1 < argc) {
+            max_rules = strtoull(argv[++i], nullptr, 0);
+        } else if (opt == "--max-growth" && i + 1 < argc) {
+            max_growth = atof(argv[++i]);
+        } else if (opt == "--seed" && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 0);
+        } else if (opt == "--batch" && i + 1 < argc) {
+            batch = strtoull(argv[++i], nullptr, 0);
+        } else if (opt == "--jobs" && i + 1 < argc) {
+            jobs = strtoul(argv[++i], nullptr, 0);
+        } else {
+            fprintf(stderr, "usage: %s [--max-rules N] [--max-growth EXPONENT] [--seed N] [--batch N] [--jobs N]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<seccomp::Layout> const layouts {
+        layout(seccomp::Dispatch::LINEAR, false, false),
+        layout(seccomp::Dispatch::LINEAR, true, true),
+        layout(seccomp::Dispatch::BALANCED_TREE, true, true),
+    };
+
+    printf("%8s  %-8s %-22s %10s %7s %10s %8s\n", "rules", "args", "layout", "ms", "growth", "peak KiB",
+           "insns");
+
+    unsigned failures = 0;
+    for (Complexity complexity : { Complexity::NONE, Complexity::SIMPLE, Complexity::COMPLEX }) {
+        for (seccomp::Layout const &l : layouts) {
+            Measurement previous;
+            size_t previous_rules = 0;
+
+            for (size_t rules = 10; rules <= max_rules; rules *= 10) {
+                Measurement const m = measure(synthetic_policy(rules, complexity, seed), l);
+
+                // Below a millisecond the clock and the allocator decide, not the compiler.
+                std::string growth = "-";
+                bool const too_fast = previous.ms < 1.0;
+                bool superlinear = false;
+                if (previous.ms > 0) {
+                    double const g = std::log(m.ms / previous.ms) / std::log(double(rules) / previous_rules);
+                    char buf[16];
+                    snprintf(buf, sizeof(buf), "%.2f", g);
+                    growth = buf;
+                    superlinear = !too_fast && g > max_growth;
+                }
+                failures += superlinear;
+
+                printf("%8zu  %-8s %-22s %10.2f %7s %10.0f %8zu%s%s\n", rules, name_of(complexity), l.name().c_str(),
+                       m.ms, growth.c_str(), m.peak_kib, m.instructions,
+                       m.instructions > BPF_MAXINSNS ? "  too big to load" : "",
+                       superlinear ? "  SUPERLINEAR" : "");
+                fflush(stdout);
+
+                previous = m;
+                previous_rules = rules;
+            }
+        }
+    }
+
+    if (batch != 0) {
+        auto const policies = tenant_policies(batch, std::max<size_t>(1, batch / 40), seed);
+        seccomp::Layout const l = layout(seccomp::Dispatch::BALANCED_TREE, true, true);
+
+        double const serial = milliseconds([&] {
+            for (auto const &p : policies) {
+                seccomp::compile(p.second, l);
+            }
+        });
+        printf("\n%zu tenant policies: %.1f ms one by one\n", policies.size(), serial);
+
+        std::vector<unsigned> threads { 1 };
+        unsigned const all = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        if (all > 1) {
+            threads.push_back(all);
+        }
+
+        for (unsigned t : threads) {
+            seccomp::WorkStealingPool pool(t);
+            seccomp::PolicyTable table;
+            seccomp::BatchStats stats;
+            double const ms = milliseconds([&] { stats = seccomp::compile_batch(policies, l, pool, table); });
+            printf("compile_batch on %u threads: %.1f ms, %.1fx faster, %zu distinct policies compiled\n",
+                   pool.workers(), ms, serial / ms, stats.compiled);
+
+            if (!all_decide_like(table, policies)) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        char dir[] = "/tmp/seccomp-store.XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            seccomp::die_errno("mkdtemp");
+        }
+        seccomp::WorkStealingPool pool(jobs);
+
+        for (char const *start : { "cold", "warm" }) {
+            seccomp::FilterStore store(dir);
+            seccomp::PolicyTable table;
+            seccomp::BatchStats stats;
+            double const ms = milliseconds([&] {
+                stats = seccomp::compile_batch(policies, l, pool, table, &store);
+            });
+            printf("%s store: %.1f ms, %zu compiled, %zu from the store\n", start, ms, stats.compiled, stats.stored);
+
+            if (!all_decide_like(table, policies)) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        seccomp::FilterStore store(dir);
+        seccomp::StoreUsage const full = store.evict(UINT64_MAX);
+        seccomp::StoreUsage const half = store.evict(full.bytes / 2);
+        printf("store: %zu entries in %" PRIu64 " KiB, %zu left after evicting down to half\n", full.entries,
+               full.bytes / 1024, half.entries);
+
+        store.evict(0);
+        if (rmdir(dir) != 0) {
+            seccomp::die_errno(dir);
+        }
+
+        printf("\n%8s %12s %14s %16s %12s\n", "tenants", "registry KiB", "bytes/tenant", "filters KiB",
+               "us/compile");
+
+        for (size_t tenants = 100; tenants <= batch * 10; tenants *= 10) {
+            auto const overriding = overriding_tenants(tenants, seed);
+            seccomp::PolicyRegistry registry;
+            for (auto const &p : overriding) {
+                registry.add(p.first, p.second);
+            }
+
+            size_t filters = 0;
+            double const ms = milliseconds([&] {
+                for (auto const &p : overriding) {
+                    filters += registry.compile(p.first).size() * sizeof(sock_filter);
+                }
+            });
+
+            seccomp::RegistryStats const stats = registry.stats();
+            printf("%8zu %12zu %14zu %16zu %12.1f\n", tenants, stats.bytes / 1024, stats.bytes / tenants,
+                   filters / 1024, 1000 * ms / tenants);
+
+            // Every tenant up to a thousand, and a thousand spread over the rest beyond.
+            for (size_t i = 0; i < overriding.size(); i += std::max<size_t>(1, tenants / 1000)) {
+                if (!decides_like(registry.compile(overriding[i].first), overriding[i].second)) {
+                    fprintf(stderr, "the registry compiled %s wrong\n", overriding[i].first.c_str());
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        printf("\n%8s %8s %14s %14s %14s\n", "rules", "edits", "us/edit", "us/rebuild", "us/compile");
+
+        for (size_t rules = 10; rules <= std::min<size_t>(max_rules, 10000); rules *= 10) {
+            std::mt19937_64 rng(seed + rules);
+            seccomp::Policy const spare = synthetic_policy(1000, Complexity::COMPLEX, seed + 1);
+            seccomp::IncrementalPolicy policy(synthetic_policy(rules, Complexity::COMPLEX, seed));
+            size_t const edits = 200;
+            double edit_ms = 0, rebuild_ms = 0, compile_ms = 0;
+
+            for (size_t e = 0; e < edits; e++) {
+                size_t const size = policy.policy().rules.size();
+                std::vector<sock_filter> incremental;
+                if (size == 0 || rng() % 2) {
+                    seccomp::PolicyRule r = spare.rules[rng() % spare.rules.size()];
+                    if (rng() % 8 == 0) {
+                        r.nr = uint32_t(rng() % 2048);  // past every other number, so the trie grows
+                    }
+                    edit_ms += milliseconds([&] {
+                        policy.insert(rng() % (size + 1), r);
+                        incremental = policy.filter();
+                    });
+                } else {
+                    edit_ms += milliseconds([&] {
+                        policy.erase(rng() % size);
+                        incremental = policy.filter();
+                    });
+                }
+
+                std::vector<sock_filter> rebuilt;
+                rebuild_ms += milliseconds([&] {
+                    seccomp::PolicyRegistry registry;
+                    registry.add("", policy.policy());
+                    rebuilt = registry.compile("");
+                });
+                std::vector<sock_filter> compiled;
+                compile_ms += milliseconds([&] {
+                    compiled = seccomp::compile(policy.policy(), l);
+                });
+
+                if (incremental.size() != rebuilt.size() ||
+                    memcmp(incremental.data(), rebuilt.data(), rebuilt.size() * sizeof(sock_filter)) != 0 ||
+                    !decides_like(incremental, compiled, probe_calls(policy.policy(), uint32_t(e)))) {
+                    fprintf(stderr, "edit %zu of a policy of %zu rules recompiled differently\n", e, rules);
+                    return EXIT_FAILURE;
+                }
+            }
+
+            printf("%8zu %8zu %14.1f %14.1f %14.1f\n", rules, edits, 1000 * edit_ms / edits,
+                   1000 * rebuild_ms / edits, 1000 * compile_ms / edits);
+        }
+    }
+
+    if (failures != 0) {
+        printf("FAIL: compile time grew faster than n^%.2f %u times\n", max_growth, failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// EOF
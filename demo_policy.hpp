@@ -0,0 +1,71 @@
+#pragma once
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bpf_dsl.hpp"
+#include "policy.hpp"
+#include "policy_compose.hpp"
+#include "seccomp_child.hpp"
+
+namespace seccomp {
+
+    /// The sandbox of the example program: it may print to stdout and exit.
+    inline std::unique_ptr<SeccompChild> make_demo_sandbox()
+    {
+        using dsl::allow;
+        using dsl::arg;
+
+        return std::unique_ptr<SeccompChild>(new SeccompChild {
+            SeccompWhitelist(SYS_exit_group),
+            SeccompWhitelist(SYS_exit),
+
+            // Only allow write to stdout.
+            allow(SYS_write).when(arg(0) == STDOUT_FILENO),
+
+            // Seems to be used for isatty().
+            SeccompWhitelistWithArg(SYS_fstat, STDOUT_FILENO),
+
+            // To allocate memory.
+            SeccompWhitelistWithArg(SYS_mmap, 0),
+        });
+    }
+
+    /// The groups of rules of make_demo_sandbox() as profiles.
+    inline std::vector<PolicyProfile> make_demo_profiles()
+    {
+        std::vector<ArgCheck> const stdout_only { { 0, ~0ULL, STDOUT_FILENO } };
+
+        return {
+            { "base-runtime", 0, { { SYS_exit_group, {}, SECCOMP_RET_ALLOW },
+                                   { SYS_exit, {}, SECCOMP_RET_ALLOW } } },
+
+            // fstat seems to be used for isatty().
+            { "stdout-only", 0, { { SYS_write, stdout_only, SECCOMP_RET_ALLOW },
+                                  { SYS_fstat, stdout_only, SECCOMP_RET_ALLOW } } },
+
+            { "malloc", 0, { { SYS_mmap, { { 0, ~0ULL, 0 } }, SECCOMP_RET_ALLOW } } },
+        };
+    }
+
+    /// The same rules as make_demo_sandbox() as a Policy, so they can be laid out for a workload.
+    inline Policy make_demo_policy()
+    {
+        Policy p;
+        std::string error;
+        if (!compose(make_demo_profiles(), SECCOMP_RET_KILL, p, error)) {
+            fprintf(stderr, "demo policy: %s\n", error.c_str());
+            exit(EXIT_FAILURE);
+        }
+        return p;
+    }
+
+}
+
+// EOF
@@ -0,0 +1,499 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bpf_disasm.hpp"
+#include "bpf_dsl.hpp"
+#include "bpf_eval.hpp"
+#include "bpf_superopt.hpp"
+#include "demo_policy.hpp"
+#include "seccomp_child.hpp"
+
+// Differential test of the userspace filter model against the kernel.
+//
+// Every return in the filter is rewritten to fail the system call with an errno that identifies
+// the return, so nothing the sweep calls is actually executed. Children install the rewritten
+// filter, issue raw system calls for every number with a battery of arguments and record the
+// errno they get. The parent checks that each call ended at the return the model predicts. The
+// superoptimized versions of the demo filter and of two that mask their arguments must also return
+// what the originals do.
+//
+// Then the same for the DSL's 64-bit comparisons, each on a system call number of its own, with
+// every constant they compare against and its neighbours as arguments. There the action must also
+// be what comparing the numbers in C++ gives.
+
+namespace {
+
+    using seccomp::die_errno;
+
+    /// exit_group with this in args[5] is let through, so children can exit.
+    uint64_t const exit_magic = 0x5ecc0ffee0ddf00dULL;
+
+    /// The kernel clamps errno values to this.
+    unsigned const max_errno = 4095;
+
+    struct Case {
+        uint32_t nr;
+        uint64_t args[6];
+    };
+
+    /// The filter under test with returns replaced by ERRNO(max_errno - i), where ret_pcs[i] is
+    /// where the return was in the original. Counting down from the top keeps the ids clear of
+    /// errno values a system call could produce by itself.
+    struct Instrumented {
+        std::vector<sock_filter> prog;
+        std::vector<size_t> ret_pcs;
+    };
+
+    Instrumented instrument(std::vector<sock_filter> const &prog)
+    {
+        uint32_t const arg5 = offsetof(struct seccomp_data, args) + 5 * sizeof(uint64_t);
+        Instrumented result;
+
+        result.prog = {
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_exit_group, 0, 5),
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, arg5),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(exit_magic), 0, 3),
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, arg5 + sizeof(uint32_t)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(exit_magic >> 32), 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        };
+
+        for (size_t pc = 0; pc < prog.size(); pc++) {
+            sock_filter insn = prog[pc];
+
+            if (insn.code == (BPF_RET | BPF_A)) {
+                fprintf(stderr, "difftest: instruction %zu returns A, which cannot be told apart\n", pc);
+                exit(EXIT_FAILURE);
+            }
+            if (insn.code == (BPF_RET | BPF_K)) {
+                result.ret_pcs.push_back(pc);
+                if (result.ret_pcs.size() > max_errno) {
+                    fprintf(stderr, "difftest: more than %u returns\n", max_errno);
+                    exit(EXIT_FAILURE);
+                }
+                insn.k = SECCOMP_RET_ERRNO | (max_errno + 1 - result.ret_pcs.size());
+            }
+            result.prog.push_back(insn);
+        }
+
+        return result;
+    }
+
+    /// Values worth passing as arguments: boundaries and whatever the filter compares against.
+    std::vector<uint64_t> argument_values(std::vector<sock_filter> const &prog)
+    {
+        std::set<uint64_t> values {
+            0, 1, 2, 3, ~uint64_t(0), 0xffffffff, 0x100000000ULL, 0x7fffffff, 0x80000000,
+            0x7fffffffffffffffULL, 0x8000000000000000ULL, uint64_t(int64_t(-100)),
+        };
+
+        std::set<uint64_t> constants, masks;
+        for (sock_filter const &insn : prog) {
+            if (insn.code == (BPF_ALU | BPF_AND | BPF_K)) {
+                masks.insert(insn.k);
+            }
+            if (BPF_CLASS(insn.code) != BPF_JMP || BPF_OP(insn.code) == BPF_JA) {
+                continue;
+            }
+
+            uint64_t const c = insn.k;
+            constants.insert(c);
+            values.insert({ c, c - 1, c + 1, c << 32, (c << 32) | c, ((c + 1) << 32) | c });
+        }
+
+        // Equal to a constant under a mask, different outside it.
+        for (uint64_t m : masks) {
+            for (uint64_t c : constants) {
+                values.insert({ c | (~m & 0xffffffff), c | (0x100 & ~m) });
+            }
+        }
+
+        return std::vector<uint64_t>(values.begin(), values.end());
+    }
+
+    /// A sandbox whose rules mask their arguments, so that the superoptimizer has masks to keep.
+    std::vector<sock_filter> make_masked_filter()
+    {
+        using seccomp::dsl::allow;
+        using seccomp::dsl::arg;
+
+        seccomp::SeccompChild s {
+            allow(SYS_write).when((arg(0) & 0xff) == STDOUT_FILENO),
+            allow(SYS_mmap).when((arg(2) & PROT_EXEC) == 0),
+            allow(SYS_openat).when((arg(2) & O_ACCMODE) == O_RDONLY),
+        };
+        return s.filter();
+    }
+
+    /// A whole filter that only masks and compares an argument. Without the mask it decides
+    /// differently for 0x105.
+    std::vector<sock_filter> const masked_fragment {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args)),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xff),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+    };
+
+    std::vector<Case> make_cases(std::vector<sock_filter> const &prog, uint32_t max_nr, unsigned random_per_nr)
+    {
+        std::vector<uint64_t> const values = argument_values(prog);
+        std::vector<uint32_t> nrs;
+        std::vector<Case> cases;
+        std::mt19937_64 rng(1);
+
+        // uretprobe and uprobe do not go through seccomp since Linux 6.11.
+        uint32_t const exempt[] = { 335, 336 };
+        for (uint32_t nr = 0; nr < max_nr; nr++) {
+            if (std::find(std::begin(exempt), std::end(exempt), nr) == std::end(exempt)) {
+                nrs.push_back(nr);
+            }
+        }
+        // x32 system calls and numbers no table has.
+        nrs.insert(nrs.end(), { 0x40000000, 0x40000001, 0x7fffffff });
+
+        for (uint32_t nr : nrs) {
+            // One argument at a time, then everything at once.
+            for (unsigned i = 0; i < 6; i++) {
+                for (uint64_t v : values) {
+                    Case c { nr, {} };
+                    c.args[i] = v;
+                    cases.push_back(c);
+                }
+            }
+            for (unsigned n = 0; n < random_per_nr; n++) {
+                Case c { nr, {} };
+                for (uint64_t &a : c.args) {
+                    a = values[rng() % values.size()];
+                }
+                cases.push_back(c);
+            }
+        }
+
+        // Never ask the filter to let a child exit by accident.
+        for (Case &c : cases) {
+            if (c.args[5] == exit_magic) {
+                c.args[5] = 0;
+            }
+        }
+
+        return cases;
+    }
+
+    /// What a child records for a call that took it down instead of returning.
+    int const did_not_return = -2;
+
+    /// Run all cases against the kernel, split across `jobs` children. Returns the errno each
+    /// call failed with, -1 if it succeeded and did_not_return if the child died in it. Children
+    /// that die are replaced and carry on behind the call that killed them.
+    std::vector<int> run_in_kernel(Instrumented const &inst, std::vector<Case> const &cases, unsigned jobs)
+    {
+        size_t const bytes = (cases.size() + jobs) * sizeof(long);
+        void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            die_errno("mmap");
+        }
+        long *observed = static_cast<long *>(mem);
+        long *progress = observed + cases.size();
+
+        struct Range {
+            size_t begin, end;
+        };
+
+        std::vector<Range> todo;
+        for (unsigned j = 0; j < jobs; j++) {
+            todo.push_back({ cases.size() * j / jobs, cases.size() * (j + 1) / jobs });
+        }
+
+        while (!todo.empty()) {
+            std::vector<std::unique_ptr<seccomp::SeccompChild>> children;
+
+            for (size_t j = 0; j < todo.size(); j++) {
+                Range const r = todo[j];
+                long *const done = &progress[j];
+                *done = r.begin;
+
+                children.emplace_back(new seccomp::SeccompChild(inst.prog));
+                children.back()->run([&cases, observed, done, r] {
+                    for (size_t i = r.begin; i < r.end; i++) {
+                        Case const &c = cases[i];
+                        *done = i;
+                        long const ret = syscall(c.nr, c.args[0], c.args[1], c.args[2], c.args[3], c.args[4], c.args[5]);
+                        observed[i] = ret == -1 ? errno : -1;
+                    }
+                    *done = r.end;
+
+                    syscall(SYS_exit_group, 0, 0, 0, 0, 0, exit_magic);
+                    return EXIT_FAILURE;
+                });
+            }
+
+            std::vector<Range> again;
+            for (size_t j = 0; j < todo.size(); j++) {
+                children[j]->wait_for_child();
+
+                size_t const stuck = progress[j];
+                if (stuck < todo[j].end) {
+                    observed[stuck] = did_not_return;
+                    if (stuck + 1 < todo[j].end) {
+                        again.push_back({ stuck + 1, todo[j].end });
+                    }
+                }
+            }
+            todo = std::move(again);
+        }
+
+        std::vector<int> result(observed, observed + cases.size());
+        munmap(mem, bytes);
+        return result;
+    }
+
+    seccomp_data data_for(Case const &c)
+    {
+        seccomp_data d {};
+        d.nr = c.nr;
+        d.arch = AUDIT_ARCH_X86_64;
+        for (unsigned i = 0; i < 6; i++) {
+            d.args[i] = c.args[i];
+        }
+        return d;
+    }
+
+    /// Where the model says prog returns for d.
+    size_t model_ret_pc(std::vector<sock_filter> const &prog, seccomp_data const &d)
+    {
+        size_t last = SIZE_MAX;
+        seccomp::evaluate(prog.data(), prog.size(), d, [&last] (size_t pc) { last = pc; });
+        return last;
+    }
+
+    void print_case(Case const &c)
+    {
+        char const *name = seccomp::syscall_name(c.nr);
+        fprintf(stderr, "  %s(", name ? name : std::to_string(c.nr).c_str());
+        for (unsigned i = 0; i < 6; i++) {
+            fprintf(stderr, "%s%#" PRIx64, i ? ", " : "", c.args[i]);
+        }
+        fprintf(stderr, ")");
+    }
+
+    /// Check one filter. Also checks that it returns the actions `reference` says it should.
+    size_t check(char const *name, std::vector<sock_filter> const &prog,
+                 std::function<uint32_t(seccomp_data const &)> const &reference,
+                 std::vector<Case> const &cases, unsigned jobs)
+    {
+        Instrumented const inst = instrument(prog);
+
+        auto const start = std::chrono::steady_clock::now();
+        std::vector<int> const observed = run_in_kernel(inst, cases, jobs);
+        double const secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t failures = 0;
+        size_t lost = 0;
+        for (size_t i = 0; i < cases.size(); i++) {
+            seccomp_data const d = data_for(cases[i]);
+            size_t const expected = model_ret_pc(prog, d);
+            int const id = observed[i];
+
+            // The filter fails every call, so one that never came back got past it.
+            if (id == did_not_return) {
+                if (lost++ < 10) {
+                    print_case(cases[i]);
+                    fprintf(stderr, ": did not return\n");
+                }
+                continue;
+            }
+
+            size_t const index = max_errno - id;
+            size_t const got = id >= 1 && index < inst.ret_pcs.size() ? inst.ret_pcs[index] : SIZE_MAX;
+            bool const same_ret = got == expected;
+            bool const same_action = got != SIZE_MAX &&
+                prog[got].k == reference(d);
+
+            if (same_ret && same_action) {
+                continue;
+            }
+
+            if (failures++ < 10) {
+                print_case(cases[i]);
+                if (got == SIZE_MAX) {
+                    fprintf(stderr, ": kernel returned %d, model expected the return at %zu\n", id, expected);
+                } else if (!same_ret) {
+                    fprintf(stderr, ": kernel returned at %zu, model at %zu\n", got, expected);
+                } else {
+                    fprintf(stderr, ": %s differs from the reference\n",
+                            seccomp::disassemble_insn(prog[got], got).c_str());
+                }
+            }
+        }
+
+        printf("%-12s %zu instructions, %zu calls in %.2fs on %u children, %zu mismatches, %zu did not return\n",
+               name, prog.size(), cases.size(), secs, jobs, failures, lost);
+        return failures + lost;
+    }
+
+    enum class Op { EQ, NE, LT, LE, GT, GE };
+
+    struct Comparison {
+        Op op;
+        bool is_signed;
+        uint64_t mask;
+        uint64_t value;
+
+        bool holds(uint64_t arg) const
+        {
+            uint64_t const a = arg & mask;
+            bool const less = is_signed ? int64_t(a) < int64_t(value) : a < value;
+            bool const greater = is_signed ? int64_t(a) > int64_t(value) : a > value;
+            switch (op) {
+            case Op::EQ: return a == value;
+            case Op::NE: return a != value;
+            case Op::LT: return less;
+            case Op::LE: return !greater;
+            case Op::GT: return greater;
+            case Op::GE: return !less;
+            }
+            return false;
+        }
+
+        /// ALLOW on system call nr where it holds for args[0].
+        void push_into(uint32_t nr, std::vector<sock_filter> &v) const
+        {
+            using namespace seccomp::dsl;
+
+            Arg const a = (is_signed ? signed_arg(0) : arg(0)) & mask;
+            switch (op) {
+            case Op::EQ: allow(nr).when(a == value).push_into(v); break;
+            case Op::NE: allow(nr).when(a != value).push_into(v); break;
+            case Op::LT: allow(nr).when(a < value).push_into(v); break;
+            case Op::LE: allow(nr).when(a <= value).push_into(v); break;
+            case Op::GT: allow(nr).when(a > value).push_into(v); break;
+            case Op::GE: allow(nr).when(a >= value).push_into(v); break;
+            }
+        }
+    };
+
+    /// Every comparison of the DSL against constants at the edges of 32 and 64-bit numbers, each
+    /// checked in the kernel against what the numbers say. One filter per mask keeps them short.
+    size_t check_comparisons(unsigned jobs)
+    {
+        uint64_t const values[] = {
+            0, 1, 4096, 0x7fffffff, 0x80000000, 0xffffffff, 0x100000000ULL, 0x123456789ULL,
+            0x7fffffffffffffffULL, 0x8000000000000000ULL, uint64_t(-100), ~uint64_t(0),
+        };
+        uint64_t const masks[] = { ~uint64_t(0), 0xffffffff, 0xffffffff00000000ULL, 0x800000000000ffffULL };
+
+        std::set<uint64_t> edges;
+        for (uint64_t v : values) {
+            edges.insert({ v - 1, v, v + 1 });
+        }
+
+        size_t failures = 0;
+        size_t instructions = 0;
+        for (uint64_t mask : masks) {
+            std::vector<Comparison> comparisons;
+            for (bool is_signed : { false, true }) {
+                for (Op op : { Op::EQ, Op::NE, Op::LT, Op::LE, Op::GT, Op::GE }) {
+                    for (uint64_t v : values) {
+                        comparisons.push_back({ op, is_signed, mask, v });
+                    }
+                }
+            }
+
+            std::vector<sock_filter> prog;
+            std::vector<Case> cases;
+            for (uint32_t nr = 0; nr < comparisons.size(); nr++) {
+                comparisons[nr].push_into(nr, prog);
+                for (uint64_t a : edges) {
+                    cases.push_back({ nr, { a } });
+                }
+            }
+            prog.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | 1));
+            instructions += prog.size();
+
+            char name[32];
+            snprintf(name, sizeof(name), "%#" PRIx64, mask);
+            failures += check(name, prog, [&comparisons] (seccomp_data const &d) {
+                return uint32_t(d.nr) < comparisons.size() && comparisons[d.nr].holds(d.args[0]) ?
+                    SECCOMP_RET_ALLOW : SECCOMP_RET_ERRNO | 1;
+            }, cases, jobs);
+        }
+
+        // Loading nr, comparing it and returning take three per rule, the rest is the comparisons.
+        size_t const count = sizeof(masks) / sizeof(masks[0]) * 2 * 6 * sizeof(values) / sizeof(values[0]);
+        printf("%zu comparisons in %.2f instructions each\n", count, double(instructions) / count - 3);
+        return failures;
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    unsigned jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_nr = 512;
+    unsigned random_per_nr = 16;
+
+    for (int i = 1; i < argc; i++) {
+        std::string const opt = argv[i];
+
+        if (opt == "-j" && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else if (opt == "--max-nr" && i + 1 < argc) {
+            max_nr = strtoul(argv[++i], nullptr, 0);
+        } else if (opt == "--random" && i + 1 < argc) {
+            random_per_nr = strtoul(argv[++i], nullptr, 0);
+        } else {
+            fprintf(stderr, "usage: %s [-j JOBS] [--max-nr N] [--random N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<sock_filter> const demo = seccomp::make_demo_sandbox()->filter();
+    std::vector<sock_filter> const superopt =
+        seccomp::superoptimize_prefix(demo, 24, seccomp::SuperoptOptions());
+
+    // The optimized variant is held to the same arguments as the original.
+    std::vector<Case> const cases = make_cases(demo, max_nr, random_per_nr);
+
+    size_t failures = 0;
+    auto const demo_action = [&demo] (seccomp_data const &d) { return seccomp::evaluate(demo, d).action; };
+    failures += check("demo", demo, demo_action, cases, jobs);
+    failures += check("superopt", superopt, demo_action, cases, jobs);
+
+    // The demo has no masks. These do, and the optimized versions must keep them.
+    std::vector<sock_filter> const masked = make_masked_filter();
+    auto const masked_action = [&masked] (seccomp_data const &d) { return seccomp::evaluate(masked, d).action; };
+    failures += check("masked", seccomp::superoptimize_prefix(masked, 24, seccomp::SuperoptOptions()), masked_action,
+                      make_cases(masked, max_nr, random_per_nr), jobs);
+
+    auto const fragment_action = [] (seccomp_data const &d) { return seccomp::evaluate(masked_fragment, d).action; };
+    failures += check("fragment", seccomp::superoptimize(masked_fragment, {}, 0, seccomp::SuperoptOptions()),
+                      fragment_action, make_cases(masked_fragment, max_nr, random_per_nr), jobs);
+    failures += check_comparisons(jobs);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// EOF
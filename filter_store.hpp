@@ -0,0 +1,237 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "seccomp_child.hpp"
+
+/// Compiled filters in a directory, so that every process on a host can reuse what any of them
+/// compiled.
+///
+/// Entries are addressed by a key of words that says everything the filter depends on, and named
+/// after its hash. Each file holds the whole key, which is compared on every read, so equal hashes
+/// of different keys are only misses. Files are written under a temporary name and renamed into
+/// place: readers see a complete entry or none. Reads go through mmap.
+
+namespace seccomp {
+
+    namespace store_format {
+
+        char const magic[8] = { 'S', 'E', 'C', 'C', 'B', 'P', 'F', '\0' };
+        uint32_t const version = 1;
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t instructions;
+            uint64_t key_words;
+        };
+
+        /// Temporary files of writers that died are removed after this many seconds.
+        time_t const stale_seconds = 600;
+
+    }
+
+    struct StoreUsage {
+        size_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    class FilterStore {
+        std::string dir_;
+        mutable std::atomic<uint64_t> hits_ { 0 };
+        mutable std::atomic<uint64_t> misses_ { 0 };
+
+        static uint64_t hash(std::vector<uint64_t> const &key)
+        {
+            // FNV-1a, a word at a time
+            uint64_t h = 0xcbf29ce484222325ULL;
+            for (uint64_t w : key) {
+                h = (h ^ w) * 0x100000001b3ULL;
+                h ^= h >> 32;
+            }
+            return h;
+        }
+
+        std::string path_of(std::vector<uint64_t> const &key) const
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/%016" PRIx64 ".bpf", hash(key));
+            return dir_ + name;
+        }
+
+        static bool is_entry(std::string const &name)
+        {
+            return name.size() > 4 && name.compare(name.size() - 4, 4, ".bpf") == 0 && name[0] != '.';
+        }
+
+    public:
+        /// Use dir, creating it if it does not exist.
+        explicit FilterStore(std::string dir)
+            : dir_(std::move(dir))
+        {
+            if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+                die_errno(dir_.c_str());
+            }
+        }
+
+        FilterStore(FilterStore const &) = delete;
+        FilterStore &operator=(FilterStore const &) = delete;
+
+        std::string const &dir() const { return dir_; }
+        uint64_t hits() const { return hits_; }
+        uint64_t misses() const { return misses_; }
+
+        /// The filter stored under key. Unreadable or foreign entries are misses.
+        bool find(std::vector<uint64_t> const &key, std::vector<sock_filter> &filter) const
+        {
+            using namespace store_format;
+
+            std::string const path = path_of(key);
+            int const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+                misses_++;
+                return false;
+            }
+
+            size_t const size = st.st_size;
+            void *const m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) {
+                ::close(fd);
+                misses_++;
+                return false;
+            }
+
+            Header const *const h = static_cast<Header const *>(m);
+            uint64_t const *const words = reinterpret_cast<uint64_t const *>(h + 1);
+            bool const ok = memcmp(h->magic, magic, sizeof(magic)) == 0 && h->version == version &&
+                h->key_words == key.size() &&
+                size == sizeof(Header) + h->key_words * sizeof(uint64_t) + h->instructions * sizeof(sock_filter) &&
+                std::equal(key.begin(), key.end(), words);
+            if (ok) {
+                sock_filter const *const insns = reinterpret_cast<sock_filter const *>(words + h->key_words);
+                filter.assign(insns, insns + h->instructions);
+
+                // The modification time says when the entry was last used, for evict().
+                futimens(fd, nullptr);
+            }
+
+            munmap(m, size);
+            ::close(fd);
+            (ok ? hits_ : misses_)++;
+            return ok;
+        }
+
+        /// Store filter under key. Failing to is not an error: the filter just is not shared.
+        bool insert(std::vector<uint64_t> const &key, std::vector<sock_filter> const &filter)
+        {
+            using namespace store_format;
+            static std::atomic<unsigned> counter { 0 };
+
+            char tmp[64];
+            snprintf(tmp, sizeof(tmp), "/.tmp.%ld.%u", long(getpid()), counter++);
+            std::string const tmp_path = dir_ + tmp;
+
+            FILE *f = fopen(tmp_path.c_str(), "wb");
+            if (f == nullptr) {
+                return false;
+            }
+
+            Header h;
+            memcpy(h.magic, magic, sizeof(magic));
+            h.version = version;
+            h.instructions = uint32_t(filter.size());
+            h.key_words = key.size();
+
+            bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+                fwrite(key.data(), sizeof(uint64_t), key.size(), f) == key.size() &&
+                fwrite(filter.data(), sizeof(sock_filter), filter.size(), f) == filter.size();
+            ok = fclose(f) == 0 && ok;
+            ok = ok && rename(tmp_path.c_str(), path_of(key).c_str()) == 0;
+
+            if (!ok) {
+                unlink(tmp_path.c_str());
+            }
+            return ok;
+        }
+
+        /// Remove the least recently used entries until the rest take at most max_bytes, and
+        /// what writers that died left behind. Returns what is left.
+        StoreUsage evict(uint64_t max_bytes)
+        {
+            struct Entry {
+                std::string path;
+                uint64_t bytes;
+                struct timespec used;
+            };
+
+            DIR *d = opendir(dir_.c_str());
+            if (d == nullptr) {
+                die_errno(dir_.c_str());
+            }
+
+            std::vector<Entry> entries;
+            StoreUsage usage;
+            time_t const now = time(nullptr);
+
+            while (struct dirent const *e = readdir(d)) {
+                std::string const name = e->d_name;
+                std::string const path = dir_ + "/" + name;
+                struct stat st;
+                if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+
+                if (name.compare(0, 5, ".tmp.") == 0) {
+                    if (now - st.st_mtime > store_format::stale_seconds) {
+                        unlink(path.c_str());
+                    }
+                } else if (is_entry(name)) {
+                    entries.push_back({ path, uint64_t(st.st_size), st.st_mtim });
+                    usage.entries++;
+                    usage.bytes += st.st_size;
+                }
+            }
+            closedir(d);
+
+            std::sort(entries.begin(), entries.end(), [] (Entry const &a, Entry const &b) {
+                return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+            });
+
+            for (Entry const &e : entries) {
+                if (usage.bytes <= max_bytes) {
+                    break;
+                }
+                // Another process may have evicted it already.
+                if (unlink(e.path.c_str()) == 0 || errno == ENOENT) {
+                    usage.entries--;
+                    usage.bytes -= e.bytes;
+                }
+            }
+            return usage;
+        }
+    };
+
+}
+
+// EOF
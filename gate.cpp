@@ -0,0 +1,285 @@
+#include <dirent.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "autotune.hpp"
+#include "bpf_sim.hpp"
+#include "policy_text.hpp"
+#include "syscall_names.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+/// Keeps the cost of policy edits visible: every policy in a directory is compiled and its cost
+/// for the hottest system calls of a reference trace compared against a stored baseline. Both the
+/// instructions per call and the nanoseconds per call in the kernel are gated; a timing is only
+/// compared where the baseline has one, and differences below --ns-slack do not count.
+
+namespace {
+
+    struct Cost {
+        /// Instructions per call in the simulator, cached calls counting as none.
+        double insns = -1;
+
+        /// Nanoseconds per call the filter adds in the kernel, negative if not measured.
+        double ns = -1;
+    };
+
+    /// By policy file name, then by system call name. "all" is the whole trace.
+    using Costs = std::map<std::string, std::map<std::string, Cost>>;
+
+    struct Options {
+        double threshold = 0.10;
+
+        /// Timing differences below this many nanoseconds are noise, whatever the ratio. The
+        /// kernel compiles filters to machine code, so one instruction costs well under a
+        /// nanosecond, and only big changes show above the jitter of system calls. The
+        /// instruction counts are exact and only have to stay within the threshold.
+        double ns_slack = 20.0;
+
+        size_t hot = 10;
+
+        /// Many short runs give the median something to work with.
+        size_t timing_calls = 20000;
+        unsigned repetitions = 15;
+        bool kernel = true;
+        bool update = false;
+    };
+
+    std::string name_of(uint32_t nr)
+    {
+        char const *name = seccomp::syscall_name(nr);
+        return name ? name : std::to_string(nr);
+    }
+
+    std::vector<std::string> policy_files(char const *dir)
+    {
+        DIR *d = opendir(dir);
+        if (d == nullptr) {
+            seccomp::die_errno(dir);
+        }
+
+        std::vector<std::string> files;
+        while (struct dirent const *e = readdir(d)) {
+            std::string const name = e->d_name;
+            if (name.size() > 7 && name.compare(name.size() - 7, 7, ".policy") == 0) {
+                files.push_back(name);
+            }
+        }
+        closedir(d);
+
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    /// "policy syscall insns ns" lines, with "-" for what was not measured. A missing file is an
+    /// empty baseline.
+    Costs read_baseline(char const *path)
+    {
+        Costs costs;
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            return costs;
+        }
+
+        char line[512], policy[256], syscall[64], insns[32], ns[32];
+        while (fgets(line, sizeof(line), f) != nullptr) {
+            if (line[0] == '#' || sscanf(line, "%255s %63s %31s %31s", policy, syscall, insns, ns) != 4) {
+                continue;
+            }
+            Cost &c = costs[policy][syscall];
+            c.insns = insns[0] == '-' ? -1 : atof(insns);
+            c.ns = ns[0] == '-' ? -1 : atof(ns);
+        }
+
+        fclose(f);
+        return costs;
+    }
+
+    void write_baseline(char const *path, Costs const &costs)
+    {
+        FILE *f = fopen(path, "w");
+        if (f == nullptr) {
+            seccomp::die_errno(path);
+        }
+
+        fprintf(f, "# policy system-call instructions/call ns/call\n");
+        for (auto const &p : costs) {
+            for (auto const &s : p.second) {
+                fprintf(f, "%s %s %.3f ", p.first.c_str(), s.first.c_str(), s.second.insns);
+                if (s.second.ns >= 0) {
+                    fprintf(f, "%.1f\n", s.second.ns);
+                } else {
+                    fprintf(f, "-\n");
+                }
+            }
+        }
+
+        if (fclose(f) != 0) {
+            seccomp::die_errno(path);
+        }
+    }
+
+    bool regressed(double now, double base, double threshold, double slack)
+    {
+        return base >= 0 && now >= 0 && now > base * (1 + threshold) && now - base > slack;
+    }
+
+    std::string change(double now, double base)
+    {
+        if (now < 0) {
+            return "-";
+        }
+        if (base < 0) {
+            return "new";
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%+.1f%%", base > 0 ? 100.0 * (now - base) / base : now > 0 ? 100.0 : 0.0);
+        return buf;
+    }
+
+    std::string value(double v, char const *format)
+    {
+        if (v < 0) {
+            return "-";
+        }
+        char buf[32];
+        snprintf(buf, sizeof(buf), format, v);
+        return buf;
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    std::vector<char const *> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string const opt = argv[i];
+
+        if (opt == "--threshold" && i + 1 < argc) {
+            opts.threshold = atof(argv[++i]) / 100;
+        } else if (opt == "--ns-slack" && i + 1 < argc) {
+            opts.ns_slack = atof(argv[++i]);
+        } else if (opt == "--hot" && i + 1 < argc) {
+            opts.hot = strtoul(argv[++i], nullptr, 0);
+        } else if (opt == "--no-kernel") {
+            opts.kernel = false;
+        } else if (opt == "--update") {
+            opts.update = true;
+        } else if (opt.compare(0, 2, "--") != 0) {
+            args.push_back(argv[i]);
+        } else {
+            args.clear();
+            break;
+        }
+    }
+
+    if (args.size() != 3) {
+        fprintf(stderr, "usage: %s POLICY_DIR TRACE BASELINE [--threshold PERCENT] [--ns-slack NS] [--hot N] "
+                "[--no-kernel] [--update]\n"
+                "Fails if instructions per call, or nanoseconds per call in the kernel, grew by more than\n"
+                "--threshold percent (10) over BASELINE. Timings also have to grow by more than --ns-slack\n"
+                "nanoseconds (20), and are only compared where BASELINE has them: --update records them\n"
+                "unless --no-kernel is given.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char const *const dir = args[0];
+    char const *const baseline_path = args[2];
+    seccomp::TraceReader const trace(args[1]);
+    seccomp::WorkStealingPool pool;
+
+    // The hottest system calls of the trace, and some of their calls to time.
+    std::map<uint32_t, uint64_t> counts;
+    trace.for_each([&] (seccomp::TraceRecord const &r) {
+        counts[r.nr]++;
+    });
+    std::vector<std::pair<uint32_t, uint64_t>> hot(counts.begin(), counts.end());
+    std::stable_sort(hot.begin(), hot.end(), [] (auto const &a, auto const &b) { return a.second > b.second; });
+    hot.resize(std::min(hot.size(), opts.hot));
+
+    std::map<uint32_t, std::vector<seccomp::TraceRecord>> calls;
+    for (auto const &h : hot) {
+        calls[h.first];
+    }
+    trace.for_each([&] (seccomp::TraceRecord const &r) {
+        auto const it = calls.find(r.nr);
+        if (it != calls.end() && it->second.size() < opts.timing_calls && seccomp::can_time(r)) {
+            it->second.push_back(r);
+        }
+    });
+
+    Costs const baseline = read_baseline(baseline_path);
+    Costs now;
+    unsigned regressions = 0;
+
+    printf("%-20s %-14s %8s %8s %8s %8s %8s %8s\n", "policy", "system call", "insns", "base", "change",
+           "ns", "base", "change");
+
+    for (std::string const &file : policy_files(dir)) {
+        std::string const path = std::string(dir) + "/" + file;
+        seccomp::Policy policy;
+        std::string error;
+        if (!seccomp::read_policy(path.c_str(), policy, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return EXIT_FAILURE;
+        }
+
+        // Compiled the way it would be deployed: in the layout that is best for the trace.
+        seccomp::AutotuneOptions tune;
+        tune.timed = 0;
+        std::vector<sock_filter> const filter = seccomp::autotune(policy, trace, pool, tune).winner().filter;
+        seccomp::SimReport const sim = seccomp::FilterSimulator(filter, {}).replay(trace, pool);
+
+        std::map<std::string, Cost> &costs = now[file];
+        costs["all"].insns = sim.calls ? double(sim.executed) / sim.calls : 0.0;
+        for (auto const &h : hot) {
+            seccomp::SyscallCost const &c = sim.syscalls.at(h.first);
+            Cost &cost = costs[name_of(h.first)];
+            cost.insns = double(c.executed) / c.calls;
+            if (opts.kernel && !calls[h.first].empty()) {
+                cost.ns = seccomp::kernel_cost(filter, calls[h.first], opts.repetitions);
+            }
+        }
+
+        for (auto const &c : costs) {
+            Cost base;
+            auto const p = baseline.find(file);
+            if (p != baseline.end() && p->second.count(c.first)) {
+                base = p->second.at(c.first);
+            }
+
+            bool const worse = regressed(c.second.insns, base.insns, opts.threshold, 0) ||
+                regressed(c.second.ns, base.ns, opts.threshold, opts.ns_slack);
+            regressions += worse;
+
+            printf("%-20s %-14s %8s %8s %8s %8s %8s %8s%s\n", file.c_str(), c.first.c_str(),
+                   value(c.second.insns, "%.2f").c_str(), value(base.insns, "%.2f").c_str(),
+                   change(c.second.insns, base.insns).c_str(), value(c.second.ns, "%.1f").c_str(),
+                   value(base.ns, "%.1f").c_str(), change(c.second.ns, base.ns).c_str(),
+                   worse ? "  REGRESSION" : "");
+        }
+    }
+
+    if (opts.update) {
+        write_baseline(baseline_path, now);
+        printf("baseline %s updated\n", baseline_path);
+        return EXIT_SUCCESS;
+    }
+
+    if (regressions != 0) {
+        printf("FAIL: %u system calls got more than %.0f%% slower than in %s\n", regressions,
+               opts.threshold * 100, baseline_path);
+        return EXIT_FAILURE;
+    }
+    printf("ok: nothing got more than %.0f%% slower than in %s\n", opts.threshold * 100, baseline_path);
+    return EXIT_SUCCESS;
+}
+
+// EOF
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <linux/filter.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "seccomp_child.hpp"
+
+/// Launches of sandboxed children, queued instead of forked as soon as they are asked for.
+///
+/// Forks that run at the same time slow each other down, so under a burst forking everything at
+/// once makes every launch late. The scheduler starts queued requests by priority, then earliest
+/// deadline first, and lets only so many forks run at once. That limit follows the measured fork
+/// latency: it drops by one while forks take longer than the target and grows by one while they
+/// take less than half of it, and drops by one whenever a fork fails. Requests that would start
+/// after their deadline are shed instead, when they are submitted or when their turn comes, so the
+/// ones that do start are on time.
+
+namespace seccomp {
+
+    using LaunchClock = std::chrono::steady_clock;
+
+    struct LaunchLimits {
+        /// Forks running at once, at most.
+        unsigned max_forks = 4;
+
+        /// How long a fork may take before fewer run at once.
+        std::chrono::microseconds target_fork_latency { 2000 };
+
+        /// Requests waiting, at most. More are refused.
+        size_t max_queue = 1024;
+    };
+
+    enum class LaunchOutcome {
+        QUEUED,
+        STARTED,
+        QUEUE_FULL,
+        MISSED_DEADLINE,
+        CANCELLED,
+        FORK_FAILED,
+    };
+
+    struct LaunchRequest {
+        std::shared_ptr<std::vector<sock_filter> const> filter;
+        std::function<int()> fn;
+        LaunchClock::time_point deadline = LaunchClock::time_point::max();
+
+        /// Higher goes first.
+        int priority = 0;
+
+        /// Called on a launcher thread with the running child, or with nullptr if the request was
+        /// shed after it was queued or its fork failed. Waiting for the child here holds up other
+        /// launches.
+        std::function<void(std::unique_ptr<SeccompChild>, LaunchOutcome)> done;
+    };
+
+    struct LaunchMetrics {
+        /// Requests waiting now, and the most there were.
+        size_t depth = 0, max_depth = 0;
+
+        uint64_t submitted = 0;
+        uint64_t started = 0;
+        uint64_t queue_full = 0;
+
+        /// Shed when submitted, and when their turn came.
+        uint64_t shed_on_submit = 0, shed_in_queue = 0;
+
+        /// Requests whose fork failed, e.g. because there were too many processes.
+        uint64_t fork_failed = 0;
+
+        /// Forks allowed at once now, and how long one takes, as a moving average.
+        unsigned limit = 0;
+        double fork_us = 0;
+
+        /// Time from submission to the start of the fork, of requests that started. Bucket i
+        /// counts waits below 2^i microseconds.
+        uint64_t wait_buckets[24] = {};
+        double wait_us_total = 0, wait_us_max = 0;
+
+        /// Upper bound of the wait of fraction p of the started requests.
+        double wait_percentile_us(double p) const
+        {
+            uint64_t total = 0;
+            for (uint64_t b : wait_buckets) {
+                total += b;
+            }
+            uint64_t seen = 0;
+            for (unsigned i = 0; i < 24; i++) {
+                seen += wait_buckets[i];
+                if (seen > 0 && seen >= p * total) {
+                    return double(uint64_t(1) << i);
+                }
+            }
+            return wait_us_max;
+        }
+    };
+
+    class LaunchScheduler {
+        struct Queued {
+            LaunchRequest request;
+            LaunchClock::time_point submitted;
+            uint64_t sequence;
+        };
+
+        /// Whether a goes after b: lower priority, later deadline, later submission.
+        static bool after(Queued const &a, Queued const &b)
+        {
+            if (a.request.priority != b.request.priority) {
+                return a.request.priority < b.request.priority;
+            }
+            if (a.request.deadline != b.request.deadline) {
+                return a.request.deadline > b.request.deadline;
+            }
+            return a.sequence > b.sequence;
+        }
+
+        LaunchLimits const limits_;
+
+        std::mutex lock_;
+        std::condition_variable ready_;
+        std::vector<Queued> queue_;  // a heap by after()
+        uint64_t sequence_ = 0;
+        unsigned forking_ = 0;
+        bool stop_ = false;
+        LaunchMetrics metrics_;
+        std::vector<std::thread> launchers_;
+
+        LaunchClock::duration fork_latency() const
+        {
+            return std::chrono::duration_cast<LaunchClock::duration>(
+                std::chrono::duration<double, std::micro>(metrics_.fork_us));
+        }
+
+        void record_fork(double us)
+        {
+            // Eighths, as TCP smooths round-trip times.
+            metrics_.fork_us = metrics_.fork_us == 0 ? us : metrics_.fork_us + (us - metrics_.fork_us) / 8;
+
+            double const target = std::chrono::duration<double, std::micro>(limits_.target_fork_latency).count();
+            if (metrics_.fork_us > target && metrics_.limit > 1) {
+                metrics_.limit--;
+            } else if (metrics_.fork_us < target / 2 && metrics_.limit < limits_.max_forks) {
+                metrics_.limit++;
+                ready_.notify_one();
+            }
+        }
+
+        void record_wait(double us)
+        {
+            unsigned bucket = 0;
+            while (bucket < 23 && us >= double(uint64_t(1) << bucket)) {
+                bucket++;
+            }
+            metrics_.wait_buckets[bucket]++;
+            metrics_.wait_us_total += us;
+            metrics_.wait_us_max = std::max(metrics_.wait_us_max, us);
+        }
+
+        void launch()
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            for (;;) {
+                ready_.wait(l, [&] { return stop_ || (!queue_.empty() && forking_ < metrics_.limit); });
+                if (stop_) {
+                    return;
+                }
+
+                std::pop_heap(queue_.begin(), queue_.end(), after);
+                Queued q = std::move(queue_.back());
+                queue_.pop_back();
+                metrics_.depth = queue_.size();
+
+                LaunchClock::time_point const now = LaunchClock::now();
+                if (now + fork_latency() > q.request.deadline) {
+                    metrics_.shed_in_queue++;
+                    l.unlock();
+                    q.request.done(nullptr, LaunchOutcome::MISSED_DEADLINE);
+                    l.lock();
+                    continue;
+                }
+
+                forking_++;
+                record_wait(std::chrono::duration<double, std::micro>(now - q.submitted).count());
+                l.unlock();
+
+                std::unique_ptr<SeccompChild> child(new SeccompChild(*q.request.filter));
+                if (!child->try_run(q.request.fn)) {
+                    l.lock();
+                    forking_--;
+                    metrics_.fork_failed++;
+                    metrics_.limit = std::max(1u, metrics_.limit - 1);
+                    ready_.notify_one();
+                    l.unlock();
+
+                    q.request.done(nullptr, LaunchOutcome::FORK_FAILED);
+                    l.lock();
+                    continue;
+                }
+                double const us = std::chrono::duration<double, std::micro>(LaunchClock::now() - now).count();
+
+                l.lock();
+                forking_--;
+                metrics_.started++;
+                record_fork(us);
+                ready_.notify_one();
+                l.unlock();
+
+                q.request.done(std::move(child), LaunchOutcome::STARTED);
+                l.lock();
+            }
+        }
+
+    public:
+        explicit LaunchScheduler(LaunchLimits const &limits = LaunchLimits())
+            : limits_(limits)
+        {
+            metrics_.limit = std::max(1u, limits_.max_forks);
+            for (unsigned i = 0; i < metrics_.limit; i++) {
+                launchers_.emplace_back([this] { launch(); });
+            }
+        }
+
+        LaunchScheduler(LaunchScheduler const &) = delete;
+        LaunchScheduler &operator=(LaunchScheduler const &) = delete;
+
+        /// Requests still queued are cancelled; children already started are left to their callers.
+        ~LaunchScheduler()
+        {
+            std::vector<Queued> cancelled;
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                stop_ = true;
+                cancelled.swap(queue_);
+                metrics_.depth = 0;
+            }
+            ready_.notify_all();
+            for (std::thread &t : launchers_) {
+                t.join();
+            }
+            for (Queued &q : cancelled) {
+                q.request.done(nullptr, LaunchOutcome::CANCELLED);
+            }
+        }
+
+        /// Queue request, unless the queue is full or it could not start before its deadline, going
+        /// by how many are ahead of it and how long forks take. done is only called if it was
+        /// QUEUED.
+        LaunchOutcome submit(LaunchRequest request)
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            LaunchClock::time_point const now = LaunchClock::now();
+            metrics_.submitted++;
+
+            if (queue_.size() >= limits_.max_queue) {
+                metrics_.queue_full++;
+                return LaunchOutcome::QUEUE_FULL;
+            }
+
+            // Only those that go first count, but every one of them might.
+            size_t ahead = 0;
+            Queued q { std::move(request), now, sequence_++ };
+            for (Queued const &o : queue_) {
+                ahead += after(q, o);
+            }
+            if (now + fork_latency() * (ahead / metrics_.limit + 1) > q.request.deadline) {
+                metrics_.shed_on_submit++;
+                return LaunchOutcome::MISSED_DEADLINE;
+            }
+
+            queue_.push_back(std::move(q));
+            std::push_heap(queue_.begin(), queue_.end(), after);
+            metrics_.depth = queue_.size();
+            metrics_.max_depth = std::max(metrics_.max_depth, metrics_.depth);
+            ready_.notify_one();
+            return LaunchOutcome::QUEUED;
+        }
+
+        LaunchMetrics metrics()
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            return metrics_;
+        }
+    };
+
+}
+
+// EOF
@@ -0,0 +1,469 @@
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "demo_policy.hpp"
+#include "launch_scheduler.hpp"
+#include "policy_batch.hpp"
+#include "bpf_eval.hpp"
+#include "policy_compiler.hpp"
+#include "seccomp_child.hpp"
+#include "warm_pool.hpp"
+#include "zygote.hpp"
+
+/// How long it takes to launch a sandbox, from looking up its tenant's filter in a PolicyTable to
+/// the child having run under it, while nothing else happens and while a writer keeps publishing
+/// new tables as fast as it can.
+///
+/// Then a burst of launches asked for all at once: forked right away, each on a thread of its own,
+/// and through a LaunchScheduler with a deadline, which sheds what it cannot start in time. Last,
+/// launches arriving in bursts are served from WarmPools of fixed size and from one sized by
+/// forecasting them.
+///
+/// Finally, launches for tenants with filters of their own, forked directly and by zygotes, while
+/// the process holds some memory. Each tenant's job must pass its filter and fail the next one's,
+/// and the filters a zygote and its children stack must decide as the tenant's on random input.
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        size_t tenants = 100;
+        size_t launches = 2000;
+        unsigned launchers = 2;
+        size_t burst = 200;
+        double deadline_ms = 20;
+        double pool_seconds = 2;
+        uint32_t seed = 1;
+        size_t zygote_tenants = 16;
+        size_t parent_mb = 64;
+    };
+
+    /// Every tenant's filter in generation g. The demo policy, plus a rule that differs each time.
+    std::unique_ptr<seccomp::FilterTable const> generation(size_t tenants, uint64_t g)
+    {
+        seccomp::Policy p = seccomp::make_demo_policy();
+        p.add(SYS_getpid, SECCOMP_RET_ALLOW, { { 0, ~0ULL, g } });
+
+        seccomp::Layout layout;
+        layout.dispatch = seccomp::Dispatch::BALANCED_TREE;
+        auto const filter = std::make_shared<std::vector<sock_filter> const>(seccomp::compile(p, layout));
+
+        std::unique_ptr<seccomp::FilterTable> t(new seccomp::FilterTable());
+        for (size_t i = 0; i < tenants; i++) {
+            (*t)["tenant" + std::to_string(i)] = filter;
+        }
+        return t;
+    }
+
+    struct Latencies {
+        std::vector<double> lookup_ns;
+        std::vector<double> launch_us;
+        unsigned failed = 0;
+    };
+
+    void launch(seccomp::PolicyTable const &table, Options const &opts, unsigned seed, Latencies &out)
+    {
+        for (size_t i = 0; i < opts.launches / opts.launchers; i++) {
+            std::string const tenant = "tenant" + std::to_string((seed + i * 7) % opts.tenants);
+
+            Clock::time_point const start = Clock::now();
+            seccomp::Filter const filter = table.find(tenant);
+            Clock::time_point const found = Clock::now();
+
+            seccomp::SeccompChild child(*filter);
+            child.run([] { return 0; });
+            out.failed += child.wait_for_child() != 0;
+            Clock::time_point const done = Clock::now();
+
+            out.lookup_ns.push_back(std::chrono::duration<double, std::nano>(found - start).count());
+            out.launch_us.push_back(std::chrono::duration<double, std::micro>(done - start).count());
+        }
+    }
+
+    double percentile(std::vector<double> v, double p)
+    {
+        if (v.empty()) {
+            return 0;
+        }
+        std::sort(v.begin(), v.end());
+        return v[std::min(v.size() - 1, size_t(p * v.size()))];
+    }
+
+    double since(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    /// How long each launch of the burst took to start its child, forking all at once.
+    std::vector<double> burst_direct(seccomp::Filter const &filter, size_t n)
+    {
+        std::vector<double> started(n);
+        std::vector<std::thread> threads;
+        Clock::time_point const start = Clock::now();
+        for (size_t i = 0; i < n; i++) {
+            threads.emplace_back([&, i] {
+                seccomp::SeccompChild child(*filter);
+                child.run([] { return 0; });
+                started[i] = since(start);
+            });
+        }
+        for (std::thread &t : threads) {
+            t.join();
+        }
+        return started;
+    }
+
+    /// The same through a scheduler. Shed launches are left out.
+    std::vector<double> burst_scheduled(seccomp::Filter const &filter, Options const &opts,
+                                        seccomp::LaunchMetrics &metrics)
+    {
+        std::mutex lock;
+        std::vector<double> started;
+
+        // Waited for once the burst is over, so that launchers only fork.
+        std::vector<std::unique_ptr<seccomp::SeccompChild>> children;
+        {
+            seccomp::LaunchScheduler scheduler;
+            Clock::time_point const start = Clock::now();
+            auto const deadline = start + std::chrono::microseconds(int64_t(opts.deadline_ms * 1000));
+
+            for (size_t i = 0; i < opts.burst; i++) {
+                seccomp::LaunchRequest r;
+                r.filter = filter;
+                r.fn = [] { return 0; };
+                r.deadline = deadline;
+                r.done = [&] (std::unique_ptr<seccomp::SeccompChild> child, seccomp::LaunchOutcome) {
+                    if (child) {
+                        double const us = since(start);
+                        std::lock_guard<std::mutex> l(lock);
+                        started.push_back(us);
+                        children.push_back(std::move(child));
+                    }
+                };
+                scheduler.submit(std::move(r));
+            }
+
+            while (scheduler.metrics().depth != 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            metrics = scheduler.metrics();
+        }
+        return started;
+    }
+
+    /// When launches are asked for, in microseconds from the start. For the first half, 100 a second
+    /// at random, and bursts of 1500 a second for 100 ms starting about every 400 ms. Then 20 a second.
+    std::vector<double> bursty_arrivals(double seconds, uint32_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::exponential_distribution<double> burst_gap(1 / 400e3);
+        std::vector<double> arrivals;
+        double t = 0;
+        double burst = burst_gap(rng);
+        while (t < seconds * 1e6) {
+            if (t > burst + 100e3) {
+                burst = t + burst_gap(rng);
+            }
+            double const rate = t > seconds * 0.5e6 ? 20 : t >= burst ? 1500 : 100;
+            t += std::exponential_distribution<double>(rate * 1e-6)(rng);
+            arrivals.push_back(t);
+        }
+        return arrivals;
+    }
+
+    /// A filter per tenant, allowing getpid only with the tenant's number as its argument.
+    std::vector<std::vector<sock_filter>> tenant_filters(size_t tenants)
+    {
+        std::vector<std::vector<sock_filter>> filters;
+        for (size_t k = 0; k < tenants; k++) {
+            seccomp::Policy p = seccomp::make_demo_policy();
+            p.add(SYS_getpid, SECCOMP_RET_ALLOW, { { 0, ~0ULL, k } });
+            filters.push_back(seccomp::compile(p, seccomp::Layout()));
+        }
+        return filters;
+    }
+
+    int call_getpid(std::string const &job)
+    {
+        syscall(SYS_getpid, strtoull(job.c_str(), nullptr, 0));
+        return 0;
+    }
+
+    /// Inputs on which the stacked zygote filters decide differently from filter. Arguments are
+    /// mostly the descriptors and options the zygote's own rules look for.
+    size_t zygote_mismatches(std::vector<sock_filter> const &filter, uint64_t tenant, std::mt19937_64 &rng)
+    {
+        int const ctrl = 3, sig = 4;
+        seccomp::ZygoteFilters const z = seccomp::zygote_filters(filter, ctrl, sig);
+        std::vector<std::vector<sock_filter>> const stack { z.zygote, z.child };
+        uint32_t const nrs[] = { SYS_read, SYS_write, SYS_close, SYS_poll, SYS_ppoll, SYS_wait4, SYS_clone,
+                                 SYS_set_robust_list, SYS_rt_sigprocmask, SYS_prctl, SYS_exit_group,
+                                 SYS_getpid, SYS_fstat, SYS_mmap, SYS_openat };
+        uint64_t const args[] = { uint64_t(ctrl), uint64_t(sig), PR_SET_SECCOMP, STDOUT_FILENO, 0, tenant,
+                                  tenant + 1, uint64_t(ctrl) | 1ULL << 32 };
+
+        size_t mismatches = 0;
+        for (unsigned i = 0; i < 4000; i++) {
+            seccomp_data d = {};
+            d.nr = nrs[rng() % (sizeof(nrs) / sizeof(nrs[0]))];
+            d.arch = rng() % 8 != 0 ? AUDIT_ARCH_X86_64 : AUDIT_ARCH_I386;
+            for (auto &a : d.args) {
+                a = rng() % 4 != 0 ? args[rng() % (sizeof(args) / sizeof(args[0]))] : rng();
+            }
+            mismatches += seccomp::evaluate_stacked(stack, d) != seccomp::evaluate(filter, d).action;
+        }
+        return mismatches;
+    }
+
+    struct PoolRun {
+        std::vector<double> acquire_us;
+        size_t hits = 0;
+        double idle = 0;
+        seccomp::WarmPoolStats stats;
+    };
+
+    /// Replay arrivals against a pool. Idle workers are sampled every millisecond.
+    PoolRun replay(seccomp::Filter const &filter, seccomp::WarmPoolLimits const &limits,
+                   std::vector<double> const &arrivals)
+    {
+        PoolRun run;
+        std::vector<std::unique_ptr<seccomp::SeccompChild>> children;
+        {
+            seccomp::WarmPool pool(*filter, [] (std::string const &) { return 0; }, limits);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+            std::atomic<bool> done { false };
+            size_t samples = 0;
+            std::thread sampler([&] {
+                for (; !done; samples++) {
+                    run.idle += pool.stats().idle;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+
+            Clock::time_point const start = Clock::now();
+            for (double at : arrivals) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(int64_t(at)));
+
+                Clock::time_point const asked = Clock::now();
+                bool hit;
+                children.push_back(pool.acquire("job", &hit));
+                run.acquire_us.push_back(since(asked));
+                run.hits += hit;
+            }
+            run.stats = pool.stats();
+            done = true;
+            sampler.join();
+            run.idle /= std::max<size_t>(1, samples);
+        }
+        for (auto &c : children) {
+            c->wait_for_child();
+        }
+        return run;
+    }
+
+    void report(char const *what, std::vector<Latencies> const &per_thread, double seconds, uint64_t swaps)
+    {
+        Latencies all;
+        for (Latencies const &l : per_thread) {
+            all.lookup_ns.insert(all.lookup_ns.end(), l.lookup_ns.begin(), l.lookup_ns.end());
+            all.launch_us.insert(all.launch_us.end(), l.launch_us.begin(), l.launch_us.end());
+            all.failed += l.failed;
+        }
+
+        printf("%-6s %8zu %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %7u\n", what, all.launch_us.size(),
+               percentile(all.lookup_ns, 0.5), percentile(all.lookup_ns, 0.99), percentile(all.lookup_ns, 1.0),
+               percentile(all.launch_us, 0.5), percentile(all.launch_us, 0.99), percentile(all.launch_us, 1.0),
+               swaps / seconds, all.failed);
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    Options opts;
+
+    for (int i = 1; i < argc; i++) {
+        std::string const opt = argv[i];
+
+        if (opt == "--tenants" && i + 1 < argc) {
+            opts.tenants = std::max<size_t>(1, strtoull(argv[++i], nullptr, 0));
+        } else if (opt == "--launches" && i + 1 < argc) {
+            opts.launches = strtoull(argv[++i], nullptr, 0);
+        } else if (opt == "--launchers" && i + 1 < argc) {
+            opts.launchers = std::max(1ul, strtoul(argv[++i], nullptr, 0));
+        } else if (opt == "--burst" && i + 1 < argc) {
+            opts.burst = strtoull(argv[++i], nullptr, 0);
+        } else if (opt == "--deadline-ms" && i + 1 < argc) {
+            opts.deadline_ms = atof(argv[++i]);
+        } else if (opt == "--pool-seconds" && i + 1 < argc) {
+            opts.pool_seconds = atof(argv[++i]);
+        } else if (opt == "--seed" && i + 1 < argc) {
+            opts.seed = strtoul(argv[++i], nullptr, 0);
+        } else if (opt == "--zygote-tenants" && i + 1 < argc) {
+            opts.zygote_tenants = strtoull(argv[++i], nullptr, 0);
+        } else if (opt == "--parent-mb" && i + 1 < argc) {
+            opts.parent_mb = strtoull(argv[++i], nullptr, 0);
+        } else {
+            fprintf(stderr, "usage: %s [--tenants N] [--launches N] [--launchers N] [--burst N] [--deadline-ms MS] "
+                    "[--pool-seconds S] [--seed N] [--zygote-tenants N] [--parent-mb MB]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Made first, so that zygotes are forked from a process that is still small.
+    std::unique_ptr<seccomp::ZygoteManager> zygotes;
+    if (opts.zygote_tenants != 0) {
+        zygotes.reset(new seccomp::ZygoteManager(call_getpid));
+    }
+
+    seccomp::PolicyTable table;
+    table.publish(generation(opts.tenants, 0));
+
+    printf("%-6s %8s %10s %10s %10s %10s %10s %10s %10s %7s\n", "", "launches", "lookup ns", "p99", "max",
+           "launch us", "p99", "max", "swaps/s", "failed");
+
+    unsigned failed = 0;
+    for (bool storm : { false, true }) {
+        std::atomic<bool> stop { false };
+        std::atomic<uint64_t> swaps { 0 };
+        std::thread writer;
+        if (storm) {
+            writer = std::thread([&] {
+                for (uint64_t g = 1; !stop; g++) {
+                    table.publish(generation(opts.tenants, g));
+                    swaps++;
+                }
+            });
+        }
+
+        std::vector<Latencies> latencies(opts.launchers);
+        std::vector<std::thread> launchers;
+        Clock::time_point const start = Clock::now();
+        for (unsigned l = 0; l < opts.launchers; l++) {
+            launchers.emplace_back([&, l] { launch(table, opts, l, latencies[l]); });
+        }
+        for (std::thread &t : launchers) {
+            t.join();
+        }
+        double const seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        stop = true;
+        if (writer.joinable()) {
+            writer.join();
+        }
+
+        report(storm ? "storm" : "quiet", latencies, seconds, swaps);
+        for (Latencies const &l : latencies) {
+            failed += l.failed;
+        }
+    }
+
+    if (opts.burst != 0) {
+        seccomp::Filter const filter = table.find("tenant0");
+        std::vector<double> const direct = burst_direct(filter, opts.burst);
+        seccomp::LaunchMetrics m;
+        std::vector<double> const scheduled = burst_scheduled(filter, opts, m);
+
+        double const deadline_us = opts.deadline_ms * 1000;
+        auto const late = [deadline_us] (std::vector<double> const &v) {
+            return size_t(std::count_if(v.begin(), v.end(), [deadline_us] (double us) { return us > deadline_us; }));
+        };
+
+        printf("\n%-10s %8s %8s %8s %10s %10s %10s\n", "burst", "started", "late", "shed", "start us", "p99", "max");
+        printf("%-10s %8zu %8zu %8u %10.0f %10.0f %10.0f\n", "direct", direct.size(), late(direct), 0u,
+               percentile(direct, 0.5), percentile(direct, 0.99), percentile(direct, 1.0));
+        printf("%-10s %8zu %8zu %8" PRIu64 " %10.0f %10.0f %10.0f\n", "scheduled", scheduled.size(), late(scheduled),
+               m.shed_on_submit + m.shed_in_queue, percentile(scheduled, 0.5), percentile(scheduled, 0.99),
+               percentile(scheduled, 1.0));
+        printf("scheduler: deepest queue %zu, waited %.0f us on average and at most %.0f, forks took %.0f us, "
+               "%u at once, %" PRIu64 " failed\n", m.max_depth, m.started ? m.wait_us_total / m.started : 0.0,
+               m.wait_us_max, m.fork_us, m.limit, m.fork_failed);
+    }
+
+    if (opts.pool_seconds > 0) {
+        seccomp::Filter const filter = table.find("tenant0");
+        std::vector<double> const arrivals = bursty_arrivals(opts.pool_seconds, opts.seed);
+
+        seccomp::WarmPoolLimits few;
+        few.predictive = false;
+        few.min_idle = 4;
+        seccomp::WarmPoolLimits some = few;
+        some.min_idle = 16;
+        seccomp::WarmPoolLimits many = few;
+        many.min_idle = 32;
+        seccomp::WarmPoolLimits const forecast;
+
+        printf("\n%-10s %8s %8s %10s %10s %10s %8s %8s %8s\n", "pool", "launches", "hits %", "acquire us", "p99",
+               "max", "idle", "spawned", "retired");
+        for (auto const &p : { std::make_pair("fixed 4", few), std::make_pair("fixed 16", some),
+                               std::make_pair("fixed 32", many), std::make_pair("forecast", forecast) }) {
+            PoolRun const r = replay(filter, p.second, arrivals);
+            printf("%-10s %8zu %8.1f %10.0f %10.0f %10.0f %8.1f %8" PRIu64 " %8" PRIu64 "\n", p.first,
+                   arrivals.size(), 100.0 * r.hits / arrivals.size(), percentile(r.acquire_us, 0.5),
+                   percentile(r.acquire_us, 0.99), percentile(r.acquire_us, 1.0), r.idle, r.stats.spawned,
+                   r.stats.retired);
+        }
+    }
+
+    if (zygotes) {
+        std::vector<char> const held(opts.parent_mb << 20, 1);
+        std::vector<std::vector<sock_filter>> const filters = tenant_filters(opts.zygote_tenants);
+        std::vector<double> direct_us, zygote_us;
+        unsigned wrong = 0;
+
+        for (size_t i = 0; i < opts.launches; i++) {
+            size_t const k = i % filters.size();
+            std::string const job = std::to_string(k);
+
+            Clock::time_point start = Clock::now();
+            seccomp::SeccompChild child(filters[k]);
+            child.run([&job] { return call_getpid(job); });
+            wrong += child.wait_for_child() != 0;
+            direct_us.push_back(since(start));
+
+            start = Clock::now();
+            std::unique_ptr<seccomp::ZygoteChild> z = zygotes->launch(filters[k], job);
+            wrong += z == nullptr || z->wait_for_child() != 0;
+            zygote_us.push_back(since(start));
+        }
+
+        // The next tenant's number is not allowed.
+        std::mt19937_64 rng(opts.seed);
+        size_t mismatches = 0;
+        for (size_t k = 0; k < filters.size(); k++) {
+            std::unique_ptr<seccomp::ZygoteChild> z = zygotes->launch(filters[k], std::to_string(k + 1));
+            wrong += z == nullptr || z->wait_for_child() != -1;
+            mismatches += zygote_mismatches(filters[k], k, rng);
+        }
+
+        seccomp::ZygoteStats const s = zygotes->stats();
+        printf("\n%-10s %8s %10s %10s %10s\n", "tenants", "launches", "launch us", "p99", "max");
+        printf("%-10s %8zu %10.0f %10.0f %10.0f\n", "direct", direct_us.size(), percentile(direct_us, 0.5),
+               percentile(direct_us, 0.99), percentile(direct_us, 1.0));
+        printf("%-10s %8zu %10.0f %10.0f %10.0f\n", "zygote", zygote_us.size(), percentile(zygote_us, 0.5),
+               percentile(zygote_us, 0.99), percentile(zygote_us, 1.0));
+        printf("zygotes: %zu running in %zu KiB, %" PRIu64 " started, %" PRIu64 " stopped, parent holds %zu MiB; "
+               "%u wrong exits, %zu stacked filter mismatches\n", s.zygotes, s.bytes >> 10, s.misses, s.stopped,
+               held.size() >> 20, wrong, mismatches);
+        failed += wrong + unsigned(mismatches);
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// EOF
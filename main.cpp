@@ -1,236 +1,211 @@
-#include <sys/prctl.h>
-#include <sys/wait.h>
-#include <linux/audit.h>
-#include <linux/seccomp.h>
-#include <linux/filter.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
 #include <cstddef>
 #include <cstdio>
-#include <cstdint>
 #include <cstdlib>
-#include <cassert>
-#include <functional>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
-#include <initializer_list>
-#include <utility>
 
+#include "autotune.hpp"
+#include "bpf_coverage.hpp"
+#include "bpf_disasm.hpp"
+#include "bpf_lint.hpp"
+#include "bpf_sim.hpp"
+#include "bpf_superopt.hpp"
+#include "demo_policy.hpp"
+#include "policy_minimize.hpp"
+#include "policy_text.hpp"
+#include "seccomp_child.hpp"
+
+int main(int argc, char **argv)
+{
+    using seccomp::die_errno;
 
-#define BPF_SYS_WHITELIST(nr)                                       \
-    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nr, 0, 1),                  \
-    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
-
-namespace {
-
-    [[noreturn]] void die_errno(const char *msg)
-    {
-        perror(msg);
-        exit(EXIT_FAILURE);
-    }
-
-    class ForkedChild {
-
-        pid_t child_ = 0;
-
-        enum {
-            NOT_STARTED,
-            STARTED,
-            FINISHED,
-        } state = NOT_STARTED;
+    std::unique_ptr<seccomp::SeccompChild> const sandbox = seccomp::make_demo_sandbox();
+    seccomp::SeccompChild &s = *sandbox;
 
-        int child_main(std::function<int()> const &fn)
-        {
-            prepare_child();
-            return fn();
-        }
+    bool rewritten = false;
+    unsigned jobs = 0;
 
-    protected:
+    for (int i = 1; i < argc; i++) {
+        std::string const opt = argv[i];
 
-        virtual void prepare_child()
-        {
-            // Default does nothing.
-        }
-
-    public:
+        if (opt == "--superopt" || opt == "--superopt-cache") {
+            // Every system call runs through the start of the filter, so that is worth searching.
+            char const *cache_file = opt == "--superopt-cache" && i + 1 < argc ? argv[++i] : nullptr;
+            seccomp::SuperoptCache cache;
+            if (cache_file != nullptr) {
+                cache.load(cache_file);
+            }
 
-        void run(std::function<int()> const &fn)
-        {
-            state = STARTED;
-            child_ = fork();
+            size_t const before = s.filter().size();
+            s.filter() = seccomp::superoptimize_prefix(s.filter(), 24, seccomp::SuperoptOptions(), &cache);
+            fprintf(stderr, "superopt: %zu -> %zu instructions\n", before, s.filter().size());
 
-            if (child_ < 0) {
-                die_errno("fork");
+            if (cache_file != nullptr && !cache.save(cache_file)) {
+                die_errno(cache_file);
             }
-
-            if (child_ == 0) {
-                _exit(child_main(fn));
+            rewritten = true;
+        } else if (opt == "--autotune" && i + 1 < argc) {
+            // Lay the demo policy out for the workload in the trace instead of as it is written.
+            seccomp::TraceReader const trace(argv[++i]);
+            seccomp::WorkStealingPool pool(jobs);
+            seccomp::AutotuneResult const result = seccomp::autotune(seccomp::make_demo_policy(), trace, pool);
+            seccomp::print_autotune(stderr, result);
+
+            s.filter() = result.winner().filter;
+            rewritten = true;
+        } else if (opt == "--minimize" && i + 1 < argc) {
+            // Only what the workload in the trace needs of the demo policy, laid out for it.
+            seccomp::TraceReader const trace(argv[++i]);
+            seccomp::Policy const broad = seccomp::make_demo_policy();
+            seccomp::Policy const narrow = seccomp::minimize(broad, trace);
+            seccomp::write_policy(stderr, narrow);
+            fprintf(stderr, "minimize: %zu -> %zu rules\n", broad.rules.size(), narrow.rules.size());
+
+            seccomp::WorkStealingPool pool(jobs);
+            seccomp::AutotuneResult const result = seccomp::autotune(narrow, trace, pool);
+            seccomp::print_autotune(stderr, result);
+
+            s.filter() = result.winner().filter;
+            rewritten = true;
+        } else if (opt == "--profiles") {
+            // The profiles of the demo policy as one filter each, against merged into one.
+            std::vector<seccomp::PolicyProfile> const profiles = seccomp::make_demo_profiles();
+            seccomp::Policy const merged = seccomp::make_demo_policy();
+            seccomp::Layout layout;
+            layout.dispatch = seccomp::Dispatch::BALANCED_TREE;
+            layout.ranges = layout.share = true;
+
+            seccomp::CompositionCost const cost = seccomp::composition_cost(profiles, merged, layout);
+            if (cost.mismatches != 0) {
+                fprintf(stderr, "stacked filters decide %zu calls differently from the merged policy\n",
+                        cost.mismatches);
+                return EXIT_FAILURE;
             }
-        }
-
-        /// Wait for the child to finish. Can only be called when the child was actually started with
-        /// run(). Will be automatically called by the destructor, if it hasn't been called before.
-        int wait_for_child()
-        {
-            assert(state == STARTED);
-            state = FINISHED;
-
-            int status = 0;
-            waitpid(child_, &status, 0);
-            return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
-        }
-
-        ForkedChild() = default;
-
-        ForkedChild(ForkedChild const &) = delete;
-        ForkedChild &operator=(ForkedChild const &) = delete;
-
-        virtual ~ForkedChild()
-        {
-            switch (state) {
-            case STARTED:
-                wait_for_child();
-                break;
-            default:
-                // Nothing to do.
-                break;
+            seccomp::write_policy(stdout, merged);
+            printf("%zu profiles stacked: %zu instructions, %.1f run per system call\n", profiles.size(),
+                   cost.stacked_size, cost.stacked);
+            printf("merged: %zu instructions, %.1f run per system call\n", cost.merged_size, cost.merged);
+            return EXIT_SUCCESS;
+        } else if (opt == "--lint") {
+            seccomp::LintOptions opts;
+            opts.hot_syscalls = { SYS_write, SYS_mmap };
+
+            seccomp::LintReport const report =
+                seccomp::lint(s.filter(), rewritten ? std::vector<size_t>() : s.rule_bounds(), opts);
+            seccomp::print_lint_report(stdout, report);
+            return report.errors() ? EXIT_FAILURE : EXIT_SUCCESS;
+        } else if (opt == "--disasm") {
+            seccomp::disassemble(stdout, s.filter());
+            return EXIT_SUCCESS;
+        } else if (opt == "--dot") {
+            seccomp::Profile profile;
+            if (i + 1 < argc && !seccomp::read_profile(argv[++i], profile)) {
+                die_errno(argv[i]);
             }
-        }
-    };
-
-
-    class SeccompChild final : public ForkedChild {
-
-        std::vector<sock_filter> seccomp_filter {
-            // Check architecture.
-            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, arch))),
-            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   AUDIT_ARCH_X86_64, 1, 0),
-            BPF_STMT(BPF_RET | BPF_K,             SECCOMP_RET_KILL),
-        };
-
-        void extend_all() {}
-
-        template <typename FIRST, typename... REST>
-        void extend_all(FIRST first, REST... rest)
-        {
-            first.push_into(seccomp_filter);
-            extend_all(rest...);
-        }
-
-
-    protected:
-
-        void prepare_child() override
-        {
-
-            unsigned short len = seccomp_filter.size();
-            assert(len == seccomp_filter.size());
-
-            const sock_fprog prog = {
-                .len = len,
-                .filter = seccomp_filter.data(),
+            seccomp::write_dot(stdout, s.filter(), profile);
+            return EXIT_SUCCESS;
+        } else if (opt == "--jobs" && i + 1 < argc) {
+            jobs = strtoul(argv[++i], nullptr, 0);
+        } else if (opt == "--simulate" && i + 1 < argc) {
+            seccomp::TraceReader const trace(argv[++i]);
+            seccomp::FilterSimulator const sim(s.filter(), rewritten ? std::vector<size_t>() : s.rule_bounds());
+            seccomp::WorkStealingPool pool(jobs);
+            seccomp::SimReport const report = sim.replay(trace, pool);
+            seccomp::print_sim_report(stdout, report);
+
+            // The profile can be fed to --dot.
+            if (i + 1 < argc && !seccomp::write_profile(argv[++i], report.profile)) {
+                die_errno(argv[i]);
+            }
+            return EXIT_SUCCESS;
+        } else if (opt == "--coverage" && i + 1 < argc) {
+            std::vector<size_t> const bounds = rewritten ? std::vector<size_t>() : s.rule_bounds();
+            seccomp::TraceReader const trace(argv[++i]);
+            seccomp::FilterSimulator const sim(s.filter(), bounds);
+            seccomp::WorkStealingPool pool(jobs);
+            seccomp::print_coverage(stdout, s.filter(), seccomp::coverage(s.filter(), bounds, sim.replay(trace, pool)));
+            return EXIT_SUCCESS;
+        } else if (opt == "--bench-eval" && i + 1 < argc) {
+            // Raw evaluator throughput over a trace, checked against the scalar interpreter.
+            std::vector<seccomp_data> data;
+            seccomp::TraceReader(argv[++i]).for_each([&] (seccomp::TraceRecord const &r) {
+                data.push_back(r.data());
+            });
+
+            std::vector<seccomp::BatchResult> expected, results;
+            seccomp::SimdLevel const levels[] = {
+                seccomp::SimdLevel::SCALAR, seccomp::SimdLevel::AVX2, seccomp::SimdLevel::AVX512,
             };
 
-            // We need to do this, otherwise PR_SET_SECCOMP will fail with EACCES.
-            if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
-                die_errno("PR_SET_NO_NEW_PRIVS");
+            for (seccomp::SimdLevel level : levels) {
+                if (level > seccomp::simd_level()) {
+                    continue;
+                }
+
+                struct timespec begin, end;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                seccomp::evaluate_batch(s.filter(), data, results, nullptr, level);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                double const secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+                bool const same = level == seccomp::SimdLevel::SCALAR || memcmp(
+                    results.data(), expected.data(), results.size() * sizeof(results[0])) == 0;
+                printf("%-8s %8.1f M records/s%s\n", seccomp::simd_level_name(level), data.size() / secs / 1e6,
+                       same ? "" : "  MISMATCH");
+                if (!same) {
+                    return EXIT_FAILURE;
+                }
+                if (level == seccomp::SimdLevel::SCALAR) {
+                    expected = results;
+                }
             }
-
-            if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0) != 0) {
-                die_errno("PR_SET_SECCOMP");
+            return EXIT_SUCCESS;
+        } else if (opt == "--bench-replay" && i + 1 < argc) {
+            // How replay scales with threads, doubling up to --jobs.
+            seccomp::TraceReader const trace(argv[++i]);
+            seccomp::FilterSimulator const sim(s.filter(), s.rule_bounds());
+            unsigned const most = jobs ? jobs : std::thread::hardware_concurrency();
+            double base = 0;
+            seccomp::SimReport first;
+
+            for (unsigned threads = 1; threads <= most; threads = threads < most ? std::min(most, threads * 2) : most + 1) {
+                seccomp::WorkStealingPool pool(threads);
+
+                struct timespec begin, end;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                seccomp::SimReport const report = sim.replay(trace, pool);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                double const rate = trace.records() /
+                    ((end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9);
+                if (threads == 1) {
+                    base = rate;
+                    first = report;
+                }
+
+                bool const same = report.executed == first.executed && report.profile == first.profile &&
+                    report.rule_hits == first.rule_hits && report.path_lengths == first.path_lengths;
+                printf("%3u threads %8.1f M records/s %5.2fx%s\n", threads, rate / 1e6, rate / base,
+                       same ? "" : "  MISMATCH");
+                if (!same) {
+                    return EXIT_FAILURE;
+                }
             }
-
+            return EXIT_SUCCESS;
+        } else {
+            fprintf(stderr, "usage: %s [--superopt | --superopt-cache FILE] [--jobs N] [--autotune TRACE | --minimize TRACE] "
+                    "[--profiles | --lint | --disasm | --dot [PROFILE] | --simulate TRACE [PROFILE] | --coverage TRACE | --bench-eval TRACE | "
+                    "--bench-replay TRACE]\n", argv[0]);
+            return EXIT_FAILURE;
         }
-
-    public:
-
-        template <typename... TYPES>
-        explicit SeccompChild(const TYPES &... entries)
-        {
-            // Load syscall number.
-            seccomp_filter.push_back(BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (offsetof(struct seccomp_data, nr))));
-
-            extend_all(entries...);
-
-
-            // for (unsigned sysnr : sys_whitelist) {
-            //     extend_filter(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr, 0, 1));
-            //     extend_filter(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
-            // }
-
-            // for (auto t : sys_errno) {
-            //     extend_filter(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, t.first, 0, 1));
-            //     extend_filter(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (t.second & SECCOMP_RET_DATA)));
-            // }
-
-            // Finalize filter.
-            seccomp_filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL));
-        }
-    };
-
-    class SeccompWhitelist {
-        unsigned sysnr_;
-
-    public:
-        explicit SeccompWhitelist(unsigned sysnr)
-            : sysnr_(sysnr)
-        {}
-
-        template <typename VECTOR>
-        void push_into(VECTOR &v) const
-        {
-            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))));
-            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr_, 0, 1));
-            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
-        }
-    };
-
-    class SeccompWhitelistWithArg {
-        unsigned sysnr_;
-        uint64_t arg0_;
-
-    public:
-        explicit SeccompWhitelistWithArg(unsigned sysnr, uint64_t arg0)
-            : sysnr_(sysnr), arg0_(arg0)
-        {}
-
-        template <typename VECTOR>
-        void push_into(VECTOR &v) const
-        {
-            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))));
-            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr_, 0, 6));
-
-            // First half of arg
-            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, args))));
-            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(arg0_), 0, 3));
-
-            // Second half of arg
-            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, sizeof(uint32_t) + (offsetof(struct seccomp_data, args))));
-            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(arg0_ >> 32), 0, 1));
-
-            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
-            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL));
-        }
-    };
-
-}
-
-int main()
-{
-
-    SeccompChild s {
-        SeccompWhitelist(SYS_exit_group),
-        SeccompWhitelist(SYS_exit),
-
-        // Only allow write to stdout.
-        SeccompWhitelistWithArg(SYS_write, STDOUT_FILENO),
-
-        // Seems to be used for isatty().
-        SeccompWhitelistWithArg(SYS_fstat, STDOUT_FILENO),
-
-        // To allocate memory.
-        SeccompWhitelistWithArg(SYS_mmap, 0),
-    };
+    }
 
     // Fork a child and sandbox it.
     s.run([] { printf("Hello from sandbox!\n"); return 0; });
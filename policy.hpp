@@ -0,0 +1,119 @@
+#pragma once
+
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// A policy as data rather than as code: which system calls get which action, under which
+/// conditions on their arguments. The DSL and SeccompChild entries are compiled as they are
+/// written; a Policy can be compiled in whatever layout runs fastest (see policy_compiler.hpp).
+
+namespace seccomp {
+
+    /// (args[index] & mask) == value
+    struct ArgCheck {
+        unsigned index;
+        uint64_t mask;
+        uint64_t value;
+
+        bool holds(seccomp_data const &d) const
+        {
+            return (d.args[index] & mask) == value;
+        }
+
+        bool operator==(ArgCheck const &o) const
+        {
+            return index == o.index && mask == o.mask && value == o.value;
+        }
+    };
+
+    struct PolicyRule {
+        uint32_t nr;
+
+        /// All of these have to hold for the rule to apply.
+        std::vector<ArgCheck> checks;
+
+        uint32_t action;
+    };
+
+    /// Rules are tried in order. The first one for the system call whose checks all hold decides,
+    /// and calls no rule decides get default_action. Calls from another architecture are killed.
+    struct Policy {
+        uint32_t arch = AUDIT_ARCH_X86_64;
+        uint32_t default_action = SECCOMP_RET_KILL;
+        std::vector<PolicyRule> rules;
+
+        Policy &add(uint32_t nr, uint32_t action, std::vector<ArgCheck> checks = {})
+        {
+            rules.push_back({ nr, std::move(checks), action });
+            return *this;
+        }
+
+        /// What the policy means, for checking compiled filters against.
+        uint32_t decide(seccomp_data const &d) const
+        {
+            if (d.arch != arch) {
+                return SECCOMP_RET_KILL;
+            }
+
+            for (PolicyRule const &r : rules) {
+                if (r.nr != uint32_t(d.nr)) {
+                    continue;
+                }
+
+                bool all = true;
+                for (ArgCheck const &c : r.checks) {
+                    all = all && c.holds(d);
+                }
+                if (all) {
+                    return r.action;
+                }
+            }
+
+            return default_action;
+        }
+
+        /// Calls to check compiled filters on: every number up to one past the highest a rule is
+        /// for, without arguments, and for each rule a call it applies to and, for each of its
+        /// checks, one that fails just that check.
+        std::vector<seccomp_data> probes() const
+        {
+            uint32_t highest = 0;
+            for (PolicyRule const &r : rules) {
+                highest = std::max(highest, r.nr);
+            }
+
+            std::vector<seccomp_data> out;
+            seccomp_data d {};
+            d.arch = arch;
+            for (uint32_t nr = 0; nr <= highest + 1; nr++) {
+                d.nr = int(nr);
+                out.push_back(d);
+            }
+            for (PolicyRule const &r : rules) {
+                seccomp_data all = d;
+                all.nr = int(r.nr);
+                for (ArgCheck const &c : r.checks) {
+                    all.args[c.index] = (all.args[c.index] & ~c.mask) | c.value;
+                }
+                out.push_back(all);
+                for (ArgCheck const &c : r.checks) {
+                    if (c.mask != 0) {
+                        seccomp_data one = all;
+                        one.args[c.index] ^= c.mask & -c.mask;
+                        out.push_back(one);
+                    }
+                }
+            }
+            return out;
+        }
+    };
+
+}
+
+// EOF
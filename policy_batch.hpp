@@ -0,0 +1,232 @@
+#pragma once
+
+#include <linux/filter.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "filter_store.hpp"
+#include "policy.hpp"
+#include "policy_compiler.hpp"
+#include "rcu.hpp"
+#include "thread_pool.hpp"
+
+/// Compiles many policies at once, e.g. every tenant's when a supervisor starts.
+///
+/// Policies that mean the same are compiled once: each is reduced to a canonical form, and those
+/// with equal forms share a filter. The compiles run on a thread pool, and the finished filters
+/// become visible all at once through a PolicyTable. With a FilterStore, filters some process
+/// on the host compiled before are not compiled again.
+
+namespace seccomp {
+
+    using Filter = std::shared_ptr<std::vector<sock_filter> const>;
+
+    /// Filters by policy name. Never modified once published.
+    using FilterTable = std::unordered_map<std::string, Filter>;
+
+    /// The current FilterTable. Looking a filter up takes no locks, and publishing a new table
+    /// neither blocks lookups nor invalidates filters found in the old one.
+    class PolicyTable {
+        RcuPointer<FilterTable> current_ { std::unique_ptr<FilterTable const>(new FilterTable()) };
+
+    public:
+        /// The whole table, as long as the reader lives.
+        RcuPointer<FilterTable>::Reader read() const
+        {
+            return current_.read();
+        }
+
+        /// The filter for name, or null if there is none.
+        Filter find(std::string const &name) const
+        {
+            auto const t = current_.read();
+            auto const it = t->find(name);
+            return it == t->end() ? nullptr : it->second;
+        }
+
+        /// Replaces the table for this process. Helpers forked earlier keep the filters they had:
+        /// hand a WarmPool the new one with WarmPool::set_filter(), and ask a ZygoteManager for
+        /// filters found after the publish, since it starts a zygote for each filter it is given.
+        void publish(std::unique_ptr<FilterTable const> table)
+        {
+            current_.publish(std::move(table));
+        }
+    };
+
+    namespace batch_detail {
+
+        /// What p means, as a list of words: rules grouped by system call number, without those
+        /// that can never apply or never be reached, checks sorted and without duplicates. Policies
+        /// with the same canonical form decide every call the same.
+        inline std::vector<uint64_t> canonical(Policy const &p)
+        {
+            std::vector<PolicyRule const *> rules;
+            for (PolicyRule const &r : p.rules) {
+                rules.push_back(&r);
+            }
+            std::stable_sort(rules.begin(), rules.end(), [] (PolicyRule const *a, PolicyRule const *b) {
+                return a->nr < b->nr;
+            });
+
+            std::vector<uint64_t> words { p.arch, p.default_action };
+            std::vector<ArgCheck> checks;
+            size_t kept = words.size();  // end of the rules that are not trailing default actions
+            bool closed = false;
+
+            for (size_t i = 0; i < rules.size(); i++) {
+                PolicyRule const &r = *rules[i];
+                if (i > 0 && rules[i - 1]->nr != r.nr) {
+                    words.resize(kept);
+                    closed = false;
+                }
+                if (closed) {
+                    continue;  // unreachable
+                }
+
+                checks.clear();
+                bool satisfiable = true;
+                for (ArgCheck const &k : r.checks) {
+                    satisfiable = satisfiable && (k.value & ~k.mask) == 0;
+                    if (k.mask != 0) {
+                        checks.push_back(k);
+                    }
+                }
+                if (!satisfiable) {
+                    continue;
+                }
+
+                std::sort(checks.begin(), checks.end(), [] (ArgCheck const &a, ArgCheck const &b) {
+                    return std::make_tuple(a.index, a.mask, a.value) < std::make_tuple(b.index, b.mask, b.value);
+                });
+                checks.erase(std::unique(checks.begin(), checks.end()), checks.end());
+                closed = checks.empty();
+
+                words.push_back((uint64_t(r.nr) << 32) | r.action);
+                words.push_back(checks.size());
+                for (ArgCheck const &k : checks) {
+                    words.insert(words.end(), { k.index, k.mask, k.value });
+                }
+
+                // Rules at the end that do what the default does change nothing.
+                if (r.action != p.default_action) {
+                    kept = words.size();
+                }
+            }
+            words.resize(kept);
+            return words;
+        }
+
+        /// FNV-1a, a word at a time instead of a byte, with the high bits folded back in.
+        inline uint64_t hash(std::vector<uint64_t> const &words)
+        {
+            uint64_t h = 0xcbf29ce484222325ULL;
+            for (uint64_t w : words) {
+                h = (h ^ w) * 0x100000001b3ULL;
+                h ^= h >> 32;
+            }
+            return h;
+        }
+
+    }
+
+    /// Everything compiling policy in layout depends on, for a FilterStore.
+    inline std::vector<uint64_t> policy_key(Policy const &policy, Layout const &layout)
+    {
+        std::vector<uint64_t> key { compiler_version, uint64_t(layout.dispatch), layout.profile_order,
+                                    layout.ranges, layout.share };
+        std::vector<uint64_t> const form = batch_detail::canonical(policy);
+        key.insert(key.end(), form.begin(), form.end());
+        return key;
+    }
+
+    struct BatchStats {
+        size_t policies = 0;
+
+        /// Policies that actually had to be compiled.
+        size_t compiled = 0;
+
+        /// Distinct policies found in the store instead.
+        size_t stored = 0;
+    };
+
+    /// Compile every named policy in layout on pool and publish them, replacing what table held.
+    /// Names should be unique; of several policies with one name, the last one counts. Filters
+    /// are taken from and added to store if there is one.
+    inline BatchStats compile_batch(std::vector<std::pair<std::string, Policy>> const &policies,
+                                    Layout const &layout, WorkStealingPool &pool, PolicyTable &table,
+                                    FilterStore *store = nullptr)
+    {
+        using namespace batch_detail;
+
+        size_t const n = policies.size();
+        std::vector<std::vector<uint64_t>> forms(n);
+        std::vector<uint64_t> hashes(n);
+        pool.run(n, [&] (unsigned, size_t i) {
+            forms[i] = canonical(policies[i].second);
+            hashes[i] = hash(forms[i]);
+        });
+
+        // The first policy of each form is compiled for all of them. Equal hashes of different
+        // forms are possible, so forms are compared too.
+        std::unordered_multimap<uint64_t, size_t> firsts;
+        std::vector<size_t> first(n), unique;
+        for (size_t i = 0; i < n; i++) {
+            first[i] = i;
+            auto const range = firsts.equal_range(hashes[i]);
+            for (auto it = range.first; it != range.second && first[i] == i; ++it) {
+                if (forms[it->second] == forms[i]) {
+                    first[i] = it->second;
+                }
+            }
+            if (first[i] == i) {
+                firsts.emplace(hashes[i], i);
+                unique.push_back(i);
+            }
+        }
+
+        std::vector<Filter> filters(n);
+        std::atomic<size_t> stored { 0 };
+        pool.run(unique.size(), [&] (unsigned, size_t u) {
+            size_t const i = unique[u];
+            if (store == nullptr) {
+                filters[i] = std::make_shared<std::vector<sock_filter> const>(compile(policies[i].second, layout));
+                return;
+            }
+
+            std::vector<uint64_t> const key = policy_key(policies[i].second, layout);
+            std::vector<sock_filter> filter;
+            if (store->find(key, filter)) {
+                stored++;
+            } else {
+                filter = compile(policies[i].second, layout);
+                store->insert(key, filter);
+            }
+            filters[i] = std::make_shared<std::vector<sock_filter> const>(std::move(filter));
+        });
+
+        std::unique_ptr<FilterTable> t(new FilterTable());
+        t->reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            (*t)[policies[i].first] = filters[first[i]];
+        }
+        table.publish(std::move(t));
+
+        BatchStats stats;
+        stats.policies = n;
+        stats.compiled = unique.size() - stored;
+        stats.stored = stored;
+        return stats;
+    }
+
+}
+
+// EOF
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "policy.hpp"
+
+/// Compiles a Policy into a seccomp filter in one of several layouts. They all mean the same, but
+/// differ in how many instructions a given system call runs through before it is decided.
+
+namespace seccomp {
+
+    /// Changes whenever compile() may emit something different for the same input, so that stored
+    /// filters from older compilers are not used (see filter_store.hpp).
+    uint32_t const compiler_version = 1;
+
+    enum class Dispatch {
+        /// One comparison per system call, one after the other.
+        LINEAR,
+
+        /// A binary search over the system call numbers, split in the middle.
+        BALANCED_TREE,
+
+        /// A binary search split so that both halves are about as likely (see SyscallWeights).
+        WEIGHTED_TREE,
+    };
+
+    struct Layout {
+        Dispatch dispatch = Dispatch::LINEAR;
+
+        /// LINEAR only: test the most frequent system calls first instead of in policy order.
+        bool profile_order = false;
+
+        /// Neighbouring system call numbers with the same rules are tested as one range.
+        bool ranges = false;
+
+        /// System calls with the same rules share one copy of them, and a failed argument check
+        /// jumps past the next rule's load of the same argument word.
+        bool share = false;
+
+        std::string name() const
+        {
+            std::string n = dispatch == Dispatch::LINEAR ? (profile_order ? "linear/profile" : "linear")
+                : dispatch == Dispatch::BALANCED_TREE ? "balanced" : "weighted";
+            if (ranges) {
+                n += "+ranges";
+            }
+            if (share) {
+                n += "+share";
+            }
+            return n;
+        }
+    };
+
+    /// How often each system call number was seen. Only the profile ordered and weighted layouts
+    /// use it.
+    using SyscallWeights = std::map<uint32_t, uint64_t>;
+
+    namespace compiler_detail {
+
+        /// Blocks of instructions that jump to each other by label. Blocks end up in the program in
+        /// the order they are placed, and jumps may only go forward.
+        class Assembler {
+            struct Insn {
+                sock_filter f;
+                int jt, jf;
+            };
+
+            std::vector<std::vector<Insn>> blocks_;
+            std::vector<int> order_;
+            std::vector<bool> placed_;
+
+        public:
+            /// A jump target meaning the instruction that follows.
+            static int const NEXT = -1;
+
+            int label()
+            {
+                blocks_.emplace_back();
+                placed_.push_back(false);
+                return int(blocks_.size() - 1);
+            }
+
+            void place(int l)
+            {
+                assert(!placed_[l]);
+                placed_[l] = true;
+                order_.push_back(l);
+            }
+
+            void stmt(int l, uint16_t code, uint32_t k)
+            {
+                blocks_[l].push_back({ BPF_STMT(code, k), NEXT, NEXT });
+            }
+
+            void jump(int l, uint16_t code, uint32_t k, int jt, int jf)
+            {
+                blocks_[l].push_back({ BPF_JUMP(code, k, 0, 0), jt, jf });
+            }
+
+            /// Conditional jumps only reach 255 instructions ahead. Farther targets go through a
+            /// BPF_JA right after the jump, which is why the program is put together back to front:
+            /// then all distances to targets are known when a jump is emitted.
+            std::vector<sock_filter> assemble() const
+            {
+                std::vector<sock_filter> rev;
+                std::vector<size_t> at(blocks_.size(), SIZE_MAX);
+
+                for (auto b = order_.rbegin(); b != order_.rend(); ++b) {
+                    std::vector<Insn> const &insns = blocks_[*b];
+
+                    for (size_t i = insns.size(); i-- > 0;) {
+                        Insn const &in = insns[i];
+                        size_t const next = rev.size() - 1;
+                        auto const target = [&] (int l) {
+                            assert(l == NEXT ? !rev.empty() : at[l] != SIZE_MAX);
+                            return l == NEXT ? next : at[l];
+                        };
+
+                        if (BPF_CLASS(in.f.code) != BPF_JMP) {
+                            rev.push_back(in.f);
+                        } else if (BPF_OP(in.f.code) == BPF_JA) {
+                            sock_filter f = in.f;
+                            f.k = uint32_t(rev.size() - target(in.jt) - 1);
+                            rev.push_back(f);
+                        } else {
+                            // Each trampoline moves the other target one further away.
+                            size_t t = target(in.jt);
+                            size_t f = target(in.jf);
+                            for (;;) {
+                                size_t &far = rev.size() - t - 1 > 255 ? t : f;
+                                if (rev.size() - far - 1 <= 255) {
+                                    break;
+                                }
+                                rev.push_back(BPF_STMT(BPF_JMP | BPF_JA, uint32_t(rev.size() - far - 1)));
+                                far = rev.size() - 1;
+                            }
+                            rev.push_back(BPF_JUMP(in.f.code, in.f.k, uint8_t(rev.size() - t - 1),
+                                                   uint8_t(rev.size() - f - 1)));
+                        }
+                    }
+
+                    at[*b] = rev.size() - 1;
+                }
+
+                return std::vector<sock_filter>(rev.rbegin(), rev.rend());
+            }
+        };
+
+        /// A 32-bit half of an argument check.
+        struct Word {
+            uint32_t offset;
+            uint32_t mask;
+            uint32_t value;
+        };
+
+        /// The words rule r compares, or false if no argument can satisfy it.
+        inline bool words(PolicyRule const &r, std::vector<Word> &out)
+        {
+            out.clear();
+            for (ArgCheck const &c : r.checks) {
+                if ((c.value & ~c.mask) != 0) {
+                    return false;
+                }
+                for (unsigned half = 0; half < 2; half++) {
+                    uint32_t const mask = uint32_t(c.mask >> (32 * half));
+                    if (mask != 0) {
+                        out.push_back({ uint32_t(offsetof(seccomp_data, args) + 8 * c.index + 4 * half),
+                                        mask, uint32_t(c.value >> (32 * half)) });
+                    }
+                }
+            }
+            return true;
+        }
+
+        /// The rules of one system call, in order, up to the first one that always applies.
+        struct Body {
+            std::vector<PolicyRule const *> rules;
+            int label = -1;
+            unsigned refs = 0;
+
+            bool operator==(Body const &o) const
+            {
+                return std::equal(rules.begin(), rules.end(), o.rules.begin(), o.rules.end(),
+                                  [] (PolicyRule const *a, PolicyRule const *b) {
+                                      return a->action == b->action && a->checks == b->checks;
+                                  });
+            }
+        };
+
+        /// Emit and place body starting at entry, with failed checks of the last rule going to
+        /// fallback.
+        inline void emit_body(Assembler &a, Body const &body, int entry, int fallback, bool share)
+        {
+            size_t const n = body.rules.size();
+            std::vector<std::vector<Word>> ws(n);
+            std::vector<int> start(n), after_load(n);
+            for (size_t i = 0; i < n; i++) {
+                words(*body.rules[i], ws[i]);
+                start[i] = i ? a.label() : entry;
+                after_load[i] = a.label();
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                int const fail = i + 1 < n ? start[i + 1] : fallback;
+                int block = start[i];
+                uint32_t loaded = UINT32_MAX;  // argument word in A, unmasked
+
+                for (Word const &w : ws[i]) {
+                    if (w.offset != loaded) {
+                        a.stmt(block, BPF_LD | BPF_W | BPF_ABS, w.offset);
+                    }
+                    block = after_load[i];
+
+                    bool const raw = w.mask == UINT32_MAX;
+                    if (!raw) {
+                        a.stmt(block, BPF_ALU | BPF_AND | BPF_K, w.mask);
+                    }
+
+                    // The next rule would load what is still in A.
+                    bool const skip_load = share && raw && i + 1 < n && !ws[i + 1].empty() &&
+                        ws[i + 1].front().offset == w.offset;
+                    a.jump(block, BPF_JMP | BPF_JEQ | BPF_K, w.value, Assembler::NEXT,
+                           skip_load ? after_load[i + 1] : fail);
+                    loaded = raw ? w.offset : UINT32_MAX;
+                }
+
+                a.stmt(block, BPF_RET | BPF_K, body.rules[i]->action);
+                a.place(start[i]);
+                a.place(after_load[i]);
+            }
+        }
+
+        struct Segment {
+            uint32_t lo, hi;
+
+            /// Index into the bodies, or -1 for the default action.
+            int body;
+
+            uint64_t weight;
+
+            /// Position of the first rule for it in the policy.
+            size_t first_rule;
+        };
+
+        inline uint64_t weight_of(SyscallWeights const &weights, uint32_t lo, uint32_t hi)
+        {
+            uint64_t w = 0;
+            for (auto it = weights.lower_bound(lo); it != weights.end() && it->first <= hi; ++it) {
+                w += it->second;
+            }
+            return w;
+        }
+
+        /// The system call numbers with rules as segments, in ascending order.
+        inline std::vector<Segment> segments(Policy const &policy, Layout const &layout,
+                                             SyscallWeights const &weights, std::vector<Body> &bodies)
+        {
+            std::map<uint32_t, Body> by_nr;
+            std::map<uint32_t, size_t> first_rule;
+            std::map<uint32_t, bool> closed;
+            std::vector<Word> ws;
+
+            for (size_t i = 0; i < policy.rules.size(); i++) {
+                PolicyRule const &r = policy.rules[i];
+                first_rule.emplace(r.nr, i);
+                Body &b = by_nr[r.nr];
+
+                if (!closed[r.nr] && words(r, ws)) {
+                    b.rules.push_back(&r);
+                    closed[r.nr] = ws.empty();
+                }
+            }
+
+            std::vector<Segment> segs;
+            for (auto const &e : by_nr) {
+                // Nothing to test when every rule ends up where the default action would.
+                bool const trivial = std::all_of(e.second.rules.begin(), e.second.rules.end(),
+                                                 [&] (PolicyRule const *r) {
+                                                     return r->action == policy.default_action;
+                                                 });
+                if (trivial) {
+                    continue;
+                }
+
+                int body = -1;
+                if (layout.share) {
+                    for (size_t b = 0; b < bodies.size() && body < 0; b++) {
+                        if (bodies[b] == e.second) {
+                            body = int(b);
+                        }
+                    }
+                }
+                if (body < 0) {
+                    bodies.push_back(e.second);
+                    body = int(bodies.size() - 1);
+                }
+
+                Segment s { e.first, e.first, body, weight_of(weights, e.first, e.first), first_rule[e.first] };
+                if (layout.ranges && !segs.empty() && segs.back().hi + 1 == s.lo &&
+                    bodies[segs.back().body] == bodies[s.body]) {
+                    segs.back().hi = s.hi;
+                    segs.back().weight += s.weight;
+                    segs.back().first_rule = std::min(segs.back().first_rule, s.first_rule);
+                } else {
+                    segs.push_back(s);
+                }
+            }
+
+            for (Segment const &s : segs) {
+                bodies[s.body].refs++;
+            }
+            return segs;
+        }
+
+        /// Where a segment's body starts. Bodies used only here are placed right away, shared ones
+        /// after all of the dispatch so that every jump to them goes forward.
+        inline int leaf(Assembler &a, std::vector<Body> &bodies, Segment const &s, int fallback, bool share)
+        {
+            if (s.body < 0) {
+                return fallback;
+            }
+            Body &b = bodies[s.body];
+            if (b.label < 0) {
+                b.label = a.label();
+                if (b.refs == 1) {
+                    emit_body(a, b, b.label, fallback, share);
+                }
+            }
+            return b.label;
+        }
+
+        inline void place_shared(Assembler &a, std::vector<Body> &bodies, int fallback, bool share)
+        {
+            for (Body &b : bodies) {
+                if (b.refs > 1 && b.label >= 0) {
+                    emit_body(a, b, b.label, fallback, share);
+                }
+            }
+        }
+
+        inline size_t split(std::vector<Segment> const &segs, size_t begin, size_t end, bool weighted)
+        {
+            uint64_t total = 0;
+            for (size_t i = begin; i < end; i++) {
+                total += weighted ? segs[i].weight : 0;
+            }
+            if (total == 0) {
+                return begin + (end - begin) / 2;
+            }
+
+            size_t best = begin + 1;
+            uint64_t left = segs[begin].weight;
+            uint64_t best_diff = UINT64_MAX;
+            for (size_t k = begin + 1; k < end; k++) {
+                uint64_t const diff = left * 2 > total ? left * 2 - total : total - left * 2;
+                if (diff < best_diff) {
+                    best = k;
+                    best_diff = diff;
+                }
+                left += segs[k].weight;
+            }
+            return best;
+        }
+
+        /// Emit the subtree for segs[begin, end) in preorder and return where it starts.
+        inline int tree(Assembler &a, std::vector<Body> &bodies, std::vector<Segment> const &segs,
+                        size_t begin, size_t end, bool weighted, int fallback, bool share)
+        {
+            if (end - begin == 1) {
+                return leaf(a, bodies, segs[begin], fallback, share);
+            }
+
+            size_t const k = split(segs, begin, end, weighted);
+            int const node = a.label();
+            a.place(node);
+            int const left = tree(a, bodies, segs, begin, k, weighted, fallback, share);
+            int const right = tree(a, bodies, segs, k, end, weighted, fallback, share);
+            a.jump(node, BPF_JMP | BPF_JGE | BPF_K, segs[k].lo, right, left);
+            return node;
+        }
+
+    }
+
+    inline std::vector<sock_filter> compile(Policy const &policy, Layout const &layout,
+                                            SyscallWeights const &weights = SyscallWeights())
+    {
+        using namespace compiler_detail;
+
+        Assembler a;
+        std::vector<Body> bodies;
+        std::vector<Segment> segs = segments(policy, layout, weights, bodies);
+
+        int const prologue = a.label();
+        int const fallback = a.label();
+        int const kill = policy.default_action == SECCOMP_RET_KILL ? fallback : a.label();
+
+        a.place(prologue);
+        a.stmt(prologue, BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch));
+        a.jump(prologue, BPF_JMP | BPF_JEQ | BPF_K, policy.arch, Assembler::NEXT, kill);
+        a.stmt(prologue, BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr));
+
+        if (layout.dispatch == Dispatch::LINEAR) {
+            std::stable_sort(segs.begin(), segs.end(), [&] (Segment const &x, Segment const &y) {
+                if (layout.profile_order && x.weight != y.weight) {
+                    return x.weight > y.weight;
+                }
+                return x.first_rule < y.first_rule;
+            });
+
+            std::vector<int> tests;
+            for (size_t i = 0; i < segs.size(); i++) {
+                tests.push_back(a.label());
+            }
+            tests.push_back(fallback);
+
+            for (size_t i = 0; i < segs.size(); i++) {
+                Segment const &s = segs[i];
+                int const test = tests[i];
+                a.place(test);
+                int const body = leaf(a, bodies, s, fallback, layout.share);
+
+                if (s.lo == s.hi) {
+                    a.jump(test, BPF_JMP | BPF_JEQ | BPF_K, s.lo, body, tests[i + 1]);
+                } else {
+                    if (s.lo > 0) {
+                        a.jump(test, BPF_JMP | BPF_JGE | BPF_K, s.lo, Assembler::NEXT, tests[i + 1]);
+                    }
+                    a.jump(test, BPF_JMP | BPF_JGT | BPF_K, s.hi, tests[i + 1], body);
+                }
+            }
+        } else {
+            // The tree covers all numbers, those without rules included.
+            std::vector<Segment> all;
+            uint32_t lo = 0;
+            for (Segment const &s : segs) {
+                if (s.lo > lo) {
+                    all.push_back({ lo, s.lo - 1, -1, weight_of(weights, lo, s.lo - 1), SIZE_MAX });
+                }
+                all.push_back(s);
+                lo = s.hi + 1;
+            }
+            if (segs.empty() || segs.back().hi != UINT32_MAX) {
+                all.push_back({ lo, UINT32_MAX, -1, weight_of(weights, lo, UINT32_MAX), SIZE_MAX });
+            }
+
+            tree(a, bodies, all, 0, all.size(), layout.dispatch == Dispatch::WEIGHTED_TREE,
+                 fallback, layout.share);
+        }
+
+        place_shared(a, bodies, fallback, layout.share);
+
+        a.place(fallback);
+        a.stmt(fallback, BPF_RET | BPF_K, policy.default_action);
+        if (kill != fallback) {
+            a.place(kill);
+            a.stmt(kill, BPF_RET | BPF_K, SECCOMP_RET_KILL);
+        }
+
+        return a.assemble();
+    }
+
+}
+
+// EOF
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bpf_disasm.hpp"
+#include "bpf_eval.hpp"
+#include "policy.hpp"
+#include "policy_compiler.hpp"
+#include "syscall_names.hpp"
+
+/// Policies put together from named profiles, such as "base-runtime" or "stdout-only", into one
+/// policy that compiles to one filter.
+///
+/// Stacking a filter per profile would make every system call run through all of them. Merged,
+/// it runs through one dispatch over the union. Where profiles disagree about a call, the one with
+/// the higher precedence decides; profiles of equal precedence must not disagree.
+
+namespace seccomp {
+
+    struct PolicyProfile {
+        std::string name;
+
+        /// Higher wins where profiles disagree.
+        int precedence = 0;
+
+        /// Tried in order, as in a Policy.
+        std::vector<PolicyRule> rules;
+    };
+
+    namespace compose_detail {
+
+        /// Whether some call satisfies the checks of both rules.
+        inline bool overlap(PolicyRule const &a, PolicyRule const &b)
+        {
+            if (a.nr != b.nr) {
+                return false;
+            }
+
+            std::vector<ArgCheck> all = a.checks;
+            all.insert(all.end(), b.checks.begin(), b.checks.end());
+            for (size_t i = 0; i < all.size(); i++) {
+                if ((all[i].value & ~all[i].mask) != 0) {
+                    return false;
+                }
+                for (size_t j = 0; j < i; j++) {
+                    if (all[i].index == all[j].index &&
+                        ((all[i].value ^ all[j].value) & all[i].mask & all[j].mask) != 0) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /// profiles from the highest precedence down, in their order where equal.
+        inline std::vector<PolicyProfile const *> by_precedence(std::vector<PolicyProfile> const &profiles)
+        {
+            std::vector<PolicyProfile const *> order;
+            for (PolicyProfile const &p : profiles) {
+                order.push_back(&p);
+            }
+            std::stable_sort(order.begin(), order.end(), [] (PolicyProfile const *a, PolicyProfile const *b) {
+                return a->precedence > b->precedence;
+            });
+            return order;
+        }
+
+    }
+
+    /// Merge profiles into out, with default_action for calls none of them decides. On a conflict
+    /// between profiles of equal precedence, error says which.
+    inline bool compose(std::vector<PolicyProfile> const &profiles, uint32_t default_action, Policy &out,
+                        std::string &error)
+    {
+        std::vector<PolicyProfile const *> const order = compose_detail::by_precedence(profiles);
+        for (size_t i = 0; i < order.size(); i++) {
+            for (size_t j = i; j-- > 0 && order[j]->precedence == order[i]->precedence;) {
+                for (PolicyRule const &a : order[j]->rules) {
+                    for (PolicyRule const &b : order[i]->rules) {
+                        if (a.action == b.action || !compose_detail::overlap(a, b)) {
+                            continue;
+                        }
+                        char const *name = syscall_name(a.nr);
+                        error = "profiles " + order[j]->name + " and " + order[i]->name + " disagree on " +
+                            (name ? name : std::to_string(a.nr)) + ": " + action_name(a.action) +
+                            " or " + action_name(b.action) + "; give one a higher precedence";
+                        return false;
+                    }
+                }
+            }
+        }
+
+        out = Policy();
+        out.default_action = default_action;
+        for (PolicyProfile const *p : order) {
+            out.rules.insert(out.rules.end(), p->rules.begin(), p->rules.end());
+        }
+        return true;
+    }
+
+    struct CompositionCost {
+        /// Instructions of all profiles' filters, and of the merged one.
+        size_t stacked_size = 0, merged_size = 0;
+
+        /// Instructions run per system call, averaged over the calls the two were compared on.
+        double stacked = 0, merged = 0;
+
+        /// Calls the stacked filters decide differently from the merged one; the costs mean
+        /// nothing unless this is 0.
+        size_t mismatches = 0;
+    };
+
+    /// What running a filter per profile costs compared to merged, the composition of profiles,
+    /// all compiled in layout.
+    ///
+    /// The stacked filters decide what merged does. Each profile's filter allows what its own
+    /// rules do not decide, including calls a profile of higher precedence decides, and one more
+    /// filter gives calls no profile decides merged's default.
+    inline CompositionCost composition_cost(std::vector<PolicyProfile> const &profiles, Policy const &merged,
+                                            Layout const &layout)
+    {
+        CompositionCost c;
+        std::vector<PolicyProfile const *> const order = compose_detail::by_precedence(profiles);
+        std::vector<std::vector<sock_filter>> stacked;
+        for (size_t i = 0; i < order.size(); i++) {
+            Policy alone;
+            alone.arch = merged.arch;
+            alone.default_action = SECCOMP_RET_ALLOW;
+            for (size_t j = 0; j < i; j++) {
+                for (PolicyRule const &r : order[j]->rules) {
+                    bool const shadows = std::any_of(order[i]->rules.begin(), order[i]->rules.end(),
+                                                     [&r] (PolicyRule const &o) { return o.nr == r.nr; });
+                    if (shadows) {
+                        alone.add(r.nr, SECCOMP_RET_ALLOW, r.checks);
+                    }
+                }
+            }
+            alone.rules.insert(alone.rules.end(), order[i]->rules.begin(), order[i]->rules.end());
+            stacked.push_back(compile(alone, layout));
+        }
+        if (merged.default_action != SECCOMP_RET_ALLOW) {
+            Policy rest = merged;
+            for (PolicyRule &r : rest.rules) {
+                r.action = SECCOMP_RET_ALLOW;
+            }
+            stacked.push_back(compile(rest, layout));
+        }
+        for (std::vector<sock_filter> const &f : stacked) {
+            c.stacked_size += f.size();
+        }
+        std::vector<sock_filter> const one = compile(merged, layout);
+        c.merged_size = one.size();
+
+        std::vector<seccomp_data> const calls = merged.probes();
+        for (seccomp_data const &d : calls) {
+            uint32_t const action = evaluate(one, d).action;
+            if (evaluate_stacked(stacked, d) != action || merged.decide(d) != action) {
+                c.mismatches++;
+            }
+            for (std::vector<sock_filter> const &f : stacked) {
+                c.stacked += evaluate(f, d).executed;
+            }
+            c.merged += evaluate(one, d).executed;
+        }
+        c.stacked /= calls.size();
+        c.merged /= calls.size();
+        return c;
+    }
+
+}
+
+// EOF
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <linux/filter.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "policy.hpp"
+#include "policy_registry.hpp"
+
+/// A policy that is edited a rule at a time and recompiled after each edit.
+///
+/// The policy is kept in a PolicyRegistry of its own. An edit only changes the rules of one system
+/// call, so only that call's rules are compiled again and only the trie nodes on the path to it are
+/// new; the filter is then put together from the compiled parts. Parts that edits stop using stay
+/// in the registry until 16 more edits have been made than the policy has rules, when it is built
+/// again from scratch. The 16 keeps a policy of a few rules from being rebuilt on almost every edit.
+
+namespace seccomp {
+
+    class IncrementalPolicy {
+        Policy policy_;
+        std::unique_ptr<PolicyRegistry> registry_;
+        size_t edits_ = 0;
+
+        void rebuild()
+        {
+            registry_.reset(new PolicyRegistry());
+            registry_->add("", policy_);
+            edits_ = 0;
+        }
+
+        void refresh(uint32_t nr)
+        {
+            if (++edits_ > policy_.rules.size() + 16) {
+                rebuild();
+                return;
+            }
+
+            std::vector<PolicyRule const *> rules;
+            for (PolicyRule const &r : policy_.rules) {
+                if (r.nr == nr) {
+                    rules.push_back(&r);
+                }
+            }
+            registry_->update("", nr, rules);
+        }
+
+    public:
+        explicit IncrementalPolicy(Policy policy)
+            : policy_(std::move(policy))
+        {
+            rebuild();
+        }
+
+        Policy const &policy() const { return policy_; }
+
+        /// Insert rule before the one at position, or at the end.
+        void insert(size_t position, PolicyRule rule)
+        {
+            uint32_t const nr = rule.nr;
+            policy_.rules.insert(policy_.rules.begin() + std::min(position, policy_.rules.size()), std::move(rule));
+            refresh(nr);
+        }
+
+        void erase(size_t position)
+        {
+            uint32_t const nr = policy_.rules.at(position).nr;
+            policy_.rules.erase(policy_.rules.begin() + position);
+            refresh(nr);
+        }
+
+        /// The filter of the policy as it is now, the same as a PolicyRegistry would compile for it.
+        std::vector<sock_filter> filter() const
+        {
+            return registry_->compile("");
+        }
+    };
+
+}
+
+// EOF
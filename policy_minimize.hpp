@@ -0,0 +1,161 @@
+#pragma once
+
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "policy.hpp"
+#include "trace.hpp"
+
+/// Narrows a broad policy down to what a recorded workload actually does.
+///
+/// Only system calls the broad policy let through in the trace stay. Their arguments are
+/// constrained to what was observed: a handful of distinct argument combinations are listed
+/// exactly, more are generalized to the bits all observed values have in common. The result is
+/// then intersected with the broad policy, so it never allows anything the broad one did not.
+///
+/// The broad policy is taken as an allowlist: calls it leaves to its default action are the ones
+/// it refuses, and they are refused by the result as well.
+
+namespace seccomp {
+
+    struct MinimizeOptions {
+        /// Arguments that may be constrained, one bit each. Leave out pointers and anything else
+        /// whose recorded values say nothing about the next run.
+        unsigned args = 0x3f;
+
+        /// Up to this many distinct combinations of arguments per system call are allowed exactly.
+        size_t max_exact = 4;
+    };
+
+    namespace minimize_detail {
+
+        struct Observed {
+            std::set<std::array<uint64_t, 6>> exact;
+            bool generalized = false;
+
+            /// Some observed value per argument, and the bits any value differed in from it.
+            uint64_t first[6];
+            uint64_t differs[6] = {};
+        };
+
+        /// g && r as one list of checks, or false if they contradict each other.
+        inline bool conjoin(std::vector<ArgCheck> const &g, std::vector<ArgCheck> const &r, std::vector<ArgCheck> &out)
+        {
+            out = g;
+            for (ArgCheck const &c : r) {
+                bool implied = false;
+                for (ArgCheck const &o : g) {
+                    if (o.index != c.index) {
+                        continue;
+                    }
+                    if (((o.value ^ c.value) & o.mask & c.mask) != 0) {
+                        return false;
+                    }
+                    implied = implied || ((o.mask & c.mask) == c.mask && (c.value & ~c.mask) == 0);
+                }
+                if (!implied) {
+                    out.push_back(c);
+                }
+            }
+            return true;
+        }
+
+    }
+
+    inline Policy minimize(Policy const &broad, TraceReader const &trace,
+                           MinimizeOptions const &opts = MinimizeOptions())
+    {
+        using namespace minimize_detail;
+
+        std::map<uint32_t, Observed> observed;
+        trace.for_each([&] (TraceRecord const &r) {
+            seccomp_data const d = r.data();
+            if (d.arch != broad.arch || broad.decide(d) == broad.default_action) {
+                return;
+            }
+
+            std::array<uint64_t, 6> args {};
+            for (unsigned i = 0; i < 6; i++) {
+                args[i] = opts.args & (1u << i) ? r.args[i] : 0;
+            }
+
+            auto const it = observed.find(r.nr);
+            Observed &o = observed[r.nr];
+            for (unsigned i = 0; i < 6; i++) {
+                if (it == observed.end()) {
+                    o.first[i] = args[i];
+                }
+                o.differs[i] |= args[i] ^ o.first[i];
+            }
+
+            if (!o.generalized) {
+                o.exact.insert(args);
+                if (o.exact.size() > opts.max_exact) {
+                    o.generalized = true;
+                    o.exact.clear();
+                }
+            }
+        });
+
+        Policy p;
+        p.arch = broad.arch;
+        p.default_action = broad.default_action;
+
+        std::set<uint32_t> done;
+        for (PolicyRule const &first : broad.rules) {
+            auto const o = observed.find(first.nr);
+            if (o == observed.end() || !done.insert(first.nr).second) {
+                continue;
+            }
+
+            // What was observed, as alternatives.
+            std::vector<std::vector<ArgCheck>> seen;
+            if (o->second.generalized) {
+                seen.emplace_back();
+                for (unsigned i = 0; i < 6; i++) {
+                    uint64_t const mask = ~o->second.differs[i];
+                    if (opts.args & (1u << i) && mask != 0) {
+                        seen.back().push_back({ i, mask, o->second.first[i] & mask });
+                    }
+                }
+            } else {
+                for (std::array<uint64_t, 6> const &args : o->second.exact) {
+                    seen.emplace_back();
+                    for (unsigned i = 0; i < 6; i++) {
+                        if (opts.args & (1u << i)) {
+                            seen.back().push_back({ i, ~0ULL, args[i] });
+                        }
+                    }
+                }
+            }
+
+            // Each alternative runs through the broad rules for this system call.
+            size_t const begin = p.rules.size();
+            std::vector<ArgCheck> checks;
+            for (std::vector<ArgCheck> const &g : seen) {
+                for (PolicyRule const &r : broad.rules) {
+                    if (r.nr == first.nr && conjoin(g, r.checks, checks)) {
+                        p.add(r.nr, r.action, checks);
+                    }
+                }
+            }
+
+            // Nothing after these could decide differently from the default.
+            while (p.rules.size() > begin && p.rules.back().action == p.default_action) {
+                p.rules.pop_back();
+            }
+        }
+
+        return p;
+    }
+
+}
+
+// EOF
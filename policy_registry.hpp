@@ -0,0 +1,382 @@
+#pragma once
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "policy.hpp"
+#include "policy_compiler.hpp"
+
+/// Policies of many tenants that mostly share a base, each stored and compiled once per distinct
+/// part instead of once per tenant.
+///
+/// Everything is hash-consed: rules, the lists of rules of a system call, and the nodes of a
+/// binary trie over system call numbers. The trie splits at fixed powers of two, so a tenant that
+/// overrides a few system calls shares every subtree of the base except those on the paths to its
+/// overrides. Each list of rules is compiled once, to code that only jumps within itself; a
+/// tenant's filter is put together by copying those along its trie, which takes microseconds.
+
+namespace seccomp {
+
+    struct RegistryStats {
+        size_t tenants = 0;
+        size_t rules = 0;
+        size_t bodies = 0;
+        size_t nodes = 0;
+
+        /// Instructions compiled for all distinct lists of rules.
+        size_t instructions = 0;
+
+        /// Roughly what all of it takes in memory.
+        size_t bytes = 0;
+    };
+
+    class PolicyRegistry {
+        struct WordsHash {
+            size_t operator()(std::vector<uint64_t> const &words) const
+            {
+                // FNV-1a, a word at a time
+                uint64_t h = 0xcbf29ce484222325ULL;
+                for (uint64_t w : words) {
+                    h = (h ^ w) * 0x100000001b3ULL;
+                    h ^= h >> 32;
+                }
+                return size_t(h);
+            }
+        };
+
+        using Interned = std::unordered_map<std::vector<uint64_t>, uint32_t, WordsHash>;
+
+        /// A leaf holds the code of a list of rules, an inner node tests whether nr >= mid.
+        struct Node {
+            uint32_t mid = 0;
+            uint32_t left = 0, right = 0;
+            bool leaf = true;
+            std::vector<sock_filter> code;
+
+            /// Instructions of the whole subtree.
+            size_t size = 0;
+        };
+
+        struct Tenant {
+            uint32_t arch;
+            uint32_t default_action;
+
+            /// The trie covers [0, 2^bits), larger numbers get the default action.
+            unsigned bits;
+            uint32_t root;
+        };
+
+        std::vector<std::unique_ptr<PolicyRule const>> rules_;
+        Interned rule_ids_;
+        Interned body_ids_;
+        std::vector<std::vector<uint64_t>> bodies_;
+        std::vector<Node> nodes_;
+        Interned node_ids_;
+        std::unordered_map<std::string, Tenant> tenants_;
+
+        static uint32_t const DEFAULT_BODY = UINT32_MAX;
+
+        uint32_t intern(Interned &table, std::vector<uint64_t> key, uint32_t next)
+        {
+            return table.emplace(std::move(key), next).first->second;
+        }
+
+        /// Rules do not include their system call number: the same rule for two system calls is
+        /// one rule here.
+        uint32_t intern_rule(PolicyRule const &r)
+        {
+            PolicyRule c { 0, {}, r.action };
+            for (ArgCheck const &k : r.checks) {
+                if (k.mask != 0) {
+                    c.checks.push_back(k);
+                }
+            }
+            std::sort(c.checks.begin(), c.checks.end(), [] (ArgCheck const &a, ArgCheck const &b) {
+                return a.index != b.index ? a.index < b.index : a.mask != b.mask ? a.mask < b.mask : a.value < b.value;
+            });
+            c.checks.erase(std::unique(c.checks.begin(), c.checks.end()), c.checks.end());
+
+            std::vector<uint64_t> key { c.action };
+            for (ArgCheck const &k : c.checks) {
+                key.insert(key.end(), { k.index, k.mask, k.value });
+            }
+            uint32_t const id = intern(rule_ids_, std::move(key), uint32_t(rules_.size()));
+            if (id == rules_.size()) {
+                rules_.emplace_back(new PolicyRule(std::move(c)));
+            }
+            return id;
+        }
+
+        uint32_t intern_node(std::vector<uint64_t> key, Node &&node)
+        {
+            uint32_t const id = intern(node_ids_, std::move(key), uint32_t(nodes_.size()));
+            if (id == nodes_.size()) {
+                nodes_.push_back(std::move(node));
+            }
+            return id;
+        }
+
+        /// The leaf running body, a list of interned rules, or DEFAULT_BODY.
+        uint32_t leaf(uint32_t body, uint32_t default_action)
+        {
+            std::vector<uint64_t> key { 0, body, default_action };
+            auto const it = node_ids_.find(key);
+            if (it != node_ids_.end()) {
+                return it->second;
+            }
+
+            using namespace compiler_detail;
+            Node n;
+            if (body == DEFAULT_BODY) {
+                n.code.push_back(BPF_STMT(BPF_RET | BPF_K, default_action));
+            } else {
+                Body b;
+                for (uint64_t r : bodies_[body]) {
+                    b.rules.push_back(rules_[r].get());
+                }
+
+                Assembler a;
+                int const entry = a.label();
+                int const fallback = a.label();
+                emit_body(a, b, entry, fallback, true);
+                a.place(fallback);
+                a.stmt(fallback, BPF_RET | BPF_K, default_action);
+                n.code = a.assemble();
+            }
+            n.size = n.code.size();
+            return intern_node(std::move(key), std::move(n));
+        }
+
+        uint32_t inner(uint32_t mid, uint32_t left, uint32_t right)
+        {
+            if (left == right) {
+                return left;  // only leaves can be equal: inner nodes differ in mid
+            }
+
+            Node n;
+            n.mid = mid;
+            n.left = left;
+            n.right = right;
+            n.leaf = false;
+            size_t const ls = nodes_[left].size;
+            n.size = 1 + (ls > 255) + ls + nodes_[right].size;
+            return intern_node({ 1, mid, left, right }, std::move(n));
+        }
+
+        /// The subtree for [lo, lo + 2^bits), given the leaves of the numbers in it that have rules.
+        uint32_t build(uint64_t lo, unsigned bits, std::pair<uint32_t, uint32_t> const *begin,
+                       std::pair<uint32_t, uint32_t> const *end, uint32_t default_leaf)
+        {
+            if (begin == end) {
+                return default_leaf;
+            }
+            if (bits == 0) {
+                return begin->second;
+            }
+
+            uint64_t const mid = lo + (uint64_t(1) << (bits - 1));
+            auto const split = std::lower_bound(begin, end, mid, [] (auto const &e, uint64_t nr) {
+                return e.first < nr;
+            });
+            uint32_t const left = build(lo, bits - 1, begin, split, default_leaf);
+            uint32_t const right = build(mid, bits - 1, split, end, default_leaf);
+            return inner(uint32_t(mid), left, right);
+        }
+
+        /// The leaf for the rules of one system call: those up to the first that always applies, as
+        /// compile() sees them, without those at the end that do what the default does.
+        uint32_t leaf_of(std::vector<PolicyRule const *> const &rules, uint32_t default_action)
+        {
+            std::vector<uint64_t> body;
+            for (PolicyRule const *r : rules) {
+                bool const satisfiable = std::all_of(r->checks.begin(), r->checks.end(), [] (ArgCheck const &k) {
+                    return (k.value & ~k.mask) == 0;
+                });
+                if (!satisfiable) {
+                    continue;
+                }
+                body.push_back(intern_rule(*r));
+                if (rules_[body.back()]->checks.empty()) {
+                    break;
+                }
+            }
+
+            while (!body.empty() && rules_[body.back()]->action == default_action) {
+                body.pop_back();
+            }
+            if (body.empty()) {
+                return leaf(DEFAULT_BODY, default_action);
+            }
+
+            uint32_t const id = intern(body_ids_, body, uint32_t(bodies_.size()));
+            if (id == bodies_.size()) {
+                bodies_.push_back(std::move(body));
+            }
+            return leaf(id, default_action);
+        }
+
+        /// The subtree id for [lo, lo + 2^bits) with nr going to leaf l instead.
+        uint32_t replace(uint32_t id, uint64_t lo, unsigned bits, uint32_t nr, uint32_t l)
+        {
+            if (bits == 0) {
+                return l;
+            }
+
+            // A leaf here stands for the same leaf in both halves.
+            Node const &n = nodes_[id];
+            uint32_t left = n.leaf ? id : n.left;
+            uint32_t right = n.leaf ? id : n.right;
+
+            uint64_t const mid = lo + (uint64_t(1) << (bits - 1));
+            if (nr < mid) {
+                left = replace(left, lo, bits - 1, nr, l);
+            } else {
+                right = replace(right, mid, bits - 1, nr, l);
+            }
+            return inner(uint32_t(mid), left, right);
+        }
+
+        void emit(uint32_t id, std::vector<sock_filter> &out) const
+        {
+            Node const &n = nodes_[id];
+            if (n.leaf) {
+                out.insert(out.end(), n.code.begin(), n.code.end());
+                return;
+            }
+
+            size_t const ls = nodes_[n.left].size;
+            if (ls <= 255) {
+                out.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, n.mid, uint8_t(ls), 0));
+            } else {
+                out.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, n.mid, 0, 1));
+                out.push_back(BPF_STMT(BPF_JMP | BPF_JA, uint32_t(ls)));
+            }
+            emit(n.left, out);
+            emit(n.right, out);
+        }
+
+    public:
+        /// Add a tenant or replace its policy. What the old policy used alone stays in the registry.
+        void add(std::string const &tenant, Policy const &policy)
+        {
+            std::map<uint32_t, std::vector<PolicyRule const *>> by_nr;
+            for (PolicyRule const &r : policy.rules) {
+                by_nr[r.nr].push_back(&r);
+            }
+
+            uint32_t const default_leaf = leaf(DEFAULT_BODY, policy.default_action);
+            std::vector<std::pair<uint32_t, uint32_t>> leaves;
+            for (auto const &e : by_nr) {
+                uint32_t const l = leaf_of(e.second, policy.default_action);
+                if (l != default_leaf) {
+                    leaves.emplace_back(e.first, l);
+                }
+            }
+
+            Tenant t { policy.arch, policy.default_action, 1, default_leaf };
+            while (t.bits < 32 && !leaves.empty() && (leaves.back().first >> t.bits) != 0) {
+                t.bits++;
+            }
+            t.root = build(0, t.bits, leaves.data(), leaves.data() + leaves.size(), default_leaf);
+            tenants_[tenant] = t;
+        }
+
+        /// Replace the rules tenant has for system call nr by rules, all for nr, in order. Only the
+        /// path to nr in the trie is built anew, so the result is what add() would have made.
+        void update(std::string const &tenant, uint32_t nr, std::vector<PolicyRule const *> const &rules)
+        {
+            Tenant &t = tenants_.at(tenant);
+            uint32_t const default_leaf = leaf(DEFAULT_BODY, t.default_action);
+            uint32_t const l = leaf_of(rules, t.default_action);
+
+            while (t.bits < 32 && (nr >> t.bits) != 0) {
+                t.root = inner(uint32_t(1) << t.bits, t.root, default_leaf);
+                t.bits++;
+            }
+            t.root = replace(t.root, 0, t.bits, nr, l);
+
+            // Shrink back to the smallest trie that covers every number with rules.
+            while (t.bits > 1) {
+                Node const &n = nodes_[t.root];
+                if (t.root == default_leaf) {
+                    t.bits = 1;
+                } else if (!n.leaf && n.mid == uint32_t(1) << (t.bits - 1) && n.right == default_leaf) {
+                    t.root = n.left;
+                    t.bits--;
+                } else {
+                    break;
+                }
+            }
+        }
+
+        bool contains(std::string const &tenant) const
+        {
+            return tenants_.count(tenant) != 0;
+        }
+
+        /// The filter of tenant, which must have been added.
+        std::vector<sock_filter> compile(std::string const &tenant) const
+        {
+            Tenant const &t = tenants_.at(tenant);
+
+            std::vector<sock_filter> out {
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, t.arch, 1, 0),
+                BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+            };
+            if (t.bits < 32) {
+                out.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, uint32_t(1) << t.bits, 0, 1));
+                out.push_back(BPF_STMT(BPF_RET | BPF_K, t.default_action));
+            }
+            out.reserve(out.size() + nodes_[t.root].size);
+            emit(t.root, out);
+            return out;
+        }
+
+        RegistryStats stats() const
+        {
+            RegistryStats s;
+            s.tenants = tenants_.size();
+            s.rules = rules_.size();
+            s.bodies = body_ids_.size();
+            s.nodes = nodes_.size();
+
+            auto const keys = [] (Interned const &table) {
+                size_t bytes = 0;
+                for (auto const &e : table) {
+                    bytes += sizeof(e) + e.first.capacity() * sizeof(uint64_t);
+                }
+                return bytes;
+            };
+            s.bytes = keys(rule_ids_) + keys(body_ids_) + keys(node_ids_);
+            for (auto const &b : bodies_) {
+                s.bytes += sizeof(b) + b.capacity() * sizeof(uint64_t);
+            }
+            for (auto const &r : rules_) {
+                s.bytes += sizeof(PolicyRule) + r->checks.capacity() * sizeof(ArgCheck);
+            }
+            for (Node const &n : nodes_) {
+                s.instructions += n.code.size();
+                s.bytes += sizeof(Node) + n.code.capacity() * sizeof(sock_filter);
+            }
+            for (auto const &e : tenants_) {
+                s.bytes += sizeof(e) + e.first.capacity();
+            }
+            return s;
+        }
+    };
+
+}
+
+// EOF
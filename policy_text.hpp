@@ -0,0 +1,379 @@
+#pragma once
+
+#include <linux/seccomp.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "arg_constants.hpp"
+#include "bpf_disasm.hpp"
+#include "policy.hpp"
+#include "policy_compose.hpp"
+#include "syscall_names.hpp"
+
+/// Policies as text, one rule per line:
+///
+///     # comment
+///     ALLOW write when arg(0) == 0x1
+///     ERRNO(13) openat when (arg(2) & O_ACCMODE) == O_WRONLY
+///     ALLOW mmap when arg(2) lacks PROT_EXEC && arg(3) has MAP_PRIVATE|MAP_ANONYMOUS
+///     ALLOW clone when arg(0) only CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_SIGHAND|CLONE_THREAD
+///     KILL everything else
+///
+/// Actions are named as in the disassembly, system calls by name or number. Values are numbers or
+/// constants (see arg_constants.hpp), joined with | into sets of flags. `has` requires all of the
+/// flags, `lacks` none of them, and `only` allows no others; each is one masked comparison, where
+/// listing the allowed combinations with == would take a rule each. Checks are joined with &&.
+/// The last line sets the default action.
+///
+/// A policy can pull in profiles, other policy files relative to its own, whose rules it merges
+/// with its own (see policy_compose.hpp). Its own rules have precedence 0:
+///
+///     use profiles/base-runtime
+///     use profiles/deny-debugging precedence 10
+
+namespace seccomp {
+
+    namespace policy_text_detail {
+
+        class Parser {
+            char const *p_;
+
+        public:
+            /// The constant value() did not know, if any.
+            std::string unknown;
+
+            explicit Parser(char const *line)
+                : p_(line)
+            {}
+
+            void skip_space()
+            {
+                while (isspace(static_cast<unsigned char>(*p_))) {
+                    p_++;
+                }
+            }
+
+            bool done()
+            {
+                skip_space();
+                return *p_ == '\0' || *p_ == '#';
+            }
+
+            /// Consume s if the line continues with it.
+            bool literal(char const *s)
+            {
+                skip_space();
+                size_t const n = strlen(s);
+                if (strncmp(p_, s, n) != 0) {
+                    return false;
+                }
+                p_ += n;
+                return true;
+            }
+
+            bool number(uint64_t &v)
+            {
+                skip_space();
+                if (!isdigit(static_cast<unsigned char>(*p_))) {
+                    return false;
+                }
+                char *end;
+                errno = 0;
+                v = strtoull(p_, &end, 0);
+                p_ = end;
+                return errno == 0;
+            }
+
+            /// Numbers and constants joined with |.
+            bool value(uint64_t &v)
+            {
+                v = 0;
+                do {
+                    uint64_t term;
+                    if (!number(term)) {
+                        std::string const name = word();
+                        if (name.empty()) {
+                            return false;
+                        }
+                        if (!arg_constant(name.c_str(), term)) {
+                            unknown = name;
+                            return false;
+                        }
+                    }
+                    v |= term;
+                } while (literal("|"));
+                return true;
+            }
+
+            /// Up to the next space.
+            std::string token()
+            {
+                skip_space();
+                char const *begin = p_;
+                while (*p_ != '\0' && !isspace(static_cast<unsigned char>(*p_))) {
+                    p_++;
+                }
+                return std::string(begin, p_);
+            }
+
+            bool signed_number(long long &v)
+            {
+                bool const negative = literal("-");
+                uint64_t u;
+                if (!number(u) || u > uint64_t(LLONG_MAX)) {
+                    return false;
+                }
+                v = negative ? -(long long)u : (long long)u;
+                return true;
+            }
+
+            std::string word()
+            {
+                skip_space();
+                char const *begin = p_;
+                while (isalnum(static_cast<unsigned char>(*p_)) || *p_ == '_') {
+                    p_++;
+                }
+                return std::string(begin, p_);
+            }
+
+            bool action(uint32_t &k)
+            {
+                uint64_t v;
+                if (number(v)) {
+                    k = uint32_t(v);
+                    return v <= UINT32_MAX;
+                }
+
+                std::string const name = word();
+                struct { char const *name; uint32_t action; bool data; } const actions[] = {
+                    { "ALLOW", SECCOMP_RET_ALLOW, false },
+                    { "KILL", SECCOMP_RET_KILL_THREAD, false },
+                    { "KILL_PROCESS", SECCOMP_RET_KILL_PROCESS, false },
+                    { "LOG", SECCOMP_RET_LOG, false },
+                    { "USER_NOTIF", SECCOMP_RET_USER_NOTIF, false },
+                    { "TRAP", SECCOMP_RET_TRAP, true },
+                    { "ERRNO", SECCOMP_RET_ERRNO, true },
+                    { "TRACE", SECCOMP_RET_TRACE, true },
+                };
+                for (auto const &a : actions) {
+                    if (name != a.name) {
+                        continue;
+                    }
+                    v = 0;
+                    if (a.data && !(literal("(") && number(v) && v <= SECCOMP_RET_DATA && literal(")"))) {
+                        return false;
+                    }
+                    k = a.action | uint32_t(v);
+                    return true;
+                }
+                return false;
+            }
+
+            /// arg(N) == V, (arg(N) & M) == V, or arg(N) has, lacks or only FLAGS
+            bool check(ArgCheck &c)
+            {
+                uint64_t index;
+                bool const masked = literal("(");
+                if (!literal("arg") || !literal("(") || !number(index) || index >= 6 || !literal(")")) {
+                    return false;
+                }
+                c.index = unsigned(index);
+                c.mask = ~0ULL;
+                if (masked) {
+                    return literal("&") && value(c.mask) && literal(")") && literal("==") && value(c.value);
+                }
+
+                uint64_t flags;
+                if (literal("has")) {
+                    if (!value(flags)) {
+                        return false;
+                    }
+                    c.mask = c.value = flags;
+                    return true;
+                }
+                if (literal("lacks")) {
+                    if (!value(flags)) {
+                        return false;
+                    }
+                    c.mask = flags;
+                    c.value = 0;
+                    return true;
+                }
+                if (literal("only")) {
+                    if (!value(flags)) {
+                        return false;
+                    }
+                    c.mask = ~flags;
+                    c.value = 0;
+                    return true;
+                }
+                return literal("==") && value(c.value);
+            }
+        };
+
+    }
+
+    namespace policy_text_detail {
+
+        /// Profiles may use profiles, but not forever.
+        unsigned const max_depth = 8;
+
+        inline bool read(char const *path, unsigned depth, Policy &policy, std::string &error)
+        {
+            FILE *f = fopen(path, "r");
+            if (f == nullptr) {
+                error = std::string(path) + ": " + strerror(errno);
+                return false;
+            }
+
+            std::string const file = path;
+            std::string const dir = file.find('/') == std::string::npos ? "." : file.substr(0, file.rfind('/'));
+            std::vector<PolicyProfile> profiles { { file, 0, {} } };
+
+            policy = Policy();
+            char buf[4096];
+            unsigned line = 0;
+            bool ok = true;
+
+            while (ok && fgets(buf, sizeof(buf), f) != nullptr) {
+                line++;
+                Parser p(buf);
+                if (p.done()) {
+                    continue;
+                }
+
+                auto const fail = [&] (std::string const &what) {
+                    error = file + ":" + std::to_string(line) + ": " + what;
+                    ok = false;
+                };
+
+                if (p.literal("use ")) {
+                    PolicyProfile profile;
+                    profile.name = p.token();
+                    long long precedence = 0;
+                    if (p.literal("precedence") && !p.signed_number(precedence)) {
+                        fail("expected a number after precedence");
+                        continue;
+                    }
+                    if (profile.name.empty() || !p.done()) {
+                        fail("expected 'use PROFILE [precedence N]'");
+                        continue;
+                    }
+                    if (depth >= max_depth) {
+                        fail("profiles nest too deep, do they use each other?");
+                        continue;
+                    }
+
+                    Policy used;
+                    if (!read((dir + "/" + profile.name + ".policy").c_str(), depth + 1, used, error)) {
+                        fail(error);
+                        continue;
+                    }
+                    profile.precedence = int(precedence);
+                    profile.rules = std::move(used.rules);
+                    profiles.push_back(std::move(profile));
+                    continue;
+                }
+
+                uint32_t action;
+                if (!p.action(action)) {
+                    fail("expected an action, e.g. ALLOW or ERRNO(1)");
+                    continue;
+                }
+
+                uint64_t nr;
+                if (p.literal("everything")) {
+                    policy.default_action = action;
+                    if (!p.literal("else") || !p.done()) {
+                        fail("expected 'everything else'");
+                    }
+                    continue;
+                }
+                if (!p.number(nr)) {
+                    std::string const name = p.word();
+                    long const n = syscall_number(name.c_str());
+                    if (n < 0) {
+                        fail(name.empty() ? "expected a system call" : "unknown system call " + name);
+                        continue;
+                    }
+                    nr = uint64_t(n);
+                }
+
+                std::vector<ArgCheck> checks;
+                if (p.literal("when")) {
+                    do {
+                        ArgCheck c;
+                        if (!p.check(c)) {
+                            fail(!p.unknown.empty() ? "unknown constant " + p.unknown :
+                                 "expected arg(N) == VALUE, (arg(N) & MASK) == VALUE or arg(N) has, lacks or only FLAGS");
+                            break;
+                        }
+                        checks.push_back(c);
+                    } while (p.literal("&&"));
+                }
+                if (ok && !p.done()) {
+                    fail("unexpected text after the rule");
+                }
+                if (ok) {
+                    profiles.front().rules.push_back({ uint32_t(nr), checks, action });
+                }
+            }
+
+            fclose(f);
+            if (!ok) {
+                return false;
+            }
+
+            Policy composed;
+            if (!compose(profiles, policy.default_action, composed, error)) {
+                error = file + ": " + error;
+                return false;
+            }
+            policy = std::move(composed);
+            return true;
+        }
+
+    }
+
+    /// Parse the policy in path, and the profiles it uses. On failure, error says where and why.
+    inline bool read_policy(char const *path, Policy &policy, std::string &error)
+    {
+        return policy_text_detail::read(path, 0, policy, error);
+    }
+
+    /// The format read_policy() reads.
+    inline void write_policy(FILE *out, Policy const &p)
+    {
+        for (PolicyRule const &r : p.rules) {
+            char const *name = syscall_name(r.nr);
+            fprintf(out, "%s %s", action_name(r.action).c_str(),
+                    name ? name : std::to_string(r.nr).c_str());
+
+            for (size_t i = 0; i < r.checks.size(); i++) {
+                ArgCheck const &c = r.checks[i];
+                fprintf(out, i ? " && " : " when ");
+                if (c.mask == ~0ULL) {
+                    fprintf(out, "arg(%u) == %#" PRIx64, c.index, c.value);
+                } else {
+                    fprintf(out, "(arg(%u) & %#" PRIx64 ") == %#" PRIx64, c.index, c.mask, c.value);
+                }
+            }
+            fprintf(out, "\n");
+        }
+        fprintf(out, "%s everything else\n", action_name(p.default_action).c_str());
+    }
+
+}
+
+// EOF
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/// A pointer to an immutable object that readers follow without locks while writers replace it,
+/// in the manner of read-copy-update.
+///
+/// Readers announce themselves on the counter of the current phase, one of two, before they load
+/// the pointer. A writer swaps the pointer, starts the next phase and waits until the counter of
+/// the old one drains: every reader that could have seen the old object is then done with it, and
+/// it is deleted. A reader that counted itself in a phase that ended meanwhile tries again, so no
+/// late reader is missed. Readers never block; only writers do, for as long as the slowest reader
+/// that was already inside.
+
+namespace seccomp {
+
+    template <typename T>
+    class RcuPointer {
+        struct alignas(64) Counter {  // one cache line each
+            std::atomic<uint64_t> readers { 0 };
+        };
+
+        std::atomic<T const *> current_;
+        std::atomic<unsigned> phase_ { 0 };
+        mutable Counter counters_[2];
+        std::mutex writers_;
+
+    public:
+        /// Keeps the object it was created with alive until it goes away. Do not hold on to it:
+        /// writers wait for it.
+        class Reader {
+            Counter *counter_;
+            T const *object_;
+
+        public:
+            explicit Reader(RcuPointer const &p)
+            {
+                for (;;) {
+                    unsigned const phase = p.phase_.load();
+                    counter_ = &p.counters_[phase & 1];
+                    counter_->readers++;
+                    if (p.phase_.load() == phase) {
+                        break;
+                    }
+                    counter_->readers--;
+                }
+                object_ = p.current_.load();
+            }
+
+            Reader(Reader &&o) noexcept
+                : counter_(o.counter_), object_(o.object_)
+            {
+                o.counter_ = nullptr;
+            }
+
+            Reader(Reader const &) = delete;
+            Reader &operator=(Reader const &) = delete;
+
+            ~Reader()
+            {
+                if (counter_ != nullptr) {
+                    counter_->readers--;
+                }
+            }
+
+            T const &operator*() const { return *object_; }
+            T const *operator->() const { return object_; }
+        };
+
+        explicit RcuPointer(std::unique_ptr<T const> initial)
+            : current_(initial.release())
+        {}
+
+        RcuPointer(RcuPointer const &) = delete;
+        RcuPointer &operator=(RcuPointer const &) = delete;
+
+        ~RcuPointer()
+        {
+            delete current_.load();
+        }
+
+        Reader read() const
+        {
+            return Reader(*this);
+        }
+
+        /// Make object the one new readers see, and delete the old one once no reader uses it.
+        void publish(std::unique_ptr<T const> object)
+        {
+            std::lock_guard<std::mutex> l(writers_);
+            std::unique_ptr<T const> const old(current_.exchange(object.release()));
+
+            // Readers that count themselves from now on can only see the new object.
+            unsigned const phase = phase_.fetch_add(1) & 1;
+            while (counters_[phase].readers.load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+    };
+
+}
+
+// EOF
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <functional>
+#include <vector>
+#include <utility>
+
+
+#define BPF_SYS_WHITELIST(nr)                                       \
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nr, 0, 1),                  \
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+namespace seccomp {
+
+    [[noreturn]] inline void die_errno(const char *msg)
+    {
+        perror(msg);
+        exit(EXIT_FAILURE);
+    }
+
+    /// Close every file descriptor above stderr but keep, e.g. in a child that should only have
+    /// what it is given.
+    inline void close_fds_above_stderr_but(int keep)
+    {
+        unsigned const fd = unsigned(keep);
+        if ((fd > 3 && syscall(SYS_close_range, 3u, fd - 1, 0u) != 0) ||
+            syscall(SYS_close_range, fd + 1, ~0u, 0u) != 0) {
+            die_errno("close_range");
+        }
+    }
+
+    class ForkedChild {
+
+        pid_t child_ = 0;
+
+        enum {
+            NOT_STARTED,
+            STARTED,
+            FINISHED,
+        } state = NOT_STARTED;
+
+        int child_main(std::function<int()> const &fn)
+        {
+            prepare_child();
+            return fn();
+        }
+
+    protected:
+
+        virtual void prepare_child()
+        {
+            // Default does nothing.
+        }
+
+    public:
+
+        void run(std::function<int()> const &fn)
+        {
+            if (!try_run(fn)) {
+                die_errno("fork");
+            }
+        }
+
+        /// As run(), but returns false with errno set if the fork fails, e.g. with EAGAIN when there
+        /// are too many processes. The child is then still not started.
+        bool try_run(std::function<int()> const &fn)
+        {
+            child_ = fork();
+
+            if (child_ < 0) {
+                return false;
+            }
+
+            if (child_ == 0) {
+                _exit(child_main(fn));
+            }
+            state = STARTED;
+            return true;
+        }
+
+        /// The child's process id, once run() has been called.
+        pid_t pid() const { return child_; }
+
+        /// Wait for the child to finish. Can only be called when the child was actually started with
+        /// run(). Will be automatically called by the destructor, if it hasn't been called before.
+        int wait_for_child()
+        {
+            assert(state == STARTED);
+            state = FINISHED;
+
+            int status = 0;
+            waitpid(child_, &status, 0);
+            return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+
+        ForkedChild() = default;
+
+        ForkedChild(ForkedChild const &) = delete;
+        ForkedChild &operator=(ForkedChild const &) = delete;
+
+        virtual ~ForkedChild()
+        {
+            switch (state) {
+            case STARTED:
+                wait_for_child();
+                break;
+            default:
+                // Nothing to do.
+                break;
+            }
+        }
+    };
+
+
+    class SeccompChild final : public ForkedChild {
+
+        /// Where the code for each entry begins in seccomp_filter, followed by where the last one
+        /// ends.
+        std::vector<size_t> rule_bounds_;
+
+        /// The one descriptor above stderr the child keeps, if close_fds_but() was called.
+        int keep_fd_ = -1;
+
+        std::vector<sock_filter> seccomp_filter {
+            // Check architecture.
+            BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, arch))),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   AUDIT_ARCH_X86_64, 1, 0),
+            BPF_STMT(BPF_RET | BPF_K,             SECCOMP_RET_KILL),
+        };
+
+        void extend_all()
+        {
+            rule_bounds_.push_back(seccomp_filter.size());
+        }
+
+        template <typename FIRST, typename... REST>
+        void extend_all(FIRST const &first, REST const &... rest)
+        {
+            rule_bounds_.push_back(seccomp_filter.size());
+            first.push_into(seccomp_filter);
+            extend_all(rest...);
+        }
+
+
+    protected:
+
+        void prepare_child() override
+        {
+            if (keep_fd_ >= 0) {
+                close_fds_above_stderr_but(keep_fd_);
+            }
+
+            unsigned short len = seccomp_filter.size();
+            assert(len == seccomp_filter.size());
+
+            const sock_fprog prog = {
+                .len = len,
+                .filter = seccomp_filter.data(),
+            };
+
+            // We need to do this, otherwise PR_SET_SECCOMP will fail with EACCES.
+            if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+                die_errno("PR_SET_NO_NEW_PRIVS");
+            }
+
+            if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0) != 0) {
+                die_errno("PR_SET_SECCOMP");
+            }
+
+        }
+
+    public:
+
+        /// Have the child close every descriptor above stderr but fd before its filter is
+        /// installed, so that it cannot use what it inherited.
+        void close_fds_but(int fd)
+        {
+            assert(fd > STDERR_FILENO);
+            keep_fd_ = fd;
+        }
+
+        /// Install a filter that was compiled elsewhere.
+        explicit SeccompChild(std::vector<sock_filter> const &filter)
+            : seccomp_filter(filter)
+        {}
+
+        template <typename... TYPES>
+        explicit SeccompChild(const TYPES &... entries)
+        {
+            // Load syscall number.
+            seccomp_filter.push_back(BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, (offsetof(struct seccomp_data, nr))));
+
+            extend_all(entries...);
+
+
+            // for (unsigned sysnr : sys_whitelist) {
+            //     extend_filter(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr, 0, 1));
+            //     extend_filter(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+            // }
+
+            // for (auto t : sys_errno) {
+            //     extend_filter(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, t.first, 0, 1));
+            //     extend_filter(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (t.second & SECCOMP_RET_DATA)));
+            // }
+
+            // Finalize filter.
+            seccomp_filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL));
+        }
+
+        /// The filter that will be installed in the child. Can be modified until run() is called.
+        std::vector<sock_filter> &filter() { return seccomp_filter; }
+
+        /// Offsets in filter() where each entry passed to the constructor begins, followed by where
+        /// the last one ends. Only meaningful as long as filter() has not been rewritten.
+        std::vector<size_t> const &rule_bounds() const { return rule_bounds_; }
+    };
+
+    class SeccompWhitelist {
+        unsigned sysnr_;
+
+    public:
+        explicit SeccompWhitelist(unsigned sysnr)
+            : sysnr_(sysnr)
+        {}
+
+        template <typename VECTOR>
+        void push_into(VECTOR &v) const
+        {
+            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))));
+            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr_, 0, 1));
+            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+        }
+    };
+
+    class SeccompWhitelistWithArg {
+        unsigned sysnr_;
+        uint64_t arg0_;
+
+    public:
+        explicit SeccompWhitelistWithArg(unsigned sysnr, uint64_t arg0)
+            : sysnr_(sysnr), arg0_(arg0)
+        {}
+
+        template <typename VECTOR>
+        void push_into(VECTOR &v) const
+        {
+            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))));
+            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, sysnr_, 0, 6));
+
+            // First half of arg
+            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, args))));
+            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(arg0_), 0, 3));
+
+            // Second half of arg
+            v.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, sizeof(uint32_t) + (offsetof(struct seccomp_data, args))));
+            v.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(arg0_ >> 32), 0, 1));
+
+            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+            v.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL));
+        }
+    };
+
+}
+
+// EOF
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed set of worker threads that run numbered tasks.
+///
+/// Each worker starts with an equal share of the tasks as a range [begin, end) packed into one
+/// atomic word. It takes tasks from the front of its own range, and when that is empty steals the
+/// back half of the largest range it finds. Taking or stealing is a single compare-and-swap, so
+/// there are no locks while tasks run.
+
+namespace seccomp {
+
+    class WorkStealingPool {
+        struct Range {
+            std::atomic<uint64_t> bounds { 0 };
+            char pad[64 - sizeof(bounds)];  // one cache line each
+        };
+
+        static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t(end) << 32) | begin; }
+        static uint32_t begin_of(uint64_t r) { return uint32_t(r); }
+        static uint32_t end_of(uint64_t r) { return uint32_t(r >> 32); }
+
+        unsigned const workers_;
+        std::unique_ptr<Range[]> ranges_;
+        std::vector<std::thread> threads_;
+
+        std::mutex lock_;
+        std::condition_variable start_;
+        std::condition_variable finished_;
+        uint64_t generation_ = 0;
+        unsigned running_ = 0;
+        bool stop_ = false;
+        std::function<void(unsigned, size_t)> const *job_ = nullptr;
+
+        bool take(unsigned worker, uint32_t &task)
+        {
+            std::atomic<uint64_t> &mine = ranges_[worker].bounds;
+            uint64_t r = mine.load(std::memory_order_relaxed);
+
+            while (begin_of(r) < end_of(r)) {
+                if (mine.compare_exchange_weak(r, pack(begin_of(r) + 1, end_of(r)))) {
+                    task = begin_of(r);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// Move the back half of the fullest other range into ours. ours is empty, so nobody else
+        /// writes it: thieves only steal from ranges with work left.
+        bool steal(unsigned worker)
+        {
+            for (;;) {
+                unsigned victim = worker;
+                uint32_t most = 0;
+                for (unsigned w = 0; w < workers_; w++) {
+                    uint64_t const r = ranges_[w].bounds.load(std::memory_order_relaxed);
+                    if (w != worker && end_of(r) > begin_of(r) && end_of(r) - begin_of(r) > most) {
+                        victim = w;
+                        most = end_of(r) - begin_of(r);
+                    }
+                }
+                if (victim == worker) {
+                    return false;
+                }
+
+                std::atomic<uint64_t> &theirs = ranges_[victim].bounds;
+                uint64_t r = theirs.load(std::memory_order_relaxed);
+                if (begin_of(r) >= end_of(r)) {
+                    continue;
+                }
+
+                uint32_t const mid = end_of(r) - (end_of(r) - begin_of(r) + 1) / 2;
+                if (theirs.compare_exchange_strong(r, pack(begin_of(r), mid))) {
+                    ranges_[worker].bounds.store(pack(mid, end_of(r)));
+                    return true;
+                }
+            }
+        }
+
+        void work(unsigned worker)
+        {
+            uint64_t seen = 0;
+
+            for (;;) {
+                std::function<void(unsigned, size_t)> const *job;
+                {
+                    std::unique_lock<std::mutex> l(lock_);
+                    start_.wait(l, [&] { return stop_ || generation_ != seen; });
+                    if (stop_) {
+                        return;
+                    }
+                    seen = generation_;
+                    job = job_;
+                }
+
+                uint32_t task;
+                for (;;) {
+                    if (take(worker, task)) {
+                        (*job)(worker, task);
+                    } else if (!steal(worker)) {
+                        break;
+                    }
+                }
+
+                std::lock_guard<std::mutex> l(lock_);
+                if (--running_ == 0) {
+                    finished_.notify_all();
+                }
+            }
+        }
+
+    public:
+        /// threads = 0 uses one per CPU.
+        explicit WorkStealingPool(unsigned threads = 0)
+            : workers_(std::max(1u, threads ? threads : std::thread::hardware_concurrency()))
+        {
+            ranges_.reset(new Range[workers_]);
+            for (unsigned w = 0; w < workers_; w++) {
+                threads_.emplace_back([this, w] { work(w); });
+            }
+        }
+
+        WorkStealingPool(WorkStealingPool const &) = delete;
+        WorkStealingPool &operator=(WorkStealingPool const &) = delete;
+
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                stop_ = true;
+            }
+            start_.notify_all();
+            for (std::thread &t : threads_) {
+                t.join();
+            }
+        }
+
+        unsigned workers() const { return workers_; }
+
+        /// Call fn(worker, task) for every task in [0, tasks) and wait for all of them. worker is
+        /// below workers(), and no two calls with the same worker run at the same time, so it can
+        /// index per-thread state. Tasks beyond 2^32 - 1 are not supported.
+        void run(size_t tasks, std::function<void(unsigned, size_t)> const &fn)
+        {
+            uint32_t const n = uint32_t(std::min<size_t>(tasks, UINT32_MAX));
+
+            for (unsigned w = 0; w < workers_; w++) {
+                ranges_[w].bounds.store(pack(uint64_t(n) * w / workers_, uint64_t(n) * (w + 1) / workers_));
+            }
+
+            std::unique_lock<std::mutex> l(lock_);
+            job_ = &fn;
+            running_ = workers_;
+            generation_++;
+            start_.notify_all();
+            finished_.wait(l, [&] { return running_ == 0; });
+            job_ = nullptr;
+        }
+    };
+
+}
+
+// EOF
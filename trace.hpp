@@ -0,0 +1,687 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/audit.h>
+#include <linux/seccomp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "seccomp_child.hpp"
+
+/// A compact binary format for recorded system calls.
+///
+/// Records are grouped into blocks. Within a block every record is stored relative to the one
+/// before it (varint encoded deltas, arguments that are zero are left out) and the block is then
+/// compressed with zlib. Blocks are independent of each other, and an index at the end of the file
+/// lists where each block starts, its first timestamp and the number of its first record. That way
+/// a trace can be mmap'ed and any part of it decoded without touching the rest.
+///
+///     header   "SCTRACE\0", version, flags
+///     block*   BlockHeader, payload
+///     index    IndexHeader, IndexEntry*
+///     trailer  index offset, record count, "SCTREND\0"
+///
+/// All integers are little endian, like the machines this runs on.
+
+namespace seccomp {
+
+    struct TraceRecord {
+        uint64_t timestamp;
+        uint32_t pid;
+        uint32_t nr;
+        uint32_t arch;
+        uint64_t args[6];
+
+        /// What the filter saw for this call. The instruction pointer is not recorded.
+        seccomp_data data() const
+        {
+            seccomp_data d {};
+            d.nr = nr;
+            d.arch = arch;
+            std::copy(args, args + 6, d.args);
+            return d;
+        }
+    };
+
+    namespace trace_format {
+
+        char const file_magic[8] = { 'S', 'C', 'T', 'R', 'A', 'C', 'E', 0 };
+        char const end_magic[8]  = { 'S', 'C', 'T', 'R', 'E', 'N', 'D', 0 };
+        uint32_t const version = 1;
+        uint32_t const block_magic = 0x4b424353;  // "SCBK"
+        uint32_t const index_magic = 0x58494353;  // "SCIX"
+
+        enum Encoding : uint32_t {
+            RAW  = 0,
+            ZLIB = 1,
+        };
+
+        struct FileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t flags;
+        };
+
+        struct BlockHeader {
+            uint32_t magic;
+            uint32_t records;
+            uint32_t raw_size;
+            uint32_t stored_size;
+            uint32_t encoding;
+            uint32_t reserved;
+            uint64_t first_timestamp;
+            uint64_t last_timestamp;
+        };
+
+        struct IndexHeader {
+            uint32_t magic;
+            uint32_t reserved;
+            uint64_t blocks;
+        };
+
+        struct IndexEntry {
+            uint64_t offset;
+            uint64_t first_timestamp;
+            uint64_t first_record;
+        };
+
+        struct Trailer {
+            uint64_t index_offset;
+            uint64_t records;
+            char magic[8];
+        };
+
+        enum Flags : uint8_t {
+            PID_CHANGED  = 1 << 0,
+            ARCH_CHANGED = 1 << 1,
+            // Bits 2 to 7: argument i is not zero.
+            ARG_SHIFT    = 2,
+        };
+
+        inline uint64_t zigzag(uint64_t now, uint64_t before)
+        {
+            int64_t const d = static_cast<int64_t>(now - before);
+            return (static_cast<uint64_t>(d) << 1) ^ static_cast<uint64_t>(d >> 63);
+        }
+
+        inline uint64_t unzigzag(uint64_t v, uint64_t before)
+        {
+            return before + ((v >> 1) ^ (~(v & 1) + 1));
+        }
+
+        inline void put_varint(std::vector<uint8_t> &out, uint64_t v)
+        {
+            while (v >= 0x80) {
+                out.push_back(static_cast<uint8_t>(v) | 0x80);
+                v >>= 7;
+            }
+            out.push_back(static_cast<uint8_t>(v));
+        }
+
+        /// Returns false when running off the end or on overlong encodings.
+        inline bool get_varint(uint8_t const *&p, uint8_t const *end, uint64_t &v)
+        {
+            v = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                if (p == end) {
+                    return false;
+                }
+                uint8_t const b = *p++;
+                v |= uint64_t(b & 0x7f) << shift;
+                if (!(b & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// Delta state shared by the encoder and decoder. It starts over with every block.
+        struct DeltaState {
+            uint64_t timestamp = 0;
+            uint32_t pid = 0;
+            uint32_t arch = 0;
+            uint64_t args[6] = {};
+        };
+
+        inline void encode(std::vector<uint8_t> &out, DeltaState &s, TraceRecord const &r)
+        {
+            uint8_t flags = 0;
+            flags |= r.pid != s.pid ? PID_CHANGED : 0;
+            flags |= r.arch != s.arch ? ARCH_CHANGED : 0;
+            for (unsigned i = 0; i < 6; i++) {
+                flags |= r.args[i] != 0 ? (1u << (ARG_SHIFT + i)) : 0;
+            }
+
+            out.push_back(flags);
+            put_varint(out, r.nr);
+            put_varint(out, zigzag(r.timestamp, s.timestamp));
+            if (flags & PID_CHANGED) {
+                put_varint(out, zigzag(r.pid, s.pid));
+            }
+            if (flags & ARCH_CHANGED) {
+                put_varint(out, r.arch);
+            }
+            for (unsigned i = 0; i < 6; i++) {
+                if (flags & (1u << (ARG_SHIFT + i))) {
+                    put_varint(out, zigzag(r.args[i], s.args[i]));
+                }
+                s.args[i] = r.args[i];
+            }
+
+            s.timestamp = r.timestamp;
+            s.pid = r.pid;
+            s.arch = r.arch;
+        }
+
+        inline bool decode(uint8_t const *&p, uint8_t const *end, DeltaState &s, TraceRecord &r)
+        {
+            if (p == end) {
+                return false;
+            }
+
+            uint8_t const flags = *p++;
+            uint64_t v;
+
+            if (!get_varint(p, end, v)) {
+                return false;
+            }
+            r.nr = static_cast<uint32_t>(v);
+
+            if (!get_varint(p, end, v)) {
+                return false;
+            }
+            r.timestamp = s.timestamp = unzigzag(v, s.timestamp);
+
+            if (flags & PID_CHANGED) {
+                if (!get_varint(p, end, v)) {
+                    return false;
+                }
+                s.pid = static_cast<uint32_t>(unzigzag(v, s.pid));
+            }
+            r.pid = s.pid;
+
+            if (flags & ARCH_CHANGED) {
+                if (!get_varint(p, end, v)) {
+                    return false;
+                }
+                s.arch = static_cast<uint32_t>(v);
+            }
+            r.arch = s.arch;
+
+            for (unsigned i = 0; i < 6; i++) {
+                if (flags & (1u << (ARG_SHIFT + i))) {
+                    if (!get_varint(p, end, v)) {
+                        return false;
+                    }
+                    s.args[i] = unzigzag(v, s.args[i]);
+                } else {
+                    s.args[i] = 0;
+                }
+                r.args[i] = s.args[i];
+            }
+
+            return true;
+        }
+
+        /// Turn a stored block payload back into records. `scratch` keeps its memory between
+        /// calls. Returns false if the block is corrupt.
+        inline bool decode_block(BlockHeader const &h, uint8_t const *payload,
+                                 std::vector<uint8_t> &scratch, std::vector<TraceRecord> &out)
+        {
+            uint8_t const *raw = payload;
+
+            // Every record takes a few bytes, and deflate cannot shrink anything more than 1032
+            // times, so sizes beyond that are not allocated for.
+            if (h.records > h.raw_size || (h.encoding == ZLIB && h.raw_size / 1032 > h.stored_size)) {
+                return false;
+            }
+
+            if (h.encoding == ZLIB) {
+                scratch.resize(h.raw_size);
+                uLongf len = h.raw_size;
+                if (uncompress(scratch.data(), &len, payload, h.stored_size) != Z_OK || len != h.raw_size) {
+                    return false;
+                }
+                raw = scratch.data();
+            } else if (h.encoding != RAW || h.raw_size != h.stored_size) {
+                return false;
+            }
+
+            uint8_t const *p = raw;
+            uint8_t const *const end = raw + h.raw_size;
+            DeltaState s;
+
+            out.resize(h.records);
+            for (TraceRecord &r : out) {
+                if (!decode(p, end, s, r)) {
+                    return false;
+                }
+            }
+            return p == end;
+        }
+
+        [[noreturn]] inline void die_corrupt(char const *path)
+        {
+            fprintf(stderr, "%s: corrupt trace\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+    struct TraceOptions {
+        /// Records per block. Smaller blocks make seeking cheaper, larger ones compress better.
+        uint32_t block_records = 4096;
+
+        /// zlib level, 0 stores blocks uncompressed.
+        int compression = 6;
+
+        /// Applied to arguments before they are stored. Pointers are different in every run and
+        /// only cost space, so a supervisor usually masks them out.
+        uint64_t arg_mask[6] = { ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL, ~0ULL };
+    };
+
+    /// Appends records to a trace file. Not thread-safe.
+    class TraceWriter {
+        FILE *f_;
+        TraceOptions const opts_;
+
+        std::vector<uint8_t> raw_;
+        std::vector<uint8_t> packed_;
+        trace_format::DeltaState state_;
+        trace_format::BlockHeader block_ {};
+
+        std::vector<trace_format::IndexEntry> index_;
+        uint64_t records_ = 0;
+        uint64_t offset_ = 0;
+
+        void write(void const *data, size_t len)
+        {
+            if (fwrite(data, 1, len, f_) != len) {
+                die_errno("trace write");
+            }
+            offset_ += len;
+        }
+
+        void flush_block()
+        {
+            using namespace trace_format;
+
+            if (block_.records == 0) {
+                return;
+            }
+
+            block_.magic = block_magic;
+            block_.raw_size = raw_.size();
+            block_.encoding = RAW;
+            block_.stored_size = raw_.size();
+            uint8_t const *payload = raw_.data();
+
+            if (opts_.compression > 0) {
+                uLongf len = compressBound(raw_.size());
+                packed_.resize(len);
+                if (compress2(packed_.data(), &len, raw_.data(), raw_.size(), opts_.compression) == Z_OK &&
+                    len < raw_.size()) {
+                    block_.encoding = ZLIB;
+                    block_.stored_size = len;
+                    payload = packed_.data();
+                }
+            }
+
+            index_.push_back({ offset_, block_.first_timestamp, records_ - block_.records });
+            write(&block_, sizeof(block_));
+            write(payload, block_.stored_size);
+
+            raw_.clear();
+            state_ = DeltaState();
+            block_ = BlockHeader();
+        }
+
+    public:
+        explicit TraceWriter(char const *path, TraceOptions const &opts = TraceOptions())
+            : f_(fopen(path, "wb")), opts_(opts)
+        {
+            using namespace trace_format;
+
+            if (f_ == nullptr) {
+                die_errno(path);
+            }
+
+            FileHeader h {};
+            memcpy(h.magic, file_magic, sizeof(h.magic));
+            h.version = version;
+            write(&h, sizeof(h));
+        }
+
+        TraceWriter(TraceWriter const &) = delete;
+        TraceWriter &operator=(TraceWriter const &) = delete;
+
+        ~TraceWriter()
+        {
+            close();
+        }
+
+        void append(TraceRecord r)
+        {
+            for (unsigned i = 0; i < 6; i++) {
+                r.args[i] &= opts_.arg_mask[i];
+            }
+
+            if (block_.records == 0) {
+                block_.first_timestamp = r.timestamp;
+            }
+            block_.last_timestamp = r.timestamp;
+            block_.records++;
+            records_++;
+
+            trace_format::encode(raw_, state_, r);
+
+            if (block_.records >= opts_.block_records) {
+                flush_block();
+            }
+        }
+
+        void append(seccomp_data const &d, uint32_t pid, uint64_t timestamp)
+        {
+            TraceRecord r { timestamp, pid, static_cast<uint32_t>(d.nr), d.arch, {} };
+            std::copy(d.args, d.args + 6, r.args);
+            append(r);
+        }
+
+        /// Write out the current block, so everything appended so far can be read by a
+        /// TraceStream.
+        void flush()
+        {
+            flush_block();
+            if (fflush(f_) != 0) {
+                die_errno("trace flush");
+            }
+        }
+
+        uint64_t records() const { return records_; }
+
+        /// Finish the file with its index. Called by the destructor.
+        void close()
+        {
+            using namespace trace_format;
+
+            if (f_ == nullptr) {
+                return;
+            }
+
+            flush_block();
+
+            Trailer t {};
+            t.index_offset = offset_;
+            t.records = records_;
+            memcpy(t.magic, end_magic, sizeof(t.magic));
+
+            IndexHeader h { index_magic, 0, index_.size() };
+            write(&h, sizeof(h));
+            write(index_.data(), index_.size() * sizeof(IndexEntry));
+            write(&t, sizeof(t));
+
+            if (fclose(f_) != 0) {
+                die_errno("trace close");
+            }
+            f_ = nullptr;
+        }
+    };
+
+    /// Random access to a finished trace through mmap. Decoding is const and can run from many
+    /// threads at once.
+    class TraceReader {
+        char const *path_;
+        uint8_t const *data_ = nullptr;
+        size_t size_ = 0;
+
+        trace_format::IndexEntry const *index_ = nullptr;
+        size_t blocks_ = 0;
+        uint64_t records_ = 0;
+
+        template <typename T>
+        T const *at(uint64_t offset, size_t count = 1) const
+        {
+            if (offset > size_ || count > (size_ - offset) / sizeof(T)) {
+                trace_format::die_corrupt(path_);
+            }
+            return reinterpret_cast<T const *>(data_ + offset);
+        }
+
+    public:
+        explicit TraceReader(char const *path)
+            : path_(path)
+        {
+            using namespace trace_format;
+
+            int const fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                die_errno(path);
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                die_errno(path);
+            }
+            size_ = st.st_size;
+
+            if (size_ < sizeof(FileHeader) + sizeof(Trailer)) {
+                die_corrupt(path);
+            }
+
+            void *m = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) {
+                die_errno(path);
+            }
+            ::close(fd);
+            data_ = static_cast<uint8_t const *>(m);
+
+            FileHeader const *h = at<FileHeader>(0);
+            Trailer const *t = at<Trailer>(size_ - sizeof(Trailer));
+            if (memcmp(h->magic, file_magic, sizeof(h->magic)) != 0 || h->version != version ||
+                memcmp(t->magic, end_magic, sizeof(t->magic)) != 0) {
+                die_corrupt(path);
+            }
+
+            IndexHeader const *ih = at<IndexHeader>(t->index_offset);
+            if (ih->magic != index_magic) {
+                die_corrupt(path);
+            }
+
+            blocks_ = ih->blocks;
+            index_ = at<IndexEntry>(t->index_offset + sizeof(IndexHeader), blocks_);
+            records_ = t->records;
+        }
+
+        TraceReader(TraceReader const &) = delete;
+        TraceReader &operator=(TraceReader const &) = delete;
+
+        ~TraceReader()
+        {
+            munmap(const_cast<uint8_t *>(data_), size_);
+        }
+
+        size_t blocks() const { return blocks_; }
+        uint64_t records() const { return records_; }
+
+        trace_format::IndexEntry const &block(size_t i) const { return index_[i]; }
+
+        size_t block_records(size_t i) const
+        {
+            return at<trace_format::BlockHeader>(index_[i].offset)->records;
+        }
+
+        /// First block that can contain records at or after `timestamp`.
+        size_t find_block(uint64_t timestamp) const
+        {
+            auto const it = std::upper_bound(index_, index_ + blocks_, timestamp,
+                                             [] (uint64_t ts, trace_format::IndexEntry const &e) {
+                                                 return ts < e.first_timestamp;
+                                             });
+            return it == index_ ? 0 : size_t(it - index_) - 1;
+        }
+
+        /// Block that holds record number `n`.
+        size_t find_record(uint64_t n) const
+        {
+            auto const it = std::upper_bound(index_, index_ + blocks_, n,
+                                             [] (uint64_t rec, trace_format::IndexEntry const &e) {
+                                                 return rec < e.first_record;
+                                             });
+            return it == index_ ? 0 : size_t(it - index_) - 1;
+        }
+
+        /// Decode block i into out. scratch is reused between calls to avoid allocations.
+        void decode(size_t i, std::vector<TraceRecord> &out, std::vector<uint8_t> &scratch) const
+        {
+            using namespace trace_format;
+
+            BlockHeader const *h = at<BlockHeader>(index_[i].offset);
+            uint8_t const *payload = at<uint8_t>(index_[i].offset + sizeof(BlockHeader), h->stored_size);
+
+            if (h->magic != block_magic || !decode_block(*h, payload, scratch, out)) {
+                die_corrupt(path_);
+            }
+        }
+
+        /// Call fn for every record of blocks [begin, end).
+        template <typename FN>
+        void for_each(size_t begin, size_t end, FN &&fn) const
+        {
+            std::vector<TraceRecord> records;
+            std::vector<uint8_t> scratch;
+
+            for (size_t i = begin; i < end && i < blocks_; i++) {
+                decode(i, records, scratch);
+                for (TraceRecord const &r : records) {
+                    fn(r);
+                }
+            }
+        }
+
+        template <typename FN>
+        void for_each(FN &&fn) const
+        {
+            for_each(0, blocks_, fn);
+        }
+    };
+
+    /// Reads a trace front to back without the index, e.g. from a pipe or while it is still being
+    /// written. A block that is not all there yet ends the records for now; next() reads it once
+    /// it is, unless the trace comes from a pipe.
+    class TraceStream {
+        FILE *f_;
+        char const *path_;
+        bool owned_;
+
+        std::vector<TraceRecord> records_;
+        std::vector<uint8_t> payload_;
+        std::vector<uint8_t> scratch_;
+        size_t next_ = 0;
+
+        /// Go back to where a block began, so that it is read again once more of it is there.
+        /// Not possible on a pipe.
+        bool retry_from(off_t start)
+        {
+            clearerr(f_);
+            return start >= 0 && fseeko(f_, start, SEEK_SET) == 0;
+        }
+
+        bool read_block()
+        {
+            using namespace trace_format;
+
+            off_t const start = ftello(f_);
+            BlockHeader h;
+            if (fread(&h, sizeof(h), 1, f_) != 1 || h.magic != block_magic) {
+                // End of file, a block still being written or the index.
+                retry_from(start);
+                return false;
+            }
+
+            // Grown as the payload arrives, so that a garbled size cannot allocate more than
+            // the file holds.
+            payload_.clear();
+            while (payload_.size() < h.stored_size) {
+                size_t const done = payload_.size();
+                size_t const want = std::min<size_t>(h.stored_size - done, 1 << 20);
+                payload_.resize(done + want);
+                if (fread(payload_.data() + done, 1, want, f_) != want) {
+                    if (retry_from(start)) {
+                        return false;
+                    }
+                    die_corrupt(path_);
+                }
+            }
+            if (!decode_block(h, payload_.data(), scratch_, records_)) {
+                die_corrupt(path_);
+            }
+            next_ = 0;
+            return true;
+        }
+
+        static FILE *open_or_die(char const *path)
+        {
+            FILE *f = fopen(path, "rb");
+            if (f == nullptr) {
+                die_errno(path);
+            }
+            return f;
+        }
+
+    public:
+        /// Read from an already open file, e.g. stdin.
+        TraceStream(FILE *f, char const *name)
+            : f_(f), path_(name), owned_(false)
+        {
+            using namespace trace_format;
+
+            FileHeader h;
+            if (fread(&h, sizeof(h), 1, f_) != 1 || memcmp(h.magic, file_magic, sizeof(h.magic)) != 0 ||
+                h.version != version) {
+                die_corrupt(path_);
+            }
+        }
+
+        explicit TraceStream(char const *path)
+            : TraceStream(open_or_die(path), path)
+        {
+            owned_ = true;
+        }
+
+        TraceStream(TraceStream const &) = delete;
+        TraceStream &operator=(TraceStream const &) = delete;
+
+        ~TraceStream()
+        {
+            if (owned_) {
+                fclose(f_);
+            }
+        }
+
+        /// Next record, or false at the end of what has been written so far.
+        bool next(TraceRecord &r)
+        {
+            while (next_ == records_.size()) {
+                if (!read_block()) {
+                    return false;
+                }
+            }
+
+            r = records_[next_++];
+            return true;
+        }
+    };
+
+}
+
+// EOF
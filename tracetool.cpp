@@ -0,0 +1,187 @@
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/audit.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "syscall_names.hpp"
+#include "trace.hpp"
+
+namespace {
+
+    using seccomp::TraceRecord;
+
+    struct Call {
+        long nr;
+        unsigned weight;
+        uint64_t args[6];
+    };
+
+    // A server-like mix. Pointer arguments are zero, as a supervisor that masks them records them.
+    std::vector<Call> const workload {
+        { SYS_read,         30, { 5, 0, 4096 } },
+        { SYS_write,        25, { 1, 0, 128 } },
+        { SYS_futex,        20, { 0, 128 /* FUTEX_PRIVATE_FLAG */ } },
+        { SYS_epoll_wait,   12, { 4, 0, 64, ~0ULL } },
+        { SYS_recvfrom,      8, { 6, 0, 65536 } },
+        { SYS_sendto,        8, { 6, 0, 512, 0x4000 /* MSG_NOSIGNAL */ } },
+        { SYS_mmap,          4, { 0, 1 << 20, 3, 0x22, ~0ULL } },
+        { SYS_munmap,        3, { 0, 1 << 20 } },
+        { SYS_openat,        3, { uint64_t(-100) /* AT_FDCWD */, 0, 0x80000 /* O_CLOEXEC */ } },
+        { SYS_fstat,         3, { 7 } },
+        { SYS_close,         3, { 7 } },
+        { SYS_brk,           1, { 0 } },
+        { SYS_getpid,        1, {} },
+    };
+
+    void synth(char const *path, uint64_t count, unsigned threads, uint32_t seed,
+               seccomp::TraceOptions const &opts)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<unsigned> weights;
+        for (Call const &c : workload) {
+            weights.push_back(c.weight);
+        }
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        std::exponential_distribution<double> gap(1.0 / 2000);  // 2us between calls on average
+        std::uniform_int_distribution<unsigned> thread(0, threads - 1);
+        std::uniform_int_distribution<unsigned> small(0, 63);
+
+        seccomp::TraceWriter w(path, opts);
+        uint64_t now = 1000000000;
+
+        for (uint64_t i = 0; i < count; i++) {
+            Call const &c = workload[pick(rng)];
+            TraceRecord r { now, 1000 + thread(rng), uint32_t(c.nr), AUDIT_ARCH_X86_64, {} };
+            std::copy(c.args, c.args + 6, r.args);
+
+            // Sizes and descriptors move around a bit.
+            if (c.nr == SYS_read || c.nr == SYS_write || c.nr == SYS_recvfrom || c.nr == SYS_sendto) {
+                r.args[0] += small(rng) % 8;
+                r.args[2] += small(rng) * 16;
+            }
+
+            w.append(r);
+            now += 1 + uint64_t(gap(rng));
+        }
+    }
+
+    void print(TraceRecord const &r)
+    {
+        char const *name = seccomp::syscall_name(r.nr);
+        printf("%" PRIu64 " %u %s(", r.timestamp, r.pid, name ? name : std::to_string(r.nr).c_str());
+        for (unsigned i = 0; i < 6; i++) {
+            printf(i ? ", %#" PRIx64 : "%#" PRIx64, r.args[i]);
+        }
+        printf(")%s\n", r.arch == AUDIT_ARCH_X86_64 ? "" : " foreign arch");
+    }
+
+    void stat(char const *path)
+    {
+        seccomp::TraceReader t(path);
+
+        struct ::stat st;
+        if (::stat(path, &st) != 0) {
+            seccomp::die_errno(path);
+        }
+
+        uint64_t first = 0, last = 0, raw = 0;
+        if (t.blocks() > 0) {
+            first = t.block(0).first_timestamp;
+            std::vector<TraceRecord> records;
+            std::vector<uint8_t> scratch;
+            t.decode(t.blocks() - 1, records, scratch);
+            last = records.back().timestamp;
+        }
+        raw = t.records() * sizeof(TraceRecord);
+
+        printf("%s: %" PRIu64 " records in %zu blocks, %" PRIu64 " ns\n",
+               path, t.records(), t.blocks(), last - first);
+        printf("%lld bytes, %.2f bytes per record, %.1fx smaller than raw records\n",
+               static_cast<long long>(st.st_size),
+               t.records() ? double(st.st_size) / t.records() : 0.0,
+               st.st_size ? double(raw) / st.st_size : 0.0);
+    }
+
+}
+
+int main(int argc, char **argv)
+{
+    std::string const cmd = argc > 1 ? argv[1] : "";
+
+    if (cmd == "synth" && argc >= 3) {
+        uint64_t count = 1000000;
+        unsigned threads = 4;
+        uint32_t seed = 1;
+        seccomp::TraceOptions opts;
+
+        for (int i = 3; i < argc; i++) {
+            std::string const opt = argv[i];
+
+            if (opt == "--records" && i + 1 < argc) {
+                count = strtoull(argv[++i], nullptr, 0);
+            } else if (opt == "--threads" && i + 1 < argc) {
+                threads = std::max(1, atoi(argv[++i]));
+            } else if (opt == "--seed" && i + 1 < argc) {
+                seed = strtoul(argv[++i], nullptr, 0);
+            } else if (opt == "--block" && i + 1 < argc) {
+                opts.block_records = std::max(1ul, strtoul(argv[++i], nullptr, 0));
+            } else if (opt == "--level" && i + 1 < argc) {
+                opts.compression = atoi(argv[++i]);
+            } else {
+                argc = 0;
+            }
+        }
+
+        if (argc != 0) {
+            synth(argv[2], count, threads, seed, opts);
+            return EXIT_SUCCESS;
+        }
+    } else if (cmd == "dump" && argc >= 3) {
+        // "-" streams from stdin, anything else is mmap'ed and can start at a given time.
+        if (std::string(argv[2]) == "-") {
+            seccomp::TraceStream s(stdin, "stdin");
+            TraceRecord r;
+            while (s.next(r)) {
+                print(r);
+            }
+            return EXIT_SUCCESS;
+        }
+
+        seccomp::TraceReader t(argv[2]);
+        uint64_t const from = argc > 3 ? strtoull(argv[3], nullptr, 0) : 0;
+        uint64_t left = argc > 4 ? strtoull(argv[4], nullptr, 0) : UINT64_MAX;
+
+        std::vector<TraceRecord> records;
+        std::vector<uint8_t> scratch;
+        for (size_t b = t.find_block(from); b < t.blocks() && left; b++) {
+            t.decode(b, records, scratch);
+            for (TraceRecord const &r : records) {
+                if (r.timestamp >= from && left) {
+                    print(r);
+                    left--;
+                }
+            }
+        }
+        return EXIT_SUCCESS;
+    } else if (cmd == "stat" && argc == 3) {
+        stat(argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    fprintf(stderr,
+            "usage: %s synth OUT [--records N] [--threads N] [--seed N] [--block N] [--level N]\n"
+            "       %s dump TRACE|- [FROM_NS [COUNT]]\n"
+            "       %s stat TRACE\n",
+            argv[0], argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
+
+// EOF
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "seccomp_child.hpp"
+
+/// Sandboxes forked and filtered ahead of time, so that a launch only hands a job to one that is
+/// already waiting.
+///
+/// Each worker closes every descriptor but stdio and a socket, then blocks reading its job from
+/// that socket, which its filter is extended to allow, runs the pool's handler on it and exits. A
+/// manager thread counts launches per tick and forecasts them with a level and a trend, each
+/// smoothed exponentially (Holt's method). It keeps as many workers idle as the forecast says will
+/// be asked for while replacements are forked, plus twice the usual forecast error, within a memory
+/// budget. A trend only shows once a burst has begun, so it also keeps enough for the busiest tick
+/// of the recent past, which is forgotten within a fraction of a second. Workers beyond that for a
+/// while are killed.
+///
+/// Workers are not told when the process that forked them dies: idle ones are then left blocked
+/// in read until killed.
+
+namespace seccomp {
+
+    struct WarmPoolLimits {
+        /// Memory all idle workers may take, and what one takes.
+        size_t memory_budget = 64 << 20;
+        size_t worker_bytes = 1 << 20;
+
+        /// Idle workers kept whatever the forecast says. Without a forecast, exactly this many.
+        size_t min_idle = 0;
+        bool predictive = true;
+
+        std::chrono::milliseconds tick { 10 };
+
+        /// How fast the level and the trend of launches per tick follow what is measured.
+        double alpha = 0.3, beta = 0.1;
+
+        /// Ticks until the busiest one counts half. Longer keeps workers for bursts that come
+        /// further apart, at the cost of keeping them through quiet stretches.
+        unsigned peak_half_life = 20;
+
+        /// Ticks with too many idle workers before the surplus is killed.
+        unsigned retire_after = 10;
+    };
+
+    struct WarmPoolStats {
+        uint64_t hits = 0, misses = 0;
+        uint64_t spawned = 0, retired = 0;
+
+        size_t idle = 0, target = 0;
+
+        /// Launches per second the forecast expects, and how long forking a worker takes.
+        double forecast = 0;
+        double spawn_us = 0;
+    };
+
+    class WarmPool {
+        struct Worker {
+            std::unique_ptr<SeccompChild> child;
+            int job_fd;
+
+            /// Which of the pool's filters it runs under.
+            uint64_t generation;
+        };
+
+        std::vector<sock_filter> filter_;
+        std::function<int(std::string const &)> const handler_;
+        WarmPoolLimits const limits_;
+
+        std::mutex lock_;
+        std::condition_variable wake_;
+        std::deque<Worker> idle_;  // oldest first
+        uint64_t generation_ = 0;
+        uint64_t launches_ = 0;
+        bool stop_ = false;
+        WarmPoolStats stats_;
+
+        // The forecast, in launches per tick.
+        double level_ = 0, trend_ = 0, error_ = 0, peak_ = 0;
+        unsigned surplus_ticks_ = 0;
+
+        std::thread manager_;
+
+        /// The filter with a rule in front that lets the worker read its job from fd.
+        static std::vector<sock_filter> with_job_read(std::vector<sock_filter> const &filter, int fd)
+        {
+            std::vector<sock_filter> f {
+                BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, arch))),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 7),
+                BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, nr))),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_read, 0, 5),
+                BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, (offsetof(struct seccomp_data, args))),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, uint32_t(fd), 0, 3),
+                BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, sizeof(uint32_t) + (offsetof(struct seccomp_data, args))),
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+                BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+            };
+            f.insert(f.end(), filter.begin(), filter.end());
+            return f;
+        }
+
+        static bool read_all(int fd, void *buf, size_t size)
+        {
+            char *p = static_cast<char *>(buf);
+            while (size > 0) {
+                ssize_t const n = read(fd, p, size);
+                if (n <= 0) {
+                    return false;
+                }
+                p += n;
+                size -= size_t(n);
+            }
+            return true;
+        }
+
+        Worker spawn()
+        {
+            std::vector<sock_filter> filter;
+            uint64_t generation;
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                filter = filter_;
+                generation = generation_;
+            }
+
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+                die_errno("socketpair");
+            }
+
+            auto const start = std::chrono::steady_clock::now();
+            int const job = fds[1];
+            std::function<int(std::string const &)> const &handler = handler_;
+
+            Worker w { std::unique_ptr<SeccompChild>(new SeccompChild(with_job_read(filter, job))), fds[0],
+                       generation };
+            w.child->close_fds_but(job);
+            w.child->run([job, &handler] {
+                uint32_t size;
+                if (!read_all(job, &size, sizeof(size))) {
+                    return EXIT_FAILURE;
+                }
+                std::string s(size, '\0');
+                if (!read_all(job, &s[0], size)) {
+                    return EXIT_FAILURE;
+                }
+                return handler(s);
+            });
+            ::close(fds[1]);
+
+            double const us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            std::lock_guard<std::mutex> l(lock_);
+            stats_.spawned++;
+            stats_.spawn_us = stats_.spawn_us == 0 ? us : stats_.spawn_us + (us - stats_.spawn_us) / 8;
+            return w;
+        }
+
+        static void retire(Worker &w)
+        {
+            kill(w.child->pid(), SIGKILL);
+            ::close(w.job_fd);
+            w.child.reset();
+        }
+
+        static bool send_all(int fd, void const *buf, size_t size)
+        {
+            char const *p = static_cast<char const *>(buf);
+            while (size > 0) {
+                ssize_t const n = send(fd, p, size, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return false;
+                }
+                p += n;
+                size -= size_t(n);
+            }
+            return true;
+        }
+
+        /// Idle workers wanted for the next ticks, with the forecast updated by the launches of the
+        /// last one.
+        size_t forecast(uint64_t launches)
+        {
+            double const n = double(launches);
+            double const expected = std::max(0.0, level_ + trend_);
+            error_ += limits_.alpha * (std::fabs(n - expected) - error_);
+
+            double const previous = level_;
+            level_ = limits_.alpha * n + (1 - limits_.alpha) * (level_ + trend_);
+            trend_ = limits_.beta * (level_ - previous) + (1 - limits_.beta) * trend_;
+            peak_ = std::max(n, peak_ * std::exp2(-1.0 / std::max(1u, limits_.peak_half_life)));
+
+            size_t const most = limits_.memory_budget / std::max<size_t>(1, limits_.worker_bytes);
+            stats_.forecast = level_ * 1000.0 / limits_.tick.count();
+            if (!limits_.predictive) {
+                return std::min(most, limits_.min_idle);
+            }
+
+            // Launches until replacements for them are forked.
+            double const tick_us = 1000.0 * limits_.tick.count();
+            unsigned const horizon = 1 + unsigned(std::ceil(stats_.spawn_us / tick_us));
+            double wanted = 2 * error_;
+            for (unsigned h = 1; h <= horizon; h++) {
+                wanted += std::max(0.0, level_ + h * trend_);
+            }
+            wanted = std::max(wanted, peak_ * (1 + stats_.spawn_us / tick_us));
+            return std::min(most, std::max(limits_.min_idle, size_t(std::ceil(wanted))));
+        }
+
+        void manage()
+        {
+            uint64_t counted = 0;
+            std::unique_lock<std::mutex> l(lock_);
+
+            while (!stop_) {
+                size_t const target = forecast(launches_ - counted);
+                counted = launches_;
+                stats_.target = target;
+
+                // Grow right away, shrink only once the surplus has lasted.
+                surplus_ticks_ = idle_.size() > target ? surplus_ticks_ + 1 : 0;
+                std::vector<Worker> surplus;
+                if (surplus_ticks_ >= limits_.retire_after) {
+                    while (idle_.size() > target) {
+                        surplus.push_back(std::move(idle_.front()));
+                        idle_.pop_front();
+                        stats_.retired++;
+                    }
+                    surplus_ticks_ = 0;
+                }
+
+                size_t missing = target > idle_.size() ? target - idle_.size() : 0;
+                l.unlock();
+                for (Worker &w : surplus) {
+                    retire(w);
+                }
+                while (missing-- > 0) {
+                    Worker w = spawn();
+                    std::unique_lock<std::mutex> g(lock_);
+                    if (w.generation == generation_) {
+                        idle_.push_back(std::move(w));
+                        continue;
+                    }
+                    // The filter changed while it was forked.
+                    g.unlock();
+                    retire(w);
+                }
+                l.lock();
+
+                stats_.idle = idle_.size();
+                wake_.wait_for(l, limits_.tick, [&] { return stop_; });
+            }
+        }
+
+    public:
+        /// Workers run handler on the jobs they are given, under filter until set_filter().
+        WarmPool(std::vector<sock_filter> filter, std::function<int(std::string const &)> handler,
+                 WarmPoolLimits const &limits = WarmPoolLimits())
+            : filter_(std::move(filter)), handler_(std::move(handler)), limits_(limits)
+        {
+            manager_ = std::thread([this] { manage(); });
+        }
+
+        WarmPool(WarmPool const &) = delete;
+        WarmPool &operator=(WarmPool const &) = delete;
+
+        /// Idle workers are killed. Those handed out are their callers'.
+        ~WarmPool()
+        {
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            manager_.join();
+            for (Worker &w : idle_) {
+                retire(w);
+            }
+        }
+
+        /// Run workers forked from now on under filter, and kill the idle ones that run under
+        /// another. The manager forks their replacements on its next tick.
+        void set_filter(std::vector<sock_filter> filter)
+        {
+            std::vector<Worker> stale;
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                if (filter.size() == filter_.size() &&
+                    memcmp(filter.data(), filter_.data(), filter.size() * sizeof(sock_filter)) == 0) {
+                    return;
+                }
+                filter_ = std::move(filter);
+                generation_++;
+                for (Worker &w : idle_) {
+                    stale.push_back(std::move(w));
+                    stats_.retired++;
+                }
+                idle_.clear();
+                stats_.idle = 0;
+            }
+            for (Worker &w : stale) {
+                retire(w);
+            }
+        }
+
+        /// A child running the handler on job: one that was waiting if there is one, else one
+        /// forked now. hit says which.
+        std::unique_ptr<SeccompChild> acquire(std::string const &job, bool *hit = nullptr)
+        {
+            uint32_t const size = uint32_t(job.size());
+
+            // Counted once, however many workers turn out to have died.
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                launches_++;
+            }
+
+            for (;;) {
+                Worker w;
+                bool warm = false;
+                {
+                    std::lock_guard<std::mutex> l(lock_);
+                    if (!idle_.empty()) {
+                        w = std::move(idle_.back());
+                        idle_.pop_back();
+                        warm = true;
+                    }
+                    stats_.idle = idle_.size();
+                }
+                if (!warm) {
+                    w = spawn();
+                }
+
+                bool const sent = send_all(w.job_fd, &size, sizeof(size)) && send_all(w.job_fd, job.data(), job.size());
+                if (!sent) {
+                    // The worker died waiting, try another.
+                    retire(w);
+                    continue;
+                }
+                ::close(w.job_fd);
+                {
+                    std::lock_guard<std::mutex> l(lock_);
+                    (warm ? stats_.hits : stats_.misses)++;
+                }
+                if (hit != nullptr) {
+                    *hit = warm;
+                }
+                return std::move(w.child);
+            }
+        }
+
+        WarmPoolStats stats()
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            return stats_;
+        }
+    };
+
+}
+
+// EOF
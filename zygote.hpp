@@ -0,0 +1,707 @@
+#pragma once
+
+#include <sys/poll.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bpf_specialize.hpp"
+#include "policy_compiler.hpp"
+#include "seccomp_child.hpp"
+
+/// Sandboxes forked from a process that already runs under their filter.
+///
+/// A spawner is forked when the manager is made, while the process is still small, and closes the
+/// descriptors it inherited. For each distinct filter a launch asks for, the spawner forks a zygote,
+/// which installs the filter and then waits for jobs. Each job is run by a child the zygote forks, which inherits the filter instead of
+/// compiling and installing it.
+///
+/// The zygote needs a few system calls the filter may not allow: reading jobs, reporting children,
+/// forking and reaping them. Its filter is the tenant's with those allowed in front. Its children
+/// take them back with a second, small filter that decides just those calls as the tenant's does
+/// and allows everything else: stacked, the two decide exactly what the tenant's filter would.
+///
+/// Zygotes whose children have all exited are stopped, least recently used first, while all of them
+/// together take more memory than allowed. What one takes is its proportional set size.
+
+namespace seccomp {
+
+    struct ZygoteLimits {
+        /// Memory all zygotes may take, and what one is taken to take when /proc does not say.
+        size_t memory_budget = 64 << 20;
+        size_t zygote_bytes = 1 << 20;
+
+        /// Longest job, in bytes.
+        size_t max_job = 64 << 10;
+    };
+
+    struct ZygoteStats {
+        /// Launches that found their zygote running, and those that started it.
+        uint64_t hits = 0, misses = 0;
+        uint64_t stopped = 0;
+
+        size_t zygotes = 0, bytes = 0;
+    };
+
+    namespace zygote_detail {
+
+        enum class Kind : uint32_t {
+            READY,
+            STARTED,
+            EXITED,
+        };
+
+        /// What a zygote sends back, one packet each.
+        struct Report {
+            Kind kind;
+            int32_t pid;
+            int32_t status;
+        };
+
+        /// System calls the zygote makes, and the first arguments it makes them with. None means any.
+        struct Call {
+            uint32_t nr;
+            std::vector<uint32_t> arg0;
+        };
+
+        inline std::vector<Call> calls(int ctrl, int sig)
+        {
+            return {
+                { SYS_read, { uint32_t(ctrl), uint32_t(sig) } },
+                { SYS_write, { uint32_t(ctrl) } },
+                { SYS_close, { uint32_t(ctrl), uint32_t(sig) } },
+                { SYS_poll, {} },
+                { SYS_ppoll, {} },
+                { SYS_wait4, {} },
+                { SYS_clone, {} },
+                { SYS_set_robust_list, {} },
+                { SYS_rt_sigprocmask, {} },
+                { SYS_prctl, { PR_SET_SECCOMP } },
+                { SYS_exit_group, {} },
+            };
+        }
+
+        /// filter with calls allowed in front of it. File descriptors and prctl options are ints,
+        /// so only the low half of the first argument is compared.
+        inline std::vector<sock_filter> with_calls(std::vector<sock_filter> const &filter, std::vector<Call> const &calls)
+        {
+            compiler_detail::Assembler a;
+            int const entry = a.label(), allow = a.label();
+            std::vector<int> at(filter.size());
+            for (int &l : at) {
+                l = a.label();
+            }
+
+            a.place(entry);
+            a.stmt(entry, BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+            a.jump(entry, BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, compiler_detail::Assembler::NEXT, at[0]);
+
+            int l = entry;
+            for (Call const &c : calls) {
+                int const next = a.label();
+                a.stmt(l, BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+                a.jump(l, BPF_JMP | BPF_JEQ | BPF_K, c.nr, compiler_detail::Assembler::NEXT, next);
+                if (c.arg0.empty()) {
+                    a.jump(l, BPF_JMP | BPF_JA, 0, allow, compiler_detail::Assembler::NEXT);
+                } else {
+                    a.stmt(l, BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args));
+                    for (uint32_t v : c.arg0) {
+                        a.jump(l, BPF_JMP | BPF_JEQ | BPF_K, v, allow, compiler_detail::Assembler::NEXT);
+                    }
+                    a.jump(l, BPF_JMP | BPF_JA, 0, at[0], compiler_detail::Assembler::NEXT);
+                }
+                a.place(next);
+                l = next;
+            }
+            a.jump(l, BPF_JMP | BPF_JA, 0, at[0], compiler_detail::Assembler::NEXT);
+
+            a.place(allow);
+            a.stmt(allow, BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+            // The filter itself, with its jumps to labels so that they still reach.
+            for (size_t i = 0; i < filter.size(); i++) {
+                sock_filter const &insn = filter[i];
+                a.place(at[i]);
+                if (BPF_CLASS(insn.code) != BPF_JMP) {
+                    a.stmt(at[i], insn.code, insn.k);
+                } else if (BPF_OP(insn.code) == BPF_JA) {
+                    a.jump(at[i], insn.code, 0, at[i + 1 + insn.k], compiler_detail::Assembler::NEXT);
+                } else {
+                    a.jump(at[i], insn.code, insn.k, at[i + 1 + insn.jt], at[i + 1 + insn.jf]);
+                }
+            }
+            return a.assemble();
+        }
+
+        /// Install filter in this process. No new privileges must already be set.
+        inline bool install(std::vector<sock_filter> const &filter)
+        {
+            sock_fprog const prog = {
+                .len = static_cast<unsigned short>(filter.size()),
+                .filter = const_cast<sock_filter *>(filter.data()),
+            };
+            return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) == 0;
+        }
+
+        inline uint64_t hash(std::vector<sock_filter> const &filter)
+        {
+            // FNV-1a, an instruction at a time
+            uint64_t h = 0xcbf29ce484222325ULL;
+            for (sock_filter const &insn : filter) {
+                h = (h ^ (uint64_t(insn.code) | uint64_t(insn.jt) << 16 | uint64_t(insn.jf) << 24 |
+                          uint64_t(insn.k) << 32)) * 0x100000001b3ULL;
+                h ^= h >> 32;
+            }
+            return h;
+        }
+
+        inline bool same(std::vector<sock_filter> const &a, std::vector<sock_filter> const &b)
+        {
+            return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(sock_filter)) == 0;
+        }
+
+        /// Proportional set size of pid, or 0 if /proc does not say.
+        inline size_t pss(pid_t pid)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", int(pid));
+            FILE *f = fopen(path, "r");
+            if (f == nullptr) {
+                return 0;
+            }
+            char line[256];
+            unsigned long kb = 0;
+            while (fgets(line, sizeof(line), f) != nullptr && sscanf(line, "Pss: %lu kB", &kb) != 1) {
+            }
+            fclose(f);
+            return size_t(kb) << 10;
+        }
+
+        struct Zygote {
+            std::vector<sock_filter> filter;
+            int ctrl = -1;
+            pid_t pid = 0;
+            size_t bytes = 0;
+
+            /// Guarded by the manager's lock.
+            uint64_t used = 0;
+            unsigned launching = 0;
+
+            /// One job is sent at a time, so STARTED reports come in the order of the launches.
+            std::mutex send;
+
+            std::mutex lock;
+            std::condition_variable changed;
+            std::deque<pid_t> started;
+            std::map<pid_t, int> exited;
+            size_t running = 0;
+            bool dead = false;
+
+            std::thread reader;
+
+            void read_reports()
+            {
+                Report r;
+                while (recv(ctrl, &r, sizeof(r), 0) == ssize_t(sizeof(r))) {
+                    std::lock_guard<std::mutex> l(lock);
+                    if (r.kind == Kind::STARTED) {
+                        started.push_back(r.pid);
+                        running += r.pid > 0;
+                    } else if (r.kind == Kind::EXITED) {
+                        exited[r.pid] = r.status;
+                        running--;
+                    }
+                    changed.notify_all();
+                }
+                std::lock_guard<std::mutex> l(lock);
+                dead = true;
+                changed.notify_all();
+            }
+        };
+
+    }
+
+    struct ZygoteFilters {
+        std::vector<sock_filter> zygote, child;
+    };
+
+    /// What a zygote for filter installs, with ctrl and sig as its descriptors, and what its children
+    /// add. Stacked, they decide as filter does.
+    inline ZygoteFilters zygote_filters(std::vector<sock_filter> const &filter, int ctrl, int sig)
+    {
+        std::vector<zygote_detail::Call> const calls = zygote_detail::calls(ctrl, sig);
+        std::vector<uint32_t> nrs;
+        for (zygote_detail::Call const &c : calls) {
+            nrs.push_back(c.nr);
+        }
+        return { zygote_detail::with_calls(filter, calls), restrict_to(filter, AUDIT_ARCH_X86_64, nrs) };
+    }
+
+    /// A child forked by a zygote. It is not a child of this process, so it is waited for through
+    /// the zygote.
+    class ZygoteChild {
+        std::shared_ptr<zygote_detail::Zygote> zygote_;
+        pid_t pid_;
+        bool waited_ = false;
+
+    public:
+        ZygoteChild(std::shared_ptr<zygote_detail::Zygote> zygote, pid_t pid)
+            : zygote_(std::move(zygote)), pid_(pid)
+        {}
+
+        ZygoteChild(ZygoteChild const &) = delete;
+        ZygoteChild &operator=(ZygoteChild const &) = delete;
+
+        pid_t pid() const { return pid_; }
+
+        /// Exit status as ForkedChild::wait_for_child() gives it, or -1 if the zygote stopped first.
+        int wait_for_child()
+        {
+            waited_ = true;
+            std::unique_lock<std::mutex> l(zygote_->lock);
+            zygote_->changed.wait(l, [this] { return zygote_->dead || zygote_->exited.count(pid_) != 0; });
+            auto const it = zygote_->exited.find(pid_);
+            if (it == zygote_->exited.end()) {
+                return -1;
+            }
+            int const status = it->second;
+            zygote_->exited.erase(it);
+            return status;
+        }
+
+        ~ZygoteChild()
+        {
+            if (!waited_) {
+                wait_for_child();
+            }
+        }
+    };
+
+    class ZygoteManager {
+        using Zygote = zygote_detail::Zygote;
+
+        std::function<int(std::string const &)> const handler_;
+        ZygoteLimits const limits_;
+
+        pid_t spawner_ = 0;
+        int spawner_fd_ = -1;
+        std::mutex spawn_lock_;
+
+        /// A zygote being started. Launches for the same filter wait for it instead of starting
+        /// another.
+        struct Starting {
+            std::vector<sock_filter> filter;
+            bool done = false;
+            std::shared_ptr<Zygote> zygote;
+        };
+
+        std::mutex lock_;
+        std::unordered_multimap<uint64_t, std::shared_ptr<Zygote>> zygotes_;
+        std::unordered_multimap<uint64_t, std::shared_ptr<Starting>> starting_;
+        std::condition_variable started_;
+        uint64_t clock_ = 0;
+        ZygoteStats stats_;
+
+        [[noreturn]] void zygote(int ctrl, std::vector<sock_filter> const &filter)
+        {
+            using namespace zygote_detail;
+
+            // Children are reaped here, and noticed through a signalfd instead of a handler.
+            signal(SIGCHLD, SIG_DFL);
+            sigset_t chld, old;
+            sigemptyset(&chld);
+            sigaddset(&chld, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &chld, &old);
+            int const sig = signalfd(-1, &chld, 0);
+            if (sig < 0) {
+                die_errno("signalfd");
+            }
+
+            ZygoteFilters const filters = zygote_filters(filter, ctrl, sig);
+            // Jobs come after a byte, so that an empty one is not taken for the end of the stream.
+            std::vector<char> job(1 + limits_.max_job);
+
+            Report r { Kind::READY, getpid(), 0 };
+            if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 || !install(filters.zygote)) {
+                r.pid = -1;
+            }
+            if (write(ctrl, &r, sizeof(r)) != ssize_t(sizeof(r)) || r.pid < 0) {
+                _exit(EXIT_FAILURE);
+            }
+
+            // Only calls() and what filter allows from here on.
+            for (;;) {
+                pollfd fds[2] = { { ctrl, POLLIN, 0 }, { sig, POLLIN, 0 } };
+                if (poll(fds, 2, -1) < 0) {
+                    continue;
+                }
+
+                if (fds[1].revents != 0) {
+                    signalfd_siginfo si;
+                    if (read(sig, &si, sizeof(si)) < 0) {
+                        // Reaped below anyway.
+                    }
+                    int status;
+                    pid_t pid;
+                    while ((pid = wait4(-1, &status, WNOHANG, nullptr)) > 0) {
+                        Report e { Kind::EXITED, pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1 };
+                        if (write(ctrl, &e, sizeof(e)) != ssize_t(sizeof(e))) {
+                            _exit(EXIT_FAILURE);
+                        }
+                    }
+                }
+
+                if (fds[0].revents == 0) {
+                    continue;
+                }
+                ssize_t const n = read(ctrl, job.data(), job.size());
+                if (n <= 0) {
+                    _exit(EXIT_SUCCESS);
+                }
+
+                pid_t const pid = fork();
+                if (pid == 0) {
+                    close(ctrl);
+                    close(sig);
+                    sigprocmask(SIG_SETMASK, &old, nullptr);
+                    if (!install(filters.child)) {
+                        _exit(EXIT_FAILURE);
+                    }
+                    _exit(handler_(std::string(job.data() + 1, size_t(n) - 1)));
+                }
+                Report s { Kind::STARTED, pid, 0 };
+                if (write(ctrl, &s, sizeof(s)) != ssize_t(sizeof(s))) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        /// Receives filters with the socket to talk to their zygote over, and forks zygotes for them.
+        [[noreturn]] void spawner(int fd)
+        {
+            // Zygotes are reaped by the kernel.
+            signal(SIGCHLD, SIG_IGN);
+
+            // Nothing the process had open when the manager was made reaches zygotes or children.
+            close_fds_above_stderr_but(fd);
+
+            std::vector<sock_filter> filter(BPF_MAXINSNS);
+            for (;;) {
+                iovec iov = { filter.data(), filter.size() * sizeof(sock_filter) };
+                alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+                msghdr msg = {};
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                ssize_t const n = recvmsg(fd, &msg, 0);
+                if (n <= 0) {
+                    _exit(EXIT_SUCCESS);
+                }
+                cmsghdr const *c = CMSG_FIRSTHDR(&msg);
+                if (c == nullptr || c->cmsg_type != SCM_RIGHTS) {
+                    continue;
+                }
+                int ctrl;
+                memcpy(&ctrl, CMSG_DATA(c), sizeof(ctrl));
+
+                if (fork() == 0) {
+                    close(fd);
+                    zygote(ctrl, std::vector<sock_filter>(filter.begin(), filter.begin() + n / sizeof(sock_filter)));
+                }
+                close(ctrl);
+            }
+        }
+
+        /// A zygote running filter, or nullptr if it did not start.
+        std::shared_ptr<Zygote> start(std::vector<sock_filter> const &filter)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+                die_errno("socketpair");
+            }
+
+            iovec iov = { const_cast<sock_filter *>(filter.data()), filter.size() * sizeof(sock_filter) };
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(c), &fds[1], sizeof(int));
+
+            bool sent;
+            {
+                std::lock_guard<std::mutex> l(spawn_lock_);
+                sent = sendmsg(spawner_fd_, &msg, MSG_NOSIGNAL) == ssize_t(iov.iov_len);
+            }
+            close(fds[1]);
+
+            zygote_detail::Report r;
+            if (!sent || recv(fds[0], &r, sizeof(r), 0) != ssize_t(sizeof(r)) || r.kind != zygote_detail::Kind::READY ||
+                r.pid <= 0) {
+                close(fds[0]);
+                return nullptr;
+            }
+
+            auto z = std::make_shared<Zygote>();
+            z->filter = filter;
+            z->ctrl = fds[0];
+            z->pid = r.pid;
+            size_t const bytes = zygote_detail::pss(r.pid);
+            z->bytes = bytes != 0 ? bytes : limits_.zygote_bytes;
+            z->reader = std::thread([z] { z->read_reports(); });
+            return z;
+        }
+
+        static void stop(Zygote &z)
+        {
+            shutdown(z.ctrl, SHUT_RDWR);
+            z.reader.join();
+            close(z.ctrl);
+        }
+
+        /// Take the least recently used zygotes without children out, except keep, while all take
+        /// more than the budget.
+        std::vector<std::shared_ptr<Zygote>> trim(Zygote const *keep)
+        {
+            std::vector<std::shared_ptr<Zygote>> out;
+            for (;;) {
+                size_t bytes = 0;
+                auto victim = zygotes_.end();
+                for (auto it = zygotes_.begin(); it != zygotes_.end(); ++it) {
+                    Zygote &z = *it->second;
+                    bytes += z.bytes;
+
+                    std::lock_guard<std::mutex> l(z.lock);
+                    bool const idle = z.launching == 0 && z.running == 0;
+                    if (&z != keep && idle && (victim == zygotes_.end() || z.used < victim->second->used)) {
+                        victim = it;
+                    }
+                }
+                stats_.bytes = bytes;
+                if (bytes <= limits_.memory_budget || victim == zygotes_.end()) {
+                    break;
+                }
+                out.push_back(victim->second);
+                zygotes_.erase(victim);
+                stats_.stopped++;
+            }
+            stats_.zygotes = zygotes_.size();
+            return out;
+        }
+
+        /// The zygote for filter, started if there is none, with a launch counted on it. Only one
+        /// launch starts it; others for the same filter wait until it has.
+        std::shared_ptr<Zygote> acquire(std::vector<sock_filter> const &filter, uint64_t key)
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            std::shared_ptr<Starting> mine;
+            while (mine == nullptr) {
+                auto const range = zygotes_.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (zygote_detail::same(it->second->filter, filter)) {
+                        it->second->launching++;
+                        it->second->used = ++clock_;
+                        stats_.hits++;
+                        return it->second;
+                    }
+                }
+
+                std::shared_ptr<Starting> other;
+                auto const pending = starting_.equal_range(key);
+                for (auto it = pending.first; it != pending.second; ++it) {
+                    if (zygote_detail::same(it->second->filter, filter)) {
+                        other = it->second;
+                    }
+                }
+                if (other != nullptr) {
+                    started_.wait(l, [&] { return other->done; });
+                    if (other->zygote == nullptr) {
+                        return nullptr;
+                    }
+                    continue;  // it is in zygotes_ now, unless it has died since
+                }
+
+                mine = std::make_shared<Starting>();
+                mine->filter = filter;
+                starting_.emplace(key, mine);
+            }
+            l.unlock();
+
+            std::shared_ptr<Zygote> z = start(filter);
+
+            std::vector<std::shared_ptr<Zygote>> stopped;
+            l.lock();
+            auto const pending = starting_.equal_range(key);
+            for (auto it = pending.first; it != pending.second; ++it) {
+                if (it->second == mine) {
+                    starting_.erase(it);
+                    break;
+                }
+            }
+            mine->done = true;
+            mine->zygote = z;
+            started_.notify_all();
+            if (z == nullptr) {
+                return nullptr;
+            }
+
+            z->launching++;
+            z->used = ++clock_;
+            zygotes_.emplace(key, z);
+            stats_.misses++;
+            stopped = trim(z.get());
+            l.unlock();
+            for (auto const &s : stopped) {
+                stop(*s);
+            }
+            return z;
+        }
+
+        void forget(std::shared_ptr<Zygote> const &z, uint64_t key)
+        {
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> l(lock_);
+                auto const range = zygotes_.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (it->second == z) {
+                        zygotes_.erase(it);
+                        found = true;
+                        break;
+                    }
+                }
+                stats_.zygotes = zygotes_.size();
+            }
+            if (found) {
+                stop(*z);
+            }
+        }
+
+    public:
+        /// Children run handler on the jobs they are launched with. The spawner is forked here, so
+        /// the manager is best made early, before the process has grown.
+        explicit ZygoteManager(std::function<int(std::string const &)> handler,
+                               ZygoteLimits const &limits = ZygoteLimits())
+            : handler_(std::move(handler)), limits_(limits)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+                die_errno("socketpair");
+            }
+            spawner_ = fork();
+            if (spawner_ < 0) {
+                die_errno("fork");
+            }
+            if (spawner_ == 0) {
+                close(fds[0]);
+                spawner(fds[1]);
+            }
+            close(fds[1]);
+            spawner_fd_ = fds[0];
+        }
+
+        ZygoteManager(ZygoteManager const &) = delete;
+        ZygoteManager &operator=(ZygoteManager const &) = delete;
+
+        /// Zygotes are stopped. Their children keep running, but can no longer be waited for.
+        ~ZygoteManager()
+        {
+            for (auto &e : zygotes_) {
+                stop(*e.second);
+            }
+            close(spawner_fd_);
+            waitpid(spawner_, nullptr, 0);
+        }
+
+        /// A child running the handler on job under filter, forked by the zygote for filter. nullptr
+        /// if job is longer than ZygoteLimits::max_job, or no zygote could be started or fork.
+        std::unique_ptr<ZygoteChild> launch(std::vector<sock_filter> const &filter, std::string const &job)
+        {
+            if (job.size() > limits_.max_job) {
+                return nullptr;
+            }
+            uint64_t const key = zygote_detail::hash(filter);
+
+            // A zygote that died since it was last used is replaced, once.
+            for (unsigned attempt = 0; attempt < 2; attempt++) {
+                std::shared_ptr<Zygote> z = acquire(filter, key);
+                if (z == nullptr) {
+                    return nullptr;
+                }
+
+                pid_t pid = -1;
+                bool dead;
+                {
+                    std::lock_guard<std::mutex> s(z->send);
+                    char tag = 0;
+                    iovec iov[2] = { { &tag, 1 }, { const_cast<char *>(job.data()), job.size() } };
+                    msghdr msg = {};
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = 2;
+                    if (sendmsg(z->ctrl, &msg, MSG_NOSIGNAL) == ssize_t(1 + job.size())) {
+                        std::unique_lock<std::mutex> l(z->lock);
+                        z->changed.wait(l, [&] { return z->dead || !z->started.empty(); });
+                        if (!z->started.empty()) {
+                            pid = z->started.front();
+                            z->started.pop_front();
+                        }
+                    }
+                    std::lock_guard<std::mutex> l(z->lock);
+                    dead = z->dead;
+                }
+                {
+                    std::lock_guard<std::mutex> l(lock_);
+                    z->launching--;
+                }
+
+                if (pid > 0) {
+                    return std::unique_ptr<ZygoteChild>(new ZygoteChild(z, pid));
+                }
+                if (!dead) {
+                    return nullptr;  // the zygote could not fork
+                }
+                forget(z, key);
+            }
+            return nullptr;
+        }
+
+        ZygoteStats stats()
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            return stats_;
+        }
+    };
+
+}
+
+// EOF